@@ -0,0 +1,201 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hiredispool.h"
+#include "log.h"
+
+/*
+ * Acquire/release throughput of the socket pool as the number of
+ * threads grows.
+ *
+ * No redis server is needed: the pool connects to a local listening
+ * socket that never accepts, which is enough for redisConnect to succeed.
+ * Commands are never sent, so only the pool bookkeeping is measured.
+ *
+ * usage: bench_hiredispool.exe [max_threads] [millisec_per_run] [busy]
+ *                              [thread_cache_size] [pool_size]
+ *
+ * 'busy' sockets are held for the whole run to model a pool that is
+ * mostly in use.  With a pool_size below max_threads the threads queue
+ * in redis_get_socket_timed and the wait statistics are printed.
+ */
+
+static volatile int stop;
+static int dummy_reply;
+static int timed;
+
+typedef struct bench_arg {
+    REDIS_INSTANCE* inst;
+    unsigned long ops;
+    unsigned long misses;
+} BENCH_ARG;
+
+static long long now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void* bench_thread(void* p)
+{
+    BENCH_ARG* arg = p;
+    REDIS_SOCKET* sock;
+
+    while (!stop) {
+        if (timed)
+            sock = redis_get_socket_timed(arg->inst, 1000);
+        else
+            sock = redis_get_socket(arg->inst);
+        if (sock == NULL) {
+            arg->misses++;
+            continue;
+        }
+        redis_release_socket(&dummy_reply, arg->inst, sock);
+        arg->ops++;
+    }
+
+    return NULL;
+}
+
+static int listen_local(int* port)
+{
+    int fd;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+        listen(fd, 4096) < 0 ||
+        getsockname(fd, (struct sockaddr*)&sa, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    int duration = argc > 2 ? atoi(argv[2]) : 500;
+    int busy = argc > 3 ? atoi(argv[3]) : 0;
+    int cache = argc > 4 ? atoi(argv[4]) : 0;
+    int pool = argc > 5 ? atoi(argv[5]) : 0;
+    int lfd, port, nthreads, i;
+    long long start, elapsed;
+    unsigned long ops, misses;
+    pthread_t* tids;
+    BENCH_ARG* args;
+    REDIS_INSTANCE* inst;
+    REDIS_SOCKET** held;
+    REDIS_POOL_STATS stats;
+
+    LOG_CONFIG log = { 0, LOG_DEST_NULL, NULL, "bench_hiredispool", 0, 0 };
+    log_set_config(&log);
+
+    if (max_threads < 1)
+        max_threads = 1;
+    if (busy < 0)
+        busy = 0;
+    if (pool <= 0 || pool > max_threads)
+        pool = max_threads;
+    timed = pool < max_threads;
+
+    if ((lfd = listen_local(&port)) < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    REDIS_ENDPOINT endpoints[1] = { { "127.0.0.1", 0, 1 } };
+    endpoints[0].port = port;
+
+    REDIS_CONFIG conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.endpoints = endpoints;
+    conf.num_endpoints = 1;
+    conf.connect_timeout = 1000;
+    conf.net_readwrite_timeout = 1000;
+    conf.num_redis_socks = pool + busy;
+    conf.max_num_redis_socks = pool + busy;
+    conf.connect_failure_retry_delay = 1;
+    conf.thread_cache_size = cache;
+
+    if (redis_pool_create(&conf, &inst) < 0) {
+        fprintf(stderr, "redis_pool_create failed\n");
+        return 1;
+    }
+
+    tids = malloc(sizeof(pthread_t) * max_threads);
+    args = malloc(sizeof(BENCH_ARG) * max_threads);
+    held = malloc(sizeof(REDIS_SOCKET*) * (busy + 1));
+
+    for (i = 0; i < busy; i++)
+        held[i] = redis_get_socket(inst);
+
+    printf("%8s %14s %14s %10s\n", "threads", "ops/sec", "ns/op", "misses");
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        stop = 0;
+        for (i = 0; i < nthreads; i++) {
+            args[i].inst = inst;
+            args[i].ops = 0;
+            args[i].misses = 0;
+        }
+
+        start = now_usec();
+        for (i = 0; i < nthreads; i++)
+            pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+
+        usleep(duration * 1000);
+        stop = 1;
+
+        ops = misses = 0;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+            ops += args[i].ops;
+            misses += args[i].misses;
+        }
+        elapsed = now_usec() - start;
+
+        printf("%8d %14.0f %14.1f %10lu\n", nthreads,
+                ops * 1e6 / elapsed,
+                ops ? elapsed * 1e3 / ops : 0.0, misses);
+    }
+
+    if (timed && redis_pool_get_stats(inst, &stats) == 0) {
+        printf("waits %lu timeouts %lu avg wait %.1f usec max wait %lu usec\n",
+                stats.waits, stats.timeouts,
+                stats.waits ? (double)stats.wait_usec_total / stats.waits : 0.0,
+                stats.wait_usec_max);
+    }
+
+    for (i = 0; i < busy; i++)
+        if (held[i])
+            redis_release_socket(&dummy_reply, inst, held[i]);
+
+    free(held);
+    free(args);
+    free(tids);
+    redis_pool_destroy(inst);
+    close(lfd);
+
+    return 0;
+}
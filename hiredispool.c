@@ -1,25 +1,547 @@
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "hiredispool.h"
 #include "log.h"
 
 #include "hiredis/hiredis.h"
+#include "hiredis/net.h"
 
 #define MAX_REDIS_SOCKS 1000
+/* First step of the per-socket reconnect backoff, doubled per failure */
+#define REDIS_BACKOFF_BASE_MS 50
+/* Cap of the retry delay of a multiplexed connection that is down */
+#define REDIS_MUX_RETRY_MAX_MS 1000
+/* Hash slots of a Redis Cluster */
+#define REDIS_CLUSTER_SLOTS 16384
+#define REDIS_CLUSTER_MAX_NODES 256
+/* MOVED and ASK followed per command before the error goes to the caller */
+#define REDIS_CLUSTER_MAX_REDIRECTS 5
+/* Least time between two CLUSTER SLOTS reloads */
+#define REDIS_CLUSTER_REFRESH_MS 100
+/* Points on the hash ring per unit of endpoint weight */
+#define REDIS_RING_POINTS 160
+/* Pause before the sentinel subscriber tries the next sentinel */
+#define REDIS_SENTINEL_RETRY_MS 100
+/* Hedges that unused budget may save up for a burst */
+#define REDIS_HEDGE_BURST 10
+/* Round trips an endpoint needs before its p95 is trusted */
+#define REDIS_HEDGE_MIN_SAMPLES 100
+/* maintenance_interval taken when an option that needs the thread has none */
+#define REDIS_MAINTENANCE_DEFAULT_MS 1000
+
+/*
+ * Sockets released by this thread and kept out of the free map, most
+ * recent last.  Entries may have been stolen since; the socket's cached
+ * flag is the only authority on who owns it.
+ */
+typedef struct redis_thread_cache {
+    REDIS_INSTANCE* inst;
+    unsigned long generation;
+    int count;
+    REDIS_SOCKET* socks[HIREDISPOOL_MAX_THREAD_CACHE];
+} REDIS_THREAD_CACHE;
+
+/*
+ * The keys [lo, hi) of a redis_fanout call and the socket they go to.
+ */
+typedef struct redis_fanout_part {
+    REDIS_INSTANCE* inst;
+    REDIS_SOCKET* sock;
+    const char* command;
+    int keys_per_command;
+    const char** keys;
+    const size_t* keylens;
+    long lo;
+    long hi;
+    void** replies;
+    long failed;
+    pthread_t thread;
+} REDIS_FANOUT_PART;
+
+/*
+ * A thread waiting for a connection of the blocking lane.  Either it is
+ * handed one in 'sock', or 'may_connect' tells it a slot came free.
+ */
+typedef struct redis_lane_waiter {
+    pthread_cond_t cond;
+    REDIS_SOCKET* sock;
+    int may_connect;
+    struct redis_lane_waiter* next;
+} REDIS_LANE_WAITER;
+
+/*
+ * A thread parked in redis_get_socket_timed.  Lives on the waiter's stack;
+ * a releasing thread hands its socket over by setting 'sock'.
+ */
+typedef struct redis_waiter {
+    pthread_cond_t cond;
+    REDIS_SOCKET* sock;
+    int priority;/* queued behind waiters of the same or a higher class */
+    struct redis_waiter* next;
+} REDIS_WAITER;
+
+/*
+ * One argument of a formatted command, pointing into the RESP buffer.
+ */
+typedef struct redis_arg {
+    const char* str;
+    size_t len;
+} REDIS_ARG;
+
+/*
+ * A redis_command call waiting on a multiplexed connection.  Lives on
+ * the caller's stack until the reader thread sets 'done'.
+ */
+typedef struct redis_mux_request {
+    const char* cmd;
+    size_t len;
+    void* reply;
+    int done;
+    pthread_cond_t cond;
+    struct redis_mux_request* next;
+} REDIS_MUX_REQUEST;
+
+/*
+ * A point of the hash ring of sharded mode: keys hashing up to 'hash'
+ * belong to 'node'.
+ */
+typedef struct redis_ring_point {
+    uint32_t hash;
+    int node;
+} REDIS_RING_POINT;
+
+/*
+ * The nodes of a cluster or sharded instance, a pool each, and what maps
+ * keys to them: the slot map of a cluster, the hash ring of a sharded
+ * one.  Nodes are only ever added, so that a node index read from
+ * 'slots' without a lock stays good until the instance is destroyed;
+ * 'mutex' only serializes adding them.  The refresher thread reloads
+ * the slot map from CLUSTER SLOTS when a MOVED says it is out of date.
+ */
+typedef struct redis_cluster {
+    int slots[REDIS_CLUSTER_SLOTS];/* node index, -1 if not known */
+    REDIS_RING_POINT* ring;/* sorted by hash; fixed once built */
+    int num_ring;
+    REDIS_ENDPOINT nodes[REDIS_CLUSTER_MAX_NODES];
+    REDIS_INSTANCE* pools[REDIS_CLUSTER_MAX_NODES];
+    int num_nodes;
+    pthread_mutex_t mutex;
+    pthread_mutex_t refresh_mutex;
+    pthread_cond_t refresh_cond;
+    int refresh_wanted;
+    int stop;
+    int running;/* the refresher thread was started */
+    pthread_t refresher;
+} REDIS_CLUSTER;
+
+/* REDIS_COMMAND_INFO flags */
+#define REDIS_CMD_SESSION 0x01/* changes the state of the connection */
+#define REDIS_CMD_TRANSACTION 0x02/* MULTI/EXEC state or WATCHed keys */
+#define REDIS_CMD_PUBSUB 0x04/* turns the connection into a subscriber */
+#define REDIS_CMD_BLOCKING 0x08/* may hold the connection for a long time */
+/* where a blocking command has its timeout, by default the last argument in seconds */
+#define REDIS_CMD_TIMEOUT_FIRST 0x20/* the first argument */
+#define REDIS_CMD_BLOCK_OPTION 0x40/* BLOCK <ms>, and only blocks with it */
+#define REDIS_CMD_BULK 0x80/* reply may be large */
+/* where the key a cluster routes by is, by default the first argument */
+#define REDIS_CMD_KEYLESS 0x100/* none, any node will do */
+#define REDIS_CMD_KEY_SECOND 0x200/* the second, after a subcommand */
+#define REDIS_CMD_KEY_NUMKEYS 0x400/* after the numkeys of the second argument */
+#define REDIS_CMD_KEY_STREAMS 0x800/* after STREAMS */
+#define REDIS_CMD_READONLY 0x1000/* a replica may answer it */
+#define REDIS_CMD_KEY_NUMKEYS_FIRST 0x2000/* after the numkeys of the first argument */
+#define REDIS_CMD_CURSOR 0x4000/* iterates with a cursor, on one node throughout */
+#define REDIS_CMD_KEYSPACE 0x80000/* about every key of the node it is sent to */
+/* which further arguments are keys, by default none */
+#define REDIS_CMD_KEYS_REST 0x8000/* every one after the first key, but for a trailing timeout */
+#define REDIS_CMD_KEYS_PAIRS 0x10000/* every other one after the first key */
+#define REDIS_CMD_KEYS_TWO 0x20000/* the one after the first key */
+#define REDIS_CMD_KEYS_DEST 0x40000/* the first argument, as well as numkeys keys */
+
+/* Commands that cannot share a connection with other callers */
+#define REDIS_CMD_PINNED (REDIS_CMD_SESSION | REDIS_CMD_TRANSACTION \
+		| REDIS_CMD_PUBSUB | REDIS_CMD_BLOCKING)
+
+/*
+ * What the pool needs to know about a command.  Commands not in the
+ * table are plain commands with no flags.
+ */
+typedef struct redis_command_info {
+    const char* name;
+    int flags;
+} REDIS_COMMAND_INFO;
+
+/* sorted by name for bsearch */
+static const REDIS_COMMAND_INFO redis_commands[] = {
+    { "asking", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "auth", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "bitcount", REDIS_CMD_READONLY },
+    { "bitfield_ro", REDIS_CMD_READONLY },
+    { "bitop", REDIS_CMD_KEY_SECOND | REDIS_CMD_KEYS_REST },
+    { "bitpos", REDIS_CMD_READONLY },
+    { "blmove", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_TWO },
+    { "blmpop", REDIS_CMD_BLOCKING | REDIS_CMD_TIMEOUT_FIRST
+            | REDIS_CMD_KEY_NUMKEYS },
+    { "blpop", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_REST },
+    { "brpop", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_REST },
+    { "brpoplpush", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_TWO },
+    { "bzmpop", REDIS_CMD_BLOCKING | REDIS_CMD_TIMEOUT_FIRST
+            | REDIS_CMD_KEY_NUMKEYS },
+    { "bzpopmax", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_REST },
+    { "bzpopmin", REDIS_CMD_BLOCKING | REDIS_CMD_KEYS_REST },
+    { "client", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "cluster", REDIS_CMD_KEYLESS },
+    { "config", REDIS_CMD_KEYLESS },
+    { "copy", REDIS_CMD_KEYS_TWO },
+    { "dbsize", REDIS_CMD_KEYLESS | REDIS_CMD_READONLY | REDIS_CMD_KEYSPACE },
+    { "del", REDIS_CMD_KEYS_REST },
+    { "discard", REDIS_CMD_TRANSACTION | REDIS_CMD_KEYLESS },
+    { "dump", REDIS_CMD_READONLY },
+    { "echo", REDIS_CMD_KEYLESS },
+    { "eval", REDIS_CMD_KEY_NUMKEYS },
+    { "eval_ro", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_READONLY },
+    { "evalsha", REDIS_CMD_KEY_NUMKEYS },
+    { "evalsha_ro", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_READONLY },
+    { "exec", REDIS_CMD_TRANSACTION | REDIS_CMD_KEYLESS },
+    { "exists", REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "expiretime", REDIS_CMD_READONLY },
+    { "fcall", REDIS_CMD_KEY_NUMKEYS },
+    { "fcall_ro", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_READONLY },
+    { "flushall", REDIS_CMD_KEYLESS | REDIS_CMD_KEYSPACE },
+    { "flushdb", REDIS_CMD_KEYLESS | REDIS_CMD_KEYSPACE },
+    { "geodist", REDIS_CMD_READONLY },
+    { "geohash", REDIS_CMD_READONLY },
+    { "geopos", REDIS_CMD_READONLY },
+    { "georadius_ro", REDIS_CMD_READONLY },
+    { "georadiusbymember_ro", REDIS_CMD_READONLY },
+    { "geosearch", REDIS_CMD_READONLY },
+    { "geosearchstore", REDIS_CMD_KEYS_TWO },
+    { "get", REDIS_CMD_READONLY },
+    { "getbit", REDIS_CMD_READONLY },
+    { "getrange", REDIS_CMD_READONLY },
+    { "hello", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "hexists", REDIS_CMD_READONLY },
+    { "hget", REDIS_CMD_READONLY },
+    { "hgetall", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "hkeys", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "hlen", REDIS_CMD_READONLY },
+    { "hmget", REDIS_CMD_READONLY },
+    { "hrandfield", REDIS_CMD_READONLY },
+    { "hscan", REDIS_CMD_READONLY },
+    { "hstrlen", REDIS_CMD_READONLY },
+    { "hvals", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "info", REDIS_CMD_KEYLESS },
+    { "keys", REDIS_CMD_BULK | REDIS_CMD_KEYLESS | REDIS_CMD_READONLY
+            | REDIS_CMD_KEYSPACE },
+    { "lcs", REDIS_CMD_READONLY | REDIS_CMD_KEYS_TWO },
+    { "lindex", REDIS_CMD_READONLY },
+    { "llen", REDIS_CMD_READONLY },
+    { "lmove", REDIS_CMD_KEYS_TWO },
+    { "lmpop", REDIS_CMD_KEY_NUMKEYS_FIRST },
+    { "lpos", REDIS_CMD_READONLY },
+    { "lrange", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "memory", REDIS_CMD_KEY_SECOND },
+    { "mget", REDIS_CMD_BULK | REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "monitor", REDIS_CMD_PUBSUB | REDIS_CMD_KEYLESS },
+    { "mset", REDIS_CMD_KEYS_PAIRS },
+    { "msetnx", REDIS_CMD_KEYS_PAIRS },
+    { "multi", REDIS_CMD_TRANSACTION | REDIS_CMD_KEYLESS },
+    { "object", REDIS_CMD_KEY_SECOND | REDIS_CMD_READONLY },
+    { "pexpiretime", REDIS_CMD_READONLY },
+    { "pfcount", REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "pfmerge", REDIS_CMD_KEYS_REST },
+    { "ping", REDIS_CMD_KEYLESS },
+    { "psubscribe", REDIS_CMD_PUBSUB },
+    { "psync", REDIS_CMD_PUBSUB | REDIS_CMD_KEYLESS },
+    { "pttl", REDIS_CMD_READONLY },
+    { "punsubscribe", REDIS_CMD_PUBSUB },
+    { "quit", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "randomkey", REDIS_CMD_KEYLESS | REDIS_CMD_READONLY },
+    { "readonly", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "readwrite", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "rename", REDIS_CMD_KEYS_TWO },
+    { "renamenx", REDIS_CMD_KEYS_TWO },
+    { "replconf", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "reset", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "rpoplpush", REDIS_CMD_KEYS_TWO },
+    { "scan", REDIS_CMD_KEYLESS | REDIS_CMD_CURSOR | REDIS_CMD_READONLY },
+    { "scard", REDIS_CMD_READONLY },
+    { "script", REDIS_CMD_KEYLESS },
+    { "sdiff", REDIS_CMD_BULK | REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "sdiffstore", REDIS_CMD_KEYS_REST },
+    { "select", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "sinter", REDIS_CMD_BULK | REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "sintercard", REDIS_CMD_KEY_NUMKEYS_FIRST | REDIS_CMD_READONLY },
+    { "sinterstore", REDIS_CMD_KEYS_REST },
+    { "sismember", REDIS_CMD_READONLY },
+    { "smembers", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "smismember", REDIS_CMD_READONLY },
+    { "smove", REDIS_CMD_KEYS_TWO },
+    { "sort", REDIS_CMD_BULK },
+    { "sort_ro", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "srandmember", REDIS_CMD_READONLY },
+    { "sscan", REDIS_CMD_READONLY },
+    { "ssubscribe", REDIS_CMD_PUBSUB },
+    { "strlen", REDIS_CMD_READONLY },
+    { "subscribe", REDIS_CMD_PUBSUB },
+    { "substr", REDIS_CMD_READONLY },
+    { "sunion", REDIS_CMD_BULK | REDIS_CMD_READONLY | REDIS_CMD_KEYS_REST },
+    { "sunionstore", REDIS_CMD_KEYS_REST },
+    { "sunsubscribe", REDIS_CMD_PUBSUB },
+    { "swapdb", REDIS_CMD_SESSION | REDIS_CMD_KEYLESS },
+    { "sync", REDIS_CMD_PUBSUB | REDIS_CMD_KEYLESS },
+    { "time", REDIS_CMD_KEYLESS },
+    { "touch", REDIS_CMD_KEYS_REST },
+    { "ttl", REDIS_CMD_READONLY },
+    { "type", REDIS_CMD_READONLY },
+    { "unlink", REDIS_CMD_KEYS_REST },
+    { "unsubscribe", REDIS_CMD_PUBSUB },
+    { "unwatch", REDIS_CMD_TRANSACTION | REDIS_CMD_KEYLESS },
+    { "wait", REDIS_CMD_KEYLESS },
+    { "waitaof", REDIS_CMD_KEYLESS },
+    { "watch", REDIS_CMD_TRANSACTION | REDIS_CMD_KEYS_REST },
+    { "xgroup", REDIS_CMD_KEY_SECOND },
+    { "xinfo", REDIS_CMD_KEY_SECOND | REDIS_CMD_READONLY },
+    { "xlen", REDIS_CMD_READONLY },
+    { "xpending", REDIS_CMD_READONLY },
+    { "xrange", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "xread", REDIS_CMD_BLOCKING | REDIS_CMD_BLOCK_OPTION
+            | REDIS_CMD_KEY_STREAMS },
+    { "xreadgroup", REDIS_CMD_BLOCKING | REDIS_CMD_BLOCK_OPTION
+            | REDIS_CMD_KEY_STREAMS },
+    { "xrevrange", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zcard", REDIS_CMD_READONLY },
+    { "zcount", REDIS_CMD_READONLY },
+    { "zdiff", REDIS_CMD_BULK | REDIS_CMD_KEY_NUMKEYS_FIRST
+            | REDIS_CMD_READONLY },
+    { "zdiffstore", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_KEYS_DEST },
+    { "zinter", REDIS_CMD_BULK | REDIS_CMD_KEY_NUMKEYS_FIRST
+            | REDIS_CMD_READONLY },
+    { "zintercard", REDIS_CMD_KEY_NUMKEYS_FIRST | REDIS_CMD_READONLY },
+    { "zinterstore", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_KEYS_DEST },
+    { "zlexcount", REDIS_CMD_READONLY },
+    { "zmpop", REDIS_CMD_KEY_NUMKEYS_FIRST },
+    { "zmscore", REDIS_CMD_READONLY },
+    { "zrandmember", REDIS_CMD_READONLY },
+    { "zrange", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrangebylex", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrangebyscore", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrangestore", REDIS_CMD_KEYS_TWO },
+    { "zrank", REDIS_CMD_READONLY },
+    { "zrevrange", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrevrangebylex", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrevrangebyscore", REDIS_CMD_BULK | REDIS_CMD_READONLY },
+    { "zrevrank", REDIS_CMD_READONLY },
+    { "zscan", REDIS_CMD_READONLY },
+    { "zscore", REDIS_CMD_READONLY },
+    { "zunion", REDIS_CMD_BULK | REDIS_CMD_KEY_NUMKEYS_FIRST
+            | REDIS_CMD_READONLY },
+    { "zunionstore", REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_KEYS_DEST },
+};
+
+/* CRC16-CCITT (XModem), which is what the cluster hashes keys with */
+static const uint16_t redis_crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static const char redis_asking[] = "*1\r\n$6\r\nASKING\r\n";
+static const char redis_cluster_slots[] =
+		"*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n";
+
+static unsigned long next_generation;
+static __thread REDIS_THREAD_CACHE thread_cache
+		__attribute__((tls_model("initial-exec")));
 
 static int redis_init_socketpool(REDIS_INSTANCE * inst);
 static void redis_poolfree(REDIS_INSTANCE * inst);
 static int connect_single_socket(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst);
+static redisContext * redis_connect_endpoint(REDIS_INSTANCE *inst, int idx,
+		int id);
+static unsigned int redis_endpoint_address(REDIS_INSTANCE *inst, int idx,
+		char *host, int *port);
+static int redis_setup_connection(REDIS_INSTANCE *inst, redisContext *c);
+static int redis_build_handshake(REDIS_INSTANCE *inst);
+static void redis_attach_connection(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket, redisContext *c);
+static int redis_parse_command(const char *cmd, size_t len, REDIS_ARG *argv,
+		int max);
+static const REDIS_COMMAND_INFO * redis_lookup_command(const REDIS_ARG *name);
+static void redis_track_session(REDIS_SOCKET *redisocket, const char *cmd,
+		size_t len, int failed);
+static REDIS_SOCKET * redis_cache_get_db(REDIS_INSTANCE *inst, int db);
+static void redis_pipeline_deliver(REDIS_PIPELINE *p, void *reply);
+static int redis_pipeline_drain(REDIS_PIPELINE *p, const char *session,
+		size_t len);
+static int redis_pipeline_append(REDIS_PIPELINE *p, char *cmd, int len);
+static void* redis_fanout_part(void *arg);
+static void redis_fanout_deliver(void *reply, long index, void *privdata);
+static REDIS_SOCKET * redis_claim_db(REDIS_INSTANCE *inst, int db);
+static int redis_connect_sockets(REDIS_INSTANCE *inst, REDIS_SOCKET **socks,
+		int n);
+static redisContext * redis_take_standby(REDIS_INSTANCE *inst, int idx);
+static void redis_backoff_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket);
+static int redis_endpoint_take_token(REDIS_INSTANCE *inst, int idx,
+		long long now);
 static int redis_close_socket(REDIS_INSTANCE *inst, REDIS_SOCKET * redisocket);
+static void redis_drop_connection(REDIS_SOCKET *redisocket);
 static int reconnect_and_release_socket(REDIS_INSTANCE *inst,
 		REDIS_SOCKET * redisocket);
 static REDIS_SOCKET * add_new_socket(REDIS_INSTANCE * inst);
+static int redis_init_slot(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket, int id);
+static REDIS_SOCKET * redis_claim_socket(REDIS_INSTANCE *inst,
+		int *unconnected, int *tried_to_connect);
+static int redis_claim_bit(REDIS_FREE_WORD *map, int id);
+static REDIS_FREE_WORD * redis_free_map(REDIS_INSTANCE *inst, int ep);
+static int redis_endpoint_allow(REDIS_INSTANCE *inst, int idx);
+static void redis_endpoint_report(REDIS_INSTANCE *inst, int idx, int ok);
+static int redis_endpoints_available(REDIS_INSTANCE *inst);
+static int redis_endpoint_might_allow(REDIS_INSTANCE *inst, int idx,
+		long long now);
+static void redis_put_socket(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket);
+static REDIS_SOCKET * redis_cache_get(REDIS_INSTANCE *inst);
+static int redis_cache_put(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket);
+static REDIS_SOCKET * redis_steal_socket(REDIS_INSTANCE *inst);
+static void redis_handoff_socket(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket);
+static void redis_unlink_waiter(REDIS_INSTANCE *inst, REDIS_WAITER *w);
 static void* redis_vcommand(REDIS_SOCKET* redisocket, REDIS_INSTANCE* instance, const char* format, va_list ap);
+static void redis_endpoint_observe(REDIS_ENDPOINT_STATE *es, long long usec,
+		int ok);
+static int redis_popcount_map(REDIS_INSTANCE *inst, REDIS_FREE_WORD *map);
+static long long redis_monotonic_usec(void);
+static int redis_start_maintenance(REDIS_INSTANCE *inst);
+static void redis_stop_maintenance(REDIS_INSTANCE *inst);
+static void redis_kick_maintenance(REDIS_INSTANCE *inst);
+static void redis_put_dead(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket);
+static void* redis_maintenance_main(void *arg);
+static REDIS_SOCKET * redis_get_pool_socket(REDIS_INSTANCE *inst);
+static REDIS_SOCKET * redis_get_pool_socket_timed(REDIS_INSTANCE *inst,
+		int deadline_ms, int priority);
+static int redis_take_quota(REDIS_INSTANCE *inst, int priority,
+		int *deadline_ms);
+static void redis_put_quota(REDIS_INSTANCE *inst);
+static int redis_quota_limit(REDIS_INSTANCE *inst);
+static int redis_should_shed(REDIS_INSTANCE *inst, int deadline_ms);
+static void redis_adapt_limit(REDIS_INSTANCE *inst, long long usec, int ok);
+static REDIS_SOCKET * redis_get_pool_socket_db(REDIS_INSTANCE *inst, int db);
+static REDIS_SOCKET * redis_find_socket_db(REDIS_INSTANCE *inst, int db);
+static REDIS_SOCKET * redis_get_pool_socket_prio(REDIS_INSTANCE *inst,
+		int deadline_ms, int priority);
+static void* redis_socket_command(REDIS_SOCKET *redisocket,
+		REDIS_INSTANCE *inst, const char *cmd, size_t len);
+static int redis_mux_start(REDIS_INSTANCE *inst);
+static void redis_mux_stop(REDIS_INSTANCE *inst);
+static void* redis_mux_command(REDIS_SOCKET *vsock, REDIS_INSTANCE *inst,
+		int bulk, const char *cmd, size_t len);
+static int redis_command_flags(const char *cmd, size_t len);
+static REDIS_SOCKET * redis_pin_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *vsock);
+static REDIS_SOCKET * redis_get_virtual(REDIS_INSTANCE *inst, int priority);
+static void redis_put_virtual(REDIS_INSTANCE *inst, REDIS_SOCKET *vsock);
+static void redis_mux_fail(REDIS_MUX_REQUEST **head, REDIS_MUX_REQUEST **tail);
+static void* redis_mux_writer(void *arg);
+static void* redis_mux_reader(void *arg);
+static void redis_mux_reconnect(REDIS_MUX *m);
+static redisContext * redis_connect_any(REDIS_INSTANCE *inst, int first,
+		int id, int *idx);
+static int redis_command_blocks(const char *cmd, size_t len, long *timeout_ms);
+static void* redis_blocking_command(REDIS_INSTANCE *inst, const char *cmd,
+		size_t len, long timeout_ms);
+static REDIS_SOCKET * redis_lane_get(REDIS_INSTANCE *inst, long timeout_ms,
+		int *timedout);
+static void redis_lane_put(REDIS_INSTANCE *inst, REDIS_SOCKET *lsock);
+static void* redis_dispatch(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len);
+static void* redis_route(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		int consistency, const char *cmd, size_t len);
+static int redis_replica_read(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		int consistency, const char *cmd, size_t len);
+static int redis_find_key(const char *cmd, size_t len, REDIS_ARG *key);
+static void redis_key_tag(const char **key, size_t *len);
+static int redis_cluster_slot(const char *key, size_t len);
+static uint32_t redis_hash(const char *s, size_t len);
+static int redis_cluster_node_of(REDIS_INSTANCE *inst, const char *key,
+		size_t len);
+static int redis_cluster_start(REDIS_INSTANCE *inst);
+static int redis_shards_start(REDIS_INSTANCE *inst);
+static void redis_cluster_stop(REDIS_INSTANCE *inst);
+static int redis_cluster_add_node(REDIS_INSTANCE *inst, const char *host,
+		int port);
+static REDIS_INSTANCE * redis_cluster_owner(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket);
+static void* redis_cluster_command(REDIS_INSTANCE *inst, const REDIS_ARG *key,
+		const char *cmd, size_t len);
+static int redis_parse_redirect(const char *err, int *slot, char *host,
+		size_t size, int *port);
+static int redis_keys_on_node(REDIS_INSTANCE *inst, const char *cmd,
+		size_t len, int node);
+static redisReply * redis_error_reply(const char *fmt, ...);
+static int redis_cluster_refresh(REDIS_INSTANCE *inst);
+static int redis_cluster_load(REDIS_INSTANCE *inst, redisReply *reply,
+		const REDIS_ENDPOINT *from);
+static void redis_cluster_kick(REDIS_CLUSTER *cl);
+static void* redis_cluster_refresher(void *arg);
+static redisContext * redis_sentinel_connect(REDIS_INSTANCE *inst, int idx);
+static int redis_sentinel_query(REDIS_INSTANCE *inst, int idx, char *host,
+		int *port);
+static int redis_sentinel_discover(REDIS_INSTANCE *inst);
+static int redis_sentinel_start(REDIS_INSTANCE *inst);
+static void redis_sentinel_stop(REDIS_INSTANCE *inst);
+static void* redis_sentinel_main(void *arg);
+static void redis_sentinel_switch(REDIS_INSTANCE *inst, const char *host,
+		int port);
+static void redis_sentinel_drain(REDIS_INSTANCE *inst);
+static long redis_hedge_delay(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len);
+static int redis_hedge_allow(REDIS_INSTANCE *inst);
+static REDIS_SOCKET * redis_hedge_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket);
+static int redis_hedged_reply(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len, long delay, void **reply);
+static void redis_swap_connection(REDIS_SOCKET *a, REDIS_SOCKET *b);
+static int redis_flush(redisContext *c);
 
 int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 	int i;
@@ -29,22 +551,45 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 
 	inst = malloc(sizeof(REDIS_INSTANCE));
 	memset(inst, 0, sizeof(REDIS_INSTANCE));
+	pthread_mutex_init(&inst->virtual_mutex, NULL);
+	pthread_mutex_init(&inst->lane_mutex, NULL);
+	pthread_mutex_init(&inst->quota_mutex, NULL);
+	for (i = 0; i < REDIS_PRIORITY_CLASSES; i++)
+		pthread_cond_init(&inst->quota_cond[i], NULL);
+	pthread_mutex_init(&inst->sentinel_mutex, NULL);
+	pthread_cond_init(&inst->sentinel_cond, NULL);
 
 	inst->config = malloc(sizeof(REDIS_CONFIG));
 	memset(inst->config, 0, sizeof(REDIS_CONFIG));
 
-	if (config->endpoints == NULL || config->num_endpoints < 1) {
+	if (config->num_sentinels > 0 && config->sentinels) {
+		if (config->master_name[0] == '\0') {
+			log_(L_ERROR | L_CONS, "%s: Sentinels need a master_name",
+					__func__);
+			redis_pool_destroy(inst);
+			return -1;
+		}
+		/* the one endpoint is whatever they say the primary is */
+		inst->config->sentinels = malloc(
+				sizeof(REDIS_ENDPOINT) * config->num_sentinels);
+		memcpy(inst->config->sentinels, config->sentinels,
+				sizeof(REDIS_ENDPOINT) * config->num_sentinels);
+		inst->config->num_sentinels = config->num_sentinels;
+		strcpy(inst->config->master_name, config->master_name);
+		inst->config->endpoints = calloc(1, sizeof(REDIS_ENDPOINT));
+		inst->config->num_endpoints = 1;
+	} else if (config->endpoints == NULL || config->num_endpoints < 1) {
 		log_(L_ERROR | L_CONS, "%s: Must provide 1 redis endpoint", __func__);
 		redis_pool_destroy(inst);
 		return -1;
+	} else {
+		/* Assign config */
+		inst->config->endpoints = malloc(
+				sizeof(REDIS_ENDPOINT) * config->num_endpoints);
+		memcpy(inst->config->endpoints, config->endpoints,
+				sizeof(REDIS_ENDPOINT) * config->num_endpoints);
+		inst->config->num_endpoints = config->num_endpoints;
 	}
-
-	/* Assign config */
-	inst->config->endpoints = malloc(
-			sizeof(REDIS_ENDPOINT) * config->num_endpoints);
-	memcpy(inst->config->endpoints, config->endpoints,
-			sizeof(REDIS_ENDPOINT) * config->num_endpoints);
-	inst->config->num_endpoints = config->num_endpoints;
 	inst->config->connect_timeout = config->connect_timeout;
 	inst->config->net_readwrite_timeout = config->net_readwrite_timeout;
 	inst->config->num_redis_socks = config->num_redis_socks;
@@ -52,9 +597,52 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 	inst->config->connect_failure_retry_delay =
 			config->connect_failure_retry_delay;
 	strcpy(inst->config->passwd, config->passwd);
+	inst->config->thread_cache_size = config->thread_cache_size;
+	inst->config->maintenance_interval = config->maintenance_interval;
+	inst->config->heartbeat_interval = config->heartbeat_interval;
+	inst->config->idle_ttl = config->idle_ttl;
+	inst->config->high_watermark = config->high_watermark;
+	inst->config->wait_watermark = config->wait_watermark;
+	inst->config->circuit_failure_threshold =
+			config->circuit_failure_threshold;
+	inst->config->max_conn_age = config->max_conn_age;
+	inst->config->rebalance_rate = config->rebalance_rate;
+	inst->config->num_standby = config->num_standby;
+	inst->config->connect_backoff_max = config->connect_backoff_max;
+	inst->config->connect_rate = config->connect_rate;
+	inst->config->connect_burst = config->connect_burst;
+	inst->config->slow_start = config->slow_start;
+	inst->config->lazy_connect = config->lazy_connect;
+	inst->config->db = config->db;
+	strcpy(inst->config->client_name, config->client_name);
+	inst->config->num_mux_connections = config->num_mux_connections;
+	inst->config->max_blocking_socks = config->max_blocking_socks;
+	inst->config->reserved_high_socks = config->reserved_high_socks;
+	inst->config->num_mux_bulk_connections =
+			config->num_mux_bulk_connections;
+	inst->config->latency_target = config->latency_target;
+	inst->config->cluster = config->cluster;
+	inst->config->sharded = config->sharded;
+	inst->config->consistency = config->consistency;
+	inst->config->hedge_delay = config->hedge_delay;
+	inst->config->hedge_budget = config->hedge_budget;
+	if (config->num_replicas > 0 && config->replicas) {
+		inst->config->replicas = malloc(
+				sizeof(REDIS_ENDPOINT) * config->num_replicas);
+		memcpy(inst->config->replicas, config->replicas,
+				sizeof(REDIS_ENDPOINT) * config->num_replicas);
+		inst->config->num_replicas = config->num_replicas;
+	}
+	if (config->num_init_commands > 0 && config->init_commands) {
+		inst->config->init_commands = calloc(config->num_init_commands,
+				sizeof(char *));
+		inst->config->num_init_commands = config->num_init_commands;
+		for (i = 0; i < config->num_init_commands; i++)
+			inst->config->init_commands[i] = config->init_commands[i] ?
+					strdup(config->init_commands[i]) : NULL;
+	}
 	log_(L_INFO, "%s: inst->config->passwd : %s", __func__,
 			inst->config->passwd);
-//    inst->config->select = config->select;
 
 	/* Check config */
 	if (inst->config->max_num_redis_socks > MAX_REDIS_SOCKS) {
@@ -72,6 +660,127 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 		inst->config->net_readwrite_timeout = 0;
 	if (inst->config->connect_failure_retry_delay <= 0)
 		inst->config->connect_failure_retry_delay = -1;
+	if (inst->config->maintenance_interval < 0)
+		inst->config->maintenance_interval = 0;
+	if (inst->config->heartbeat_interval < 0)
+		inst->config->heartbeat_interval = 0;
+	if (inst->config->idle_ttl < 0)
+		inst->config->idle_ttl = 0;
+	if (inst->config->high_watermark < 0 || inst->config->high_watermark > 100)
+		inst->config->high_watermark = 0;
+	if (inst->config->wait_watermark < 0)
+		inst->config->wait_watermark = 0;
+	if (inst->config->circuit_failure_threshold <= 0)
+		inst->config->circuit_failure_threshold = 1;
+	if (inst->config->max_conn_age < 0)
+		inst->config->max_conn_age = 0;
+	if (inst->config->rebalance_rate <= 0)
+		inst->config->rebalance_rate = 1;
+	if (inst->config->num_standby < 0 || inst->config->num_endpoints < 2)
+		inst->config->num_standby = 0;
+	if (inst->config->num_standby > HIREDISPOOL_MAX_STANDBY)
+		inst->config->num_standby = HIREDISPOOL_MAX_STANDBY;
+	if (inst->config->connect_backoff_max < 0)
+		inst->config->connect_backoff_max = 0;
+	if (inst->config->connect_rate < 0)
+		inst->config->connect_rate = 0;
+	if (inst->config->connect_burst <= 0)
+		inst->config->connect_burst = inst->config->connect_rate;
+	if (inst->config->slow_start < 0)
+		inst->config->slow_start = 0;
+	if (inst->config->thread_cache_size < 0)
+		inst->config->thread_cache_size = 0;
+	if (inst->config->thread_cache_size > HIREDISPOOL_MAX_THREAD_CACHE)
+		inst->config->thread_cache_size = HIREDISPOOL_MAX_THREAD_CACHE;
+	if (inst->config->db < 0)
+		inst->config->db = 0;
+	if (inst->config->num_mux_connections < 0)
+		inst->config->num_mux_connections = 0;
+	if (inst->config->max_blocking_socks < 0)
+		inst->config->max_blocking_socks = 0;
+	if (inst->config->max_blocking_socks > MAX_REDIS_SOCKS)
+		inst->config->max_blocking_socks = MAX_REDIS_SOCKS;
+	if (inst->config->reserved_high_socks < 0)
+		inst->config->reserved_high_socks = 0;
+	if (inst->config->reserved_high_socks >= inst->config->max_num_redis_socks
+			&& inst->config->reserved_high_socks > 0) {
+		log_(L_ERROR | L_CONS, "%s: reserved_high_socks (%d) must leave "
+				"sockets for the other priorities out of %d", __func__,
+				inst->config->reserved_high_socks,
+				inst->config->max_num_redis_socks);
+		redis_pool_destroy(inst);
+		return -1;
+	}
+	if (inst->config->num_mux_bulk_connections < 0)
+		inst->config->num_mux_bulk_connections = 0;
+	if (inst->config->latency_target < 0)
+		inst->config->latency_target = 0;
+	if (inst->config->maintenance_interval == 0
+			&& (inst->config->heartbeat_interval > 0
+					|| inst->config->idle_ttl > 0
+					|| inst->config->high_watermark > 0
+					|| inst->config->wait_watermark > 0
+					|| inst->config->max_conn_age > 0
+					|| inst->config->num_standby > 0
+					|| inst->config->lazy_connect)) {
+		log_(L_INFO | L_CONS, "%s: heartbeat_interval, idle_ttl, "
+				"high_watermark, wait_watermark, max_conn_age, num_standby "
+				"and lazy_connect need the maintenance thread, running it "
+				"every %d ms", __func__, REDIS_MAINTENANCE_DEFAULT_MS);
+		inst->config->maintenance_interval = REDIS_MAINTENANCE_DEFAULT_MS;
+	}
+	if (inst->config->cluster && inst->config->sharded) {
+		log_(L_ERROR | L_CONS, "%s: Either cluster or sharded", __func__);
+		redis_pool_destroy(inst);
+		return -1;
+	}
+	if ((inst->config->cluster || inst->config->sharded)
+			&& inst->config->num_sentinels > 0) {
+		log_(L_ERROR | L_CONS, "%s: Sentinels watch a single primary, not "
+				"a cluster or shards", __func__);
+		redis_pool_destroy(inst);
+		return -1;
+	}
+	if ((inst->config->cluster || inst->config->sharded)
+			&& inst->config->num_replicas > 0) {
+		log_(L_WARN | L_CONS, "%s: Ignoring replicas, keys are spread over "
+				"nodes", __func__);
+		free(inst->config->replicas);
+		inst->config->replicas = NULL;
+		inst->config->num_replicas = 0;
+	}
+	if (inst->config->consistency != REDIS_CONSISTENCY_STRONG)
+		inst->config->consistency = REDIS_CONSISTENCY_EVENTUAL;
+	if (inst->config->hedge_delay < 0)
+		inst->config->hedge_delay = -1;
+	if (inst->config->hedge_budget <= 0)
+		inst->config->hedge_budget = 5;
+	if (inst->config->hedge_budget > 100)
+		inst->config->hedge_budget = 100;
+	if (inst->config->cluster && inst->config->db != 0) {
+		log_(L_WARN | L_CONS, "%s: A cluster only has database 0, "
+				"ignoring db %d", __func__, inst->config->db);
+		inst->config->db = 0;
+	}
+	inst->admission = inst->config->reserved_high_socks > 0
+			|| inst->config->latency_target > 0;
+	/* wide open until latency says otherwise */
+	inst->limit_milli = 1000 * (inst->config->max_num_redis_socks
+			- inst->config->reserved_high_socks);
+	if (inst->limit_milli < 1000)
+		inst->limit_milli = 1000;
+	inst->generation = __atomic_add_fetch(&next_generation, 1,
+			__ATOMIC_RELAXED);
+
+	if (redis_build_handshake(inst) < 0) {
+		redis_pool_destroy(inst);
+		return -1;
+	}
+
+	if (inst->config->num_sentinels > 0 && redis_sentinel_discover(inst) < 0) {
+		redis_pool_destroy(inst);
+		return -1;
+	}
 
 	for (i = 0; i < inst->config->num_endpoints; i++) {
 		host = inst->config->endpoints[i].host;
@@ -86,6 +795,35 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 				port);
 	}
 
+	if (posix_memalign((void **) &inst->endpoint_state, HIREDISPOOL_CACHELINE,
+			sizeof(REDIS_ENDPOINT_STATE) * inst->config->num_endpoints) != 0) {
+		inst->endpoint_state = NULL;
+		redis_pool_destroy(inst);
+		return -1;
+	}
+	memset(inst->endpoint_state, 0,
+			sizeof(REDIS_ENDPOINT_STATE) * inst->config->num_endpoints);
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		pthread_mutex_init(&inst->endpoint_state[i].mutex, NULL);
+		inst->endpoint_state[i].breaker = breakerclosed;
+		inst->endpoint_state[i].tokens = inst->config->connect_burst;
+		inst->endpoint_state[i].tokens_at = redis_monotonic_usec();
+	}
+
+	/*
+	 * The seeds are only asked for the slot map, the nodes get pools;
+	 * so does each shard.
+	 */
+	if (inst->config->cluster || inst->config->sharded) {
+		if ((inst->config->cluster ? redis_cluster_start(inst)
+				: redis_shards_start(inst)) < 0) {
+			redis_pool_destroy(inst);
+			return -1;
+		}
+		*instance = inst;
+		return 0;
+	}
+
 	log_(L_INFO, "%s: Attempting to connect to above endpoints "
 			"with connect_timeout %d net_readwrite_timeout %d", __func__,
 			inst->config->connect_timeout, inst->config->net_readwrite_timeout);
@@ -95,6 +833,38 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 		return -1;
 	}
 
+	if (inst->config->maintenance_interval > 0
+			&& redis_start_maintenance(inst) < 0) {
+		redis_pool_destroy(inst);
+		return -1;
+	}
+
+	if (inst->config->num_mux_connections > 0 && redis_mux_start(inst) < 0) {
+		redis_pool_destroy(inst);
+		return -1;
+	}
+
+	/* the replicas get a pool of their own, of the same config */
+	if (inst->config->num_replicas > 0) {
+		REDIS_CONFIG rconfig = *inst->config;
+		rconfig.endpoints = inst->config->replicas;
+		rconfig.num_endpoints = inst->config->num_replicas;
+		rconfig.replicas = NULL;
+		rconfig.num_replicas = 0;
+		rconfig.sentinels = NULL;
+		rconfig.num_sentinels = 0;
+		if (redis_pool_create(&rconfig, &inst->replicas) < 0) {
+			inst->replicas = NULL;
+			redis_pool_destroy(inst);
+			return -1;
+		}
+	}
+
+	if (inst->config->num_sentinels > 0 && redis_sentinel_start(inst) < 0) {
+		redis_pool_destroy(inst);
+		return -1;
+	}
+
 	*instance = inst;
 
 	return 0;
@@ -102,10 +872,31 @@ int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance) {
 
 int redis_pool_destroy(REDIS_INSTANCE* instance) {
 	REDIS_INSTANCE *inst = instance;
+	int i;
 
 	if (inst == NULL)
 		return -1;
 
+	if (inst->sentinel) {
+		redis_sentinel_stop(inst);
+	}
+
+	if (inst->replicas) {
+		redis_pool_destroy(inst->replicas);
+	}
+
+	if (inst->cluster) {
+		redis_cluster_stop(inst);
+	}
+
+	if (inst->mux) {
+		redis_mux_stop(inst);
+	}
+
+	if (inst->maintenance) {
+		redis_stop_maintenance(inst);
+	}
+
 	if (inst->redis_pool) {
 		redis_poolfree(inst);
 	}
@@ -115,9 +906,47 @@ int redis_pool_destroy(REDIS_INSTANCE* instance) {
 		 *  Free up dynamically allocated pointers.
 		 */
 		free(inst->config->endpoints);
+		free(inst->config->replicas);
+		free(inst->config->sentinels);
+		for (i = 0; i < inst->config->num_init_commands; i++)
+			free((void *) inst->config->init_commands[i]);
+		free((void *) inst->config->init_commands);
+		free(inst->handshake);
+
+		if (inst->endpoint_state) {
+			for (i = 0; i < inst->config->num_endpoints; i++) {
+				while (inst->endpoint_state[i].num_standby > 0)
+					redisFree(inst->endpoint_state[i].standby[
+							--inst->endpoint_state[i].num_standby]);
+				pthread_mutex_destroy(&inst->endpoint_state[i].mutex);
+			}
+			free(inst->endpoint_state);
+			inst->endpoint_state = NULL;
+		}
 
 		free(inst->config);
 		inst->config = NULL;
+
+		while (inst->virtual_free) {
+			REDIS_SOCKET *v = inst->virtual_free;
+			inst->virtual_free = v->next_virtual;
+			pthread_mutex_destroy(&v->mutex);
+			free(v);
+		}
+		pthread_mutex_destroy(&inst->virtual_mutex);
+
+		while (inst->lane_free) {
+			REDIS_SOCKET *l = inst->lane_free;
+			inst->lane_free = l->next_virtual;
+			redisFree(l->conn);
+			free(l);
+		}
+		pthread_mutex_destroy(&inst->lane_mutex);
+		for (i = 0; i < REDIS_PRIORITY_CLASSES; i++)
+			pthread_cond_destroy(&inst->quota_cond[i]);
+		pthread_mutex_destroy(&inst->quota_mutex);
+		pthread_cond_destroy(&inst->sentinel_cond);
+		pthread_mutex_destroy(&inst->sentinel_mutex);
 	}
 
 	free(inst);
@@ -129,48 +958,98 @@ static int redis_init_socketpool(REDIS_INSTANCE * inst) {
 	int i, rcode;
 	int success = 0;
 	REDIS_SOCKET *redisocket;
+	REDIS_SOCKET **socks;
 
-	inst->connect_after = 0;
 	inst->redis_pool = NULL;
 	inst->pool_size = 0;
 
+	/*
+	 *  All slots are allocated up front as one contiguous,
+	 *  cache-line aligned array, so that a socket never moves and
+	 *  growing the pool is just initializing the next slot.
+	 */
+	inst->num_slots = inst->config->max_num_redis_socks;
+	if (inst->num_slots < inst->config->num_redis_socks)
+		inst->num_slots = inst->config->num_redis_socks;
+	if (inst->num_slots < 1)
+		inst->num_slots = 1;
+	inst->num_free_words = (inst->num_slots + 63) / 64;
+
+	if (posix_memalign((void **) &inst->redis_pool, HIREDISPOOL_CACHELINE,
+			sizeof(REDIS_SOCKET) * inst->num_slots) != 0
+			|| posix_memalign((void **) &inst->free_map, HIREDISPOOL_CACHELINE,
+					sizeof(REDIS_FREE_WORD) * inst->num_free_words
+							* inst->config->num_endpoints) != 0
+			|| posix_memalign((void **) &inst->dead_map, HIREDISPOOL_CACHELINE,
+					sizeof(REDIS_FREE_WORD) * inst->num_free_words) != 0) {
+		log_(L_ERROR | L_CONS, "%s: Failed to allocate %d slots", __func__,
+				inst->num_slots);
+		return -1;
+	}
+	memset(inst->redis_pool, 0, sizeof(REDIS_SOCKET) * inst->num_slots);
+	memset(inst->free_map, 0, sizeof(REDIS_FREE_WORD) * inst->num_free_words
+			* inst->config->num_endpoints);
+	memset(inst->dead_map, 0, sizeof(REDIS_FREE_WORD) * inst->num_free_words);
+
+	rcode = pthread_mutex_init(&inst->pool_size_mutex, NULL);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to init pool_size lock: returns (%d)", __func__, rcode);
+		return -1;
+	}
+	rcode = pthread_mutex_init(&inst->wait_mutex, NULL);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to init wait lock: returns (%d)", __func__, rcode);
+		return -1;
+	}
+	pthread_mutex_init(&inst->maintenance_mutex, NULL);
+	pthread_cond_init(&inst->maintenance_cond, NULL);
+
+	socks = malloc(sizeof(REDIS_SOCKET *) * (inst->config->num_redis_socks + 1));
+	if (socks == NULL)
+		return -1;
+
 	for (i = 0; i < inst->config->num_redis_socks; i++) {
 		DEBUG("%s: starting %d", __func__, i);
 
-		redisocket = malloc(sizeof(REDIS_SOCKET));
-		redisocket->conn = NULL;
-		redisocket->id = i;
-		redisocket->backup = i % inst->config->num_endpoints;
-		redisocket->state = sockunconnected;
-		redisocket->inuse = 0;
-
-		rcode = pthread_mutex_init(&redisocket->mutex, NULL);
-		if (rcode != 0) {
-			log_(L_ERROR | L_CONS, "%s: "
-					"Failed to init lock: returns (%d)", __func__, rcode);
-			free(redisocket);
+		redisocket = &inst->redis_pool[i];
+		if (redis_init_slot(inst, redisocket, i) < 0) {
+			free(socks);
 			return -1;
 		}
+		socks[i] = redisocket;
+	}
 
-		if (time(NULL) > inst->connect_after) {
-			/*
-			 *  This sets the redisocket->state, and
-			 *  possibly also inst->connect_after
-			 */
-			if (connect_single_socket(redisocket, inst) == 0) {
-				success = 1;
-			}
-		}
+	/*
+	 *  Connect them all at once.  This sets each redisocket->state,
+	 *  and possibly opens endpoints' circuits.  In lazy mode nothing
+	 *  is connected here: the maintenance thread fills the pool in the
+	 *  background, or without it every socket connects on first use.
+	 */
+	if (!inst->config->lazy_connect) {
+		success = redis_connect_sockets(inst, socks,
+				inst->config->num_redis_socks) > 0;
+	}
 
-		/* Add this socket to the list of sockets */
-		redisocket->next = inst->redis_pool;
-		inst->redis_pool = redisocket;
+	for (i = 0; i < inst->config->num_redis_socks; i++) {
+		/*
+		 *  Add this socket to the pool and mark it free, or
+		 *  leave it to the maintenance thread to connect.
+		 */
+		redisocket = socks[i];
 		inst->pool_size++;
+		pthread_mutex_lock(&redisocket->mutex);
+		redisocket->inuse = 1;
+		if (redisocket->state == sockunconnected
+				&& inst->config->maintenance_interval > 0)
+			redis_put_dead(inst, redisocket);
+		else
+			redis_put_socket(inst, redisocket);
 	}
+	free(socks);
 
-	inst->last_used = NULL;
-
-	if (!success) {
+	if (!success && !inst->config->lazy_connect) {
 		log_(L_WARN, "%s: Failed to connect to any redis server.", __func__);
 	}
 
@@ -178,579 +1057,5138 @@ static int redis_init_socketpool(REDIS_INSTANCE * inst) {
 }
 
 static void redis_poolfree(REDIS_INSTANCE * inst) {
-	REDIS_SOCKET *cur;
-	REDIS_SOCKET *next;
+	int i;
 
-	for (cur = inst->redis_pool; cur; cur = next) {
-		next = cur->next;
-		redis_close_socket(inst, cur);
+	for (i = 0; i < inst->num_slots; i++) {
+		if (inst->redis_pool[i].active)
+			redis_close_socket(inst, &inst->redis_pool[i]);
 	}
+	pthread_mutex_destroy(&inst->pool_size_mutex);
+	pthread_mutex_destroy(&inst->wait_mutex);
+	pthread_mutex_destroy(&inst->maintenance_mutex);
+	pthread_cond_destroy(&inst->maintenance_cond);
 
+	free(inst->redis_pool);
+	free(inst->free_map);
+	free(inst->dead_map);
 	inst->redis_pool = NULL;
-	inst->last_used = NULL;
+	inst->free_map = NULL;
+	inst->dead_map = NULL;
+	inst->pool_size = 0;
 }
 
 /*
- * Connect to a server.  If error, set this socket's state to be
- * "sockunconnected" and set a grace period, during which we won't try
- * connecting again (to prevent unduly lagging the server and being
- * impolite to a server that may be having other issues).  If
- * successful in connecting, set state to sockconnected.
- * - hh
+ * Reset a slot to a fresh, unconnected and unused socket.
  */
-static int connect_single_socket(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst) {
-	int i;
-	redisContext* c;
-	struct timeval timeout[2];
-	char *host;
-	int port;
-
-	/* convert timeout (ms) to timeval */
-	timeout[0].tv_sec = inst->config->connect_timeout / 1000;
-	timeout[0].tv_usec = 1000 * (inst->config->connect_timeout % 1000);
-	timeout[1].tv_sec = inst->config->net_readwrite_timeout / 1000;
-	timeout[1].tv_usec = 1000 * (inst->config->net_readwrite_timeout % 1000);
-
-	for (i = 0; i < inst->config->num_endpoints; i++) {
-		/*
-		 * Get the target host and port from the backup index
-		 */
-		host = inst->config->endpoints[redisocket->backup].host;
-		port = inst->config->endpoints[redisocket->backup].port;
-
-		c = redisConnectWithTimeout(host, port, timeout[0]);
-		if (c && c->err == 0) {
-//            DEBUG("%s: Connected new redis handle #%d @%d",
-//                __func__, redisocket->id, redisocket->backup);
-			redisocket->conn = c;
-			redisocket->state = sockconnected;
-//            if (inst->config->num_endpoints > 1) {
-//                /* Select the next _random_ endpoint as the new backup */
-//                redisocket->backup = (redisocket->backup + (1 +
-//                        rand() % (inst->config->num_endpoints - 1)
-//                    )) % inst->config->num_endpoints;
-//            }
-
-			if (inst->config->passwd[0] != '\0') {
-				redisReply *reply1 = (redisReply *) redisCommand(c, "AUTH %s",
-						inst->config->passwd);
-				if (reply1->type == REDIS_REPLY_ERROR) {
-
-					printf("Redis认证失败！\n");
-				} else {
-					printf("Redis认证成功！\n");
-				}
-				freeReplyObject(reply1);
-			}
-
-			if (redisSetTimeout(c, timeout[1]) != REDIS_OK) {
-				log_(L_WARN | L_CONS,
-						"%s: Failed to set timeout: blocking-mode: %d, %s",
-						__func__, (c->flags & REDIS_BLOCK), c->errstr);
-			}
-
-			if (redisEnableKeepAlive(c) != REDIS_OK) {
-				log_(L_WARN | L_CONS, "%s: Failed to enable keepalive: %s",
-						__func__, c->errstr);
-			}
-			log_(L_INFO | L_CONS, "%s: connect socket id=%d backup=%d",
-					__func__, redisocket->id, redisocket->backup);
-
-			return 0;
-		}
-
-		/* We have tried the last one but still fail */
-		if (i == inst->config->num_endpoints - 1) {
-			log_(L_WARN | L_CONS,
-					"%s: We have tried the last one but still fail, id=%d, backup=%d: %s,"
-							"host= %s,port=%d", __func__, redisocket->id,
-					redisocket->backup, c->errstr,
-					inst->config->endpoints[redisocket->backup].host,
-					inst->config->endpoints[redisocket->backup].port);
-			break;
-		}
-
-		/* We have more backups to try */
-		if (c) {
-			log_(L_WARN | L_CONS,
-					"%s: Failed to connect redis handle id=%d, backup=%d: %s, trying backup,"
-							"host= %s,port=%d", __func__, redisocket->id,
-					redisocket->backup, c->errstr,
-					inst->config->endpoints[redisocket->backup].host,
-					inst->config->endpoints[redisocket->backup].port);
-			redisFree(c);
-		} else {
-			log_(L_WARN | L_CONS,
-					"%s: can't allocate redis handle id=%d backup=%d, trying backup,",
-					__func__, redisocket->id, redisocket->backup);
-		}
-		redisocket->backup = (redisocket->backup + 1)
-				% inst->config->num_endpoints;
-	}
+static int redis_init_slot(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket, int id) {
+	int rcode;
 
-	/*
-	 *  Error, or SERVER_DOWN.
-	 */
-	if (c) {
-		log_(L_WARN | L_CONS, "%s: Failed to connect redis handle #%d @%d: %s",
-				__func__, redisocket->id, redisocket->backup, c->errstr);
-		redisFree(c);
-	} else {
-		log_(L_WARN | L_CONS, "%s: can't allocate redis handle #%d @%d",
-				__func__, redisocket->id, redisocket->backup);
-	}
 	redisocket->conn = NULL;
+	redisocket->id = id;
+	redisocket->home = id % inst->config->num_endpoints;
+	redisocket->backup = redisocket->home;
+	redisocket->connected_at = 0;
 	redisocket->state = sockunconnected;
-	redisocket->backup = (redisocket->backup + 1) % inst->config->num_endpoints;
-
-	inst->connect_after = time(NULL)
-			+ inst->config->connect_failure_retry_delay;
+	redisocket->inuse = 0;
+	redisocket->cached = 0;
+	redisocket->last_used = 0;
+	redisocket->active = 1;
+	redisocket->connect_failures = 0;
+	redisocket->next_connect_at = 0;
 
-	return -1;
+	rcode = pthread_mutex_init(&redisocket->mutex, NULL);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to init lock: returns (%d)", __func__, rcode);
+		redisocket->active = 0;
+		return -1;
+	}
+	return 0;
 }
 
-static int redis_close_socket(REDIS_INSTANCE *inst, REDIS_SOCKET * redisocket) {
-	int rcode;
+/*
+ * Per-thread starting point into the free map, so that threads do not
+ * all race for the same lowest free bit.
+ */
+static unsigned int next_thread_hint;
+static __thread unsigned int thread_hint __attribute__((tls_model("initial-exec")));
+static __thread int thread_hint_set __attribute__((tls_model("initial-exec")));
 
-	(void) inst;
+static unsigned int redis_thread_hint(void) {
+	if (!thread_hint_set) {
+		thread_hint = __atomic_fetch_add(&next_thread_hint, 1,
+				__ATOMIC_RELAXED) * 7;
+		thread_hint_set = 1;
+	}
+	return thread_hint;
+}
 
-	log_(L_INFO | L_CONS, "%s: Closing redis socket,state= %d id=%d backup=%d",
-			__func__, redisocket->state, redisocket->id, redisocket->backup);
+static unsigned int redis_thread_random(void) {
+	static __thread unsigned int state
+			__attribute__((tls_model("initial-exec")));
 
-	if (redisocket->state == sockconnected) {
-		redisFree(redisocket->conn);
-	}
+	if (state == 0)
+		state = (redis_thread_hint() + 1) * 2654435761u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
 
-	if (redisocket->inuse) {
-		log_(L_FATAL | L_CONS, "%s: I'm still in use. Bug?", __func__);
-	}
+/*
+ * The free map of one endpoint's sub-pool.  An idle socket's bit lives in
+ * the map of the endpoint it is connected to (its 'backup').
+ */
+static REDIS_FREE_WORD * redis_free_map(REDIS_INSTANCE *inst, int ep) {
+	return &inst->free_map[ep * inst->num_free_words];
+}
 
-	rcode = pthread_mutex_destroy(&redisocket->mutex);
-	if (rcode != 0) {
-		log_(L_WARN,
-				"%s: Failed to destroy lock: returns (%d),redisocket id:%d",
-				__func__, rcode, redisocket->id);
-	}
+/*
+ * Cost of sending the next request to an endpoint: its smoothed latency
+ * scaled by the requests already outstanding there.
+ */
+static unsigned long long redis_endpoint_score(REDIS_INSTANCE *inst, int ep) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[ep];
 
-	free(redisocket);
-	return 0;
+	return (unsigned long long) (__atomic_load_n(&es->latency_usec,
+			__ATOMIC_RELAXED) + 1)
+			* (__atomic_load_n(&es->inflight, __ATOMIC_RELAXED) + 1);
 }
 
-REDIS_SOCKET * redis_get_socket(REDIS_INSTANCE * inst) {
-	REDIS_SOCKET *cur, *start;
-	int tried_to_connect = 0;
-	int unconnected = 0;
-	int rcode, locked;
+/*
+ * Claim an idle socket from one sub-pool.  Clearing a slot's bit with an
+ * atomic fetch-and gives exclusive ownership of it, so acquiring costs
+ * one atomic operation per try instead of a mutex per socket.
+ *
+ * The socket is returned locked and marked in use.  Unconnected sockets
+ * are reconnected if some circuit lets us through, otherwise they are
+ * put back and skipped; each slot is tried at most once per call.  With
+ * a maintenance thread they are handed to it instead, so the caller
+ * never pays for connect(2).
+ */
+static REDIS_SOCKET * redis_claim_from(REDIS_INSTANCE *inst, int ep,
+		int *unconnected, int *tried_to_connect) {
+	int n, w, b, bit, sb;
+	uint64_t bits, mask;
+	unsigned int hint;
+	REDIS_SOCKET *cur;
+	REDIS_FREE_WORD *map = redis_free_map(inst, ep);
 
-	/*
-	 *  Start at the last place we left off.
-	 */
-	start = inst->last_used;
-	if (!start)
-		start = inst->redis_pool;
+	hint = redis_thread_hint();
+	sb = hint & 63;
 
-	cur = start;
+	for (n = 0; n < inst->num_free_words; n++) {
+		w = (hint + n) % inst->num_free_words;
+		bits = __atomic_load_n(&map[w].bits, __ATOMIC_RELAXED);
+		if (sb)
+			bits = (bits >> sb) | (bits << (64 - sb));
 
-	locked = 0;
-	while (cur) {
-		/*
-		 *  If this socket is in use by another thread,
-		 *  skip it, and try another socket.
-		 *
-		 *  If it isn't used, then grab it ourselves.
-		 */
-		if ((rcode = pthread_mutex_trylock(&cur->mutex)) != 0) {
-			goto next;
-		} /* else we now have the lock */
-		else {
-			locked = 1;
-			TRACE("%s: Obtained lock with handle %d", __func__, cur->id);
-		}
+		while (bits) {
+			b = __builtin_ctzll(bits);
+			bits &= bits - 1;
+			bit = (b + sb) & 63;
+			mask = (uint64_t) 1 << bit;
 
-		if (cur->inuse == 1) {
-			if (locked) {
-				if ((rcode = pthread_mutex_unlock(&cur->mutex)) != 0) {
-					log_(L_FATAL | L_CONS, "%s: "
-							"Can not release lock with handle %d: returns (%d)",
-							__func__, cur->id, rcode);
-				} else {
-					TRACE("%s: Released lock with handle %d", __func__,
-									cur->id);
-				}
+			if (!(__atomic_fetch_and(&map[w].bits, ~mask,
+					__ATOMIC_ACQUIRE) & mask)) {
+				/* somebody else got it first */
+				continue;
 			}
-			goto next;
-		} else {
-			cur->inuse = 1;
-		}
 
-		/*
-		 *  If we happen upon an unconnected socket, and
-		 *  this instance's grace period on
-		 *  (re)connecting has expired, then try to
-		 *  connect it.  This should be really rare.
-		 */
-		if ((cur->state == sockunconnected)
-				&& (time(NULL) > inst->connect_after)) {
-			log_(L_INFO, "%s: "
-					"Trying to (re)connect unconnected handle %d ...", __func__,
-					cur->id);
-			tried_to_connect++;
-			connect_single_socket(cur, inst);
-		}
+			cur = &inst->redis_pool[w * 64 + bit];
+			pthread_mutex_lock(&cur->mutex);
+			cur->inuse = 1;
+			TRACE("%s: Obtained lock with handle %d", __func__, cur->id);
 
-		/* if we still aren't connected, ignore this handle */
-		if (cur->state == sockunconnected) {
-			DEBUG("%s: "
-					"Ignoring unconnected handle %d ...", __func__, cur->id);
-			unconnected++;
+			if (cur->state == sockunconnected && inst->maintenance) {
+				(*unconnected)++;
+				redis_put_dead(inst, cur);
+				continue;
+			}
 
-			cur->inuse = 0;
+			/*
+			 *  If we happen upon an unconnected socket, and
+			 *  some endpoint's circuit lets us through, then
+			 *  try to connect it.  This should be really rare.
+			 */
+			if ((cur->state == sockunconnected)
+					&& redis_endpoints_available(inst)) {
+				log_(L_INFO, "%s: "
+						"Trying to (re)connect unconnected handle %d ...",
+						__func__, cur->id);
+				(*tried_to_connect)++;
+				connect_single_socket(cur, inst);
+			}
 
-			if ((rcode = pthread_mutex_unlock(&cur->mutex)) != 0) {
-				log_(L_FATAL | L_CONS, "%s: "
-						"Can not release lock with handle %d: returns (%d)",
-						__func__, cur->id, rcode);
-			} else {
-				TRACE("%s: Released lock with handle %d", __func__, cur->id);
+			/* if we still aren't connected, ignore this handle */
+			if (cur->state == sockunconnected) {
+				DEBUG("%s: "
+						"Ignoring unconnected handle %d ...", __func__, cur->id);
+				(*unconnected)++;
+				redis_put_socket(inst, cur);
+				continue;
 			}
 
-			goto next;
+			return cur;
 		}
+	}
 
-		/* should be connected, grab it */
-		DEBUG("%s: Obtained redis socket id: %d", __func__, cur->id);
+	return NULL;
+}
 
-		if (unconnected != 0 || tried_to_connect != 0) {
-			log_(L_INFO, "%s: "
-					"got socket %d after skipping %d unconnected handles, "
-					"tried to reconnect %d though", __func__, cur->id,
-					unconnected, tried_to_connect);
-		}
+/*
+ * Pick a sub-pool by the power of two choices: of two random endpoints,
+ * try the one with the lower score first, then the other, then the
+ * rest.  Slow or overloaded endpoints thus get less traffic without any
+ * global ordering to maintain.
+ */
+static REDIS_SOCKET * redis_claim_socket(REDIS_INSTANCE *inst,
+		int *unconnected, int *tried_to_connect) {
+	int n = inst->config->num_endpoints;
+	int a, b, t, i;
+	REDIS_SOCKET *cur;
 
-		/*
-		 *  The socket is returned in the locked
-		 *  state.
-		 *
-		 *  We also remember where we left off,
-		 *  so that the next search can start from
-		 *  here.
-		 *
-		 *  Note that multiple threads MAY over-write
-		 *  the 'inst->last_used' variable.  This is OK,
-		 *  as it's a pointer only used for reading.
-		 */
-		inst->last_used = cur->next;
+	if (n == 1)
+		return redis_claim_from(inst, 0, unconnected, tried_to_connect);
+
+	a = redis_thread_random() % n;
+	b = (a + 1 + redis_thread_random() % (n - 1)) % n;
+
+	/*
+	 *  One pick in 64 ignores the scores, so that an endpoint that
+	 *  was slow keeps getting samples and can win traffic back once
+	 *  it recovers.
+	 */
+	if ((redis_thread_random() & 63) != 0
+			&& redis_endpoint_score(inst, b) < redis_endpoint_score(inst, a)) {
+		t = a;
+		a = b;
+		b = t;
+	}
+
+	if ((cur = redis_claim_from(inst, a, unconnected, tried_to_connect))
+			|| (cur = redis_claim_from(inst, b, unconnected, tried_to_connect)))
 		return cur;
 
-		/* move along the list */
-		next: cur = cur->next;
+	for (i = 0; i < n; i++) {
+		if (i == a || i == b)
+			continue;
+		if ((cur = redis_claim_from(inst, i, unconnected, tried_to_connect)))
+			return cur;
+	}
 
-		/*
-		 *  Because we didnt start at the start, once we
-		 *  hit the end of the linklist, we should go
-		 *  back to the beginning and work toward the
-		 *  middle!
-		 */
-		if (!cur) {
-			cur = inst->redis_pool;
-		}
+	return NULL;
+}
 
-		/*
-		 *  If we're at the socket we started
-		 *  we can create new socket if the pool_size < max_num_redis_socks
-		 */
-		if (cur == start) {
-			//justic inst pool size < config->max_num_redis_socks
-			int pool_mutex_code = 0;
-			if ((pool_mutex_code = pthread_mutex_trylock(&inst->pool_size_mutex))
-					!= 0) {
-				log_(L_FATAL | L_CONS, "%s: can't lock pool_size_mutex",
-						__func__);
-				break;
-			}
-			/* else we now have the lock */
-			else {
-				TRACE("%s: pool_size_mutex lock ", __func__);
-
-				if (inst->pool_size < inst->config->max_num_redis_socks) {
-					log_(L_INFO | L_CONS, "%s: " "pool size is (%d) now,"
-							"create new socket", __func__, inst->pool_size);
-					// create new socket and return new socket
-					REDIS_SOCKET* sock = add_new_socket(inst);
-
-					if ((rcode = pthread_mutex_unlock(&inst->pool_size_mutex))
-							!= 0) {
-						log_(L_FATAL | L_CONS,
-								"%s: "
-										"Bug? Can not release pool_size_mutex: returns (%d)",
-								__func__, rcode);
-					} else {
-						TRACE("%s: Released pool_size_mutex", __func__);
-					}
-
-					if (sock != NULL) {
-						sock->inuse = 1;
-						if ((rcode = pthread_mutex_trylock(&sock->mutex))
-								!= 0) {
-							log_(L_FATAL | L_CONS,
-									"%s: " "Bug? Can not trylock new socket"
-											" from add_new_socket : returns (%d),socket id: %d",
-									__func__, rcode, sock->id);
-						}
-						inst->last_used = sock->next;
-						return sock;
-					}
-					else {
-						log_(L_FATAL | L_CONS,
-								"%s: ""There are no redis socket handles to use!",
-								__func__);
-						return NULL;
-					}
+/*
+ * Take back a socket this thread released earlier, without touching any
+ * shared state unless the socket was stolen meanwhile.
+ */
+static REDIS_SOCKET * redis_cache_get(REDIS_INSTANCE *inst) {
+	REDIS_THREAD_CACHE *tc = &thread_cache;
+	REDIS_SOCKET *cur;
 
+	if (tc->inst != inst || tc->generation != inst->generation)
+		return NULL;
 
-				}
-				// has be max_num_redis_socks,can't create new socket
-				// unlock the pool_size_mutex
-				else {
-					log_(L_FATAL | L_CONS,
-							"%s: " "pool_size > max_num_redis_socks", __func__);
-					if ((rcode = pthread_mutex_unlock(&inst->pool_size_mutex))
-							!= 0) {
-						log_(L_FATAL | L_CONS,
-								"%s: "
-										"Bug? Can not release pool_size_mutex: returns (%d)",
-								__func__, rcode);
-					} else {
-						TRACE("%s: Released pool_size_mutex", __func__);
-					}
-					break;
-				}
-			}
+	while (tc->count > 0) {
+		cur = tc->socks[--tc->count];
+		if (!__atomic_exchange_n(&cur->cached, 0, __ATOMIC_ACQUIRE)) {
+			/* stolen by a thread that found the pool empty */
+			continue;
 		}
 
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+		TRACE("%s: Reused cached handle %d", __func__, cur->id);
+		return cur;
 	}
 
-	/* We get here if every redis handle is unconnected and
-	 * unconnectABLE, or in use
-	 * or add_new_socket error
-	 */
-	log_(L_WARN,
-			"%s: "
-					"There are no redis handles to use! skipped %d, tried to connect %d",
-			__func__, unconnected, tried_to_connect);
 	return NULL;
 }
 
-REDIS_SOCKET * add_new_socket(REDIS_INSTANCE * inst) {
-	REDIS_SOCKET *redisocket;
-	redisocket = malloc(sizeof(REDIS_SOCKET));
-	redisocket->conn = NULL;
-	redisocket->id = inst->pool_size;
-	redisocket->backup = redisocket->id % inst->config->num_endpoints;
-	redisocket->state = sockunconnected;
-	redisocket->inuse = 0;
+/*
+ * Park a released socket in this thread's cache.  Returns 0 if the cache
+ * is disabled or full, in which case the caller puts it in the free map.
+ */
+static int redis_cache_put(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket) {
+	REDIS_THREAD_CACHE *tc = &thread_cache;
+	int rcode;
 
-	int rcode = pthread_mutex_init(&redisocket->mutex, NULL);
-	if (rcode != 0) {
-		log_(L_ERROR | L_CONS, "%s: "
-				"Failed to init lock: returns (%d)", __func__, rcode);
-		free(redisocket);
-		return NULL;
+	if (inst->config->thread_cache_size == 0
+			|| redisocket->state != sockconnected
+			|| __atomic_load_n(&inst->num_waiters, __ATOMIC_RELAXED) > 0)
+		return 0;
+
+	if (tc->inst != inst || tc->generation != inst->generation) {
+		/*
+		 *  Entries of another instance are abandoned, they
+		 *  are stolen back by that instance when it runs low.
+		 */
+		tc->inst = inst;
+		tc->generation = inst->generation;
+		tc->count = 0;
 	}
-	if (connect_single_socket(redisocket, inst) == 0) {
-		/* Add this socket to the list of sockets */
-		redisocket->next = inst->redis_pool;
-		inst->redis_pool = redisocket;
-		inst->pool_size++;
-		log_(L_INFO | L_CONS, "after add new socket,pool size = %d",
-				inst->pool_size);
-		return redisocket;
+
+	if (tc->count >= inst->config->thread_cache_size)
+		return 0;
+
+	redisocket->inuse = 0;
+	if (inst->maintenance)
+		redisocket->last_used = redis_monotonic_usec();
+	if ((rcode = pthread_mutex_unlock(&redisocket->mutex)) != 0) {
+		log_(L_FATAL | L_CONS, "%s: "
+				"Can not release lock with handle %d: returns (%d)", __func__,
+				redisocket->id, rcode);
 	}
-	log_(L_ERROR | L_CONS, "%s: "
-			"Failed to add_new_socket", __func__);
-	free(redisocket);
-	return NULL;
+	__atomic_store_n(&redisocket->cached, 1, __ATOMIC_RELEASE);
+	tc->socks[tc->count++] = redisocket;
 
+	return 1;
 }
 
-int reconnect_and_release_socket(REDIS_INSTANCE *inst,
-		REDIS_SOCKET * err_redisocket) {
+/*
+ * The free map is empty: take an idle socket out of some thread's cache
+ * before growing the pool.
+ */
+static REDIS_SOCKET * redis_steal_socket(REDIS_INSTANCE *inst) {
+	int i;
+	REDIS_SOCKET *cur;
+
+	if (inst->config->thread_cache_size == 0)
+		return NULL;
+
+	for (i = 0; i < inst->num_slots; i++) {
+		cur = &inst->redis_pool[i];
+		if (!__atomic_load_n(&cur->cached, __ATOMIC_RELAXED)
+				|| !__atomic_exchange_n(&cur->cached, 0, __ATOMIC_ACQUIRE))
+			continue;
 
-	if (err_redisocket->state == sockconnected) {
-		redisFree(err_redisocket->conn);
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+		DEBUG("%s: Stole cached handle %d", __func__, cur->id);
+		return cur;
 	}
 
-	REDIS_SOCKET *new_redisocket;
-	new_redisocket = malloc(sizeof(REDIS_SOCKET));
-	new_redisocket->conn = NULL;
-	new_redisocket->id = err_redisocket->id;
-	new_redisocket->backup = err_redisocket->backup;
-	new_redisocket->state = sockunconnected;
-	new_redisocket->inuse = 0;
+	return NULL;
+}
 
-	int rcode = pthread_mutex_init(&new_redisocket->mutex, NULL);
-	if (rcode != 0) {
-		log_(L_ERROR | L_CONS, "%s: "
-				"Failed to init lock: returns (%d)", __func__, rcode);
-		free(new_redisocket);
-		return -1;
+/*
+ * Give an owned socket back to the free map.
+ */
+static void redis_put_socket(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket) {
+	int rcode;
+	int id = redisocket->id;
+
+	redisocket->inuse = 0;
+	if (inst->maintenance)
+		redisocket->last_used = redis_monotonic_usec();
+	if ((rcode = pthread_mutex_unlock(&redisocket->mutex)) != 0) {
+		log_(L_FATAL | L_CONS, "%s: "
+				"Can not release lock with handle %d: returns (%d)", __func__,
+				id, rcode);
+	} else {
+		TRACE("%s: Released lock with handle %d", __func__, id);
 	}
 
-	REDIS_SOCKET *pMovePre;
-	REDIS_SOCKET *pMove;
-	pMovePre = inst->redis_pool;
-	pMove = inst->redis_pool->next;
+	/*
+	 *  Publish the socket first and only then look for waiters.  A
+	 *  waiter bumps num_waiters before its last look at the free map,
+	 *  so either it sees this bit or we see it queued.
+	 */
+	__atomic_fetch_or(&redis_free_map(inst, redisocket->backup)[id / 64].bits,
+			(uint64_t) 1 << (id % 64), __ATOMIC_SEQ_CST);
 
-	if (pMovePre != NULL && pMovePre->id == err_redisocket->id) {
-		connect_single_socket(new_redisocket, inst);
-		/* Add this socket to the list of sockets */
-		inst->redis_pool = new_redisocket;
-		new_redisocket->next = pMove;
+	if (__atomic_load_n(&inst->num_waiters, __ATOMIC_SEQ_CST) > 0
+			&& redisocket->state == sockconnected) {
+		redis_handoff_socket(inst, redisocket);
+	}
+}
 
-		log_(L_INFO, "%s: reconnect socket id= (%d)", __func__,
-				new_redisocket->id);
+/*
+ * Hand a just released socket directly to the longest waiting thread,
+ * provided nobody claimed it from the free map in the meantime.
+ */
+static void redis_handoff_socket(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket) {
+	REDIS_WAITER *w;
+	int id = redisocket->id;
+	uint64_t mask = (uint64_t) 1 << (id % 64);
 
-		int rcode = pthread_mutex_unlock(&err_redisocket->mutex);
+	pthread_mutex_lock(&inst->wait_mutex);
+	w = inst->wait_head;
+	if (w && (__atomic_fetch_and(
+			&redis_free_map(inst, redisocket->backup)[id / 64].bits, ~mask,
+			__ATOMIC_ACQUIRE) & mask)) {
+		inst->wait_head = w->next;
+		if (!inst->wait_head)
+			inst->wait_tail = NULL;
+		__atomic_sub_fetch(&inst->num_waiters, 1, __ATOMIC_SEQ_CST);
 
-		if (rcode != 0) {
-			log_(L_WARN, "%s: Failed to unlock lock: returns (%d)", __func__,
-					rcode);
-		}
-		rcode = pthread_mutex_destroy(&err_redisocket->mutex);
+		w->sock = redisocket;
+		pthread_cond_signal(&w->cond);
+		TRACE("%s: Handed handle %d to a waiter", __func__, id);
+	}
+	pthread_mutex_unlock(&inst->wait_mutex);
+}
 
-		if (rcode != 0) {
-			log_(L_WARN, "%s: Failed to destroy lock: returns (%d)", __func__,
-					rcode);
-		}
+/*
+ * Remove a waiter that gave up.  Called with wait_mutex held.
+ */
+static void redis_unlink_waiter(REDIS_INSTANCE *inst, REDIS_WAITER *w) {
+	REDIS_WAITER *prev = NULL;
+	REDIS_WAITER *cur;
 
-		free(err_redisocket);
-		err_redisocket = new_redisocket;
-		return 0;
+	for (cur = inst->wait_head; cur; prev = cur, cur = cur->next) {
+		if (cur != w)
+			continue;
+
+		if (prev)
+			prev->next = cur->next;
+		else
+			inst->wait_head = cur->next;
+		if (inst->wait_tail == cur)
+			inst->wait_tail = prev;
+		__atomic_sub_fetch(&inst->num_waiters, 1, __ATOMIC_SEQ_CST);
+		return;
 	}
+}
 
-	while (pMove != NULL) {
-		if (pMove->id == err_redisocket->id) {
+/*
+ * Connect to a server.  If error, set this socket's state to be
+ * "sockunconnected" and open that endpoint's circuit for a grace
+ * period, during which we won't try connecting to it again (to prevent
+ * unduly lagging the server and being impolite to a server that may be
+ * having other issues).  If successful in connecting, set state to
+ * sockconnected.
+ * - hh
+ */
+static int connect_single_socket(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst) {
+	int i;
+	int attempted = 0;
+	long long now = redis_monotonic_usec();
+	redisContext* c;
 
-			connect_single_socket(new_redisocket, inst);
-			/* Add this socket to the list of sockets */
-			pMovePre->next = new_redisocket;
-			new_redisocket->next = pMove->next;
+	if (now < redisocket->next_connect_at) {
+		TRACE("%s: handle %d backing off for another %lld usec", __func__,
+				redisocket->id, redisocket->next_connect_at - now);
+		return -1;
+	}
 
-			log_(L_INFO, "%s: reconnect  socket id= (%d)", __func__, pMove->id);
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		if (i > 0) {
+			/* We have more backups to try */
+			redisocket->backup = (redisocket->backup + 1)
+					% inst->config->num_endpoints;
+		}
 
-			int rcode = pthread_mutex_unlock(&err_redisocket->mutex);
-			if (rcode != 0) {
-				log_(L_WARN, "%s: Failed to unlock lock: returns (%d)",
-						__func__, rcode);
-			}
-			rcode = pthread_mutex_destroy(&err_redisocket->mutex);
+		/*
+		 * Failing over: promote a hot standby connection if there is
+		 * one, skipping DNS, the TCP handshake and AUTH.  It costs no
+		 * connect, so it is not charged to the endpoint's budget.
+		 */
+		c = NULL;
+		if (redisocket->backup != redisocket->home
+				&& redis_endpoint_might_allow(inst, redisocket->backup, now))
+			c = redis_take_standby(inst, redisocket->backup);
 
-			if (rcode != 0) {
-				log_(L_WARN, "%s: Failed to destroy lock: returns (%d)",
-						__func__, rcode);
+		if (c == NULL) {
+			/*
+			 * Skip endpoints whose circuit is open or whose connect
+			 * budget is spent without paying a connect timeout for
+			 * each of them
+			 */
+			if (!redis_endpoint_allow(inst, redisocket->backup)) {
+				TRACE("%s: endpoint @%d refused a connect, skipping",
+						__func__, redisocket->backup);
+				continue;
 			}
+			attempted++;
+			c = redis_connect_endpoint(inst, redisocket->backup,
+					redisocket->id);
+		}
+		if (c) {
+			redis_attach_connection(inst, redisocket, c);
+			log_(L_INFO | L_CONS, "%s: connect socket id=%d backup=%d",
+					__func__, redisocket->id, redisocket->backup);
 
-			free(err_redisocket);
-			err_redisocket = new_redisocket;
-			pMove = NULL;
 			return 0;
 		}
-		pMovePre = pMovePre->next;
-		pMove = pMove->next;
 	}
 
-	log_(L_WARN, "%s: can't reconnect error socket id= (%d)", __func__,
-			err_redisocket->id);
+	/*
+	 *  Error, SERVER_DOWN, or every circuit is open.
+	 */
+	if (attempted) {
+		log_(L_WARN | L_CONS,
+				"%s: We have tried the last one but still fail, id=%d, "
+						"tried %d endpoints", __func__, redisocket->id,
+				attempted);
+		redis_backoff_socket(inst, redisocket);
+	} else {
+		DEBUG("%s: every endpoint circuit is open, handle %d stays "
+				"unconnected", __func__, redisocket->id);
+	}
+	redisocket->conn = NULL;
+	redisocket->state = sockunconnected;
+	redisocket->backup = (redisocket->backup + 1) % inst->config->num_endpoints;
 
 	return -1;
 }
 
-int redis_release_socket(void* reply, REDIS_INSTANCE * inst,
-		REDIS_SOCKET * redisocket) {
-	int rcode;
+/*
+ * Keep a socket whose connects failed from retrying for a while.  The
+ * delay doubles per consecutive failure up to connect_backoff_max, and
+ * half of it is random so that sockets which failed together, in this
+ * process or across a fleet, spread their retries out instead of
+ * hitting a restarting server at the same instant.
+ */
+static void redis_backoff_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket) {
+	long long delay;
+	int shift;
 
-	//
-	if (reply == NULL || ((redisContext *) redisocket->conn)->err > 0) {
-		if (reconnect_and_release_socket(inst, redisocket) == 0) {
-			return 0;
+	if (inst->config->connect_backoff_max == 0)
+		return;
+
+	shift = redisocket->connect_failures < 16 ?
+			redisocket->connect_failures : 16;
+	redisocket->connect_failures++;
+
+	delay = (long long) REDIS_BACKOFF_BASE_MS << shift;
+	if (delay > inst->config->connect_backoff_max)
+		delay = inst->config->connect_backoff_max;
+	delay *= 1000;
+	delay = delay / 2 + redis_thread_random() % (delay / 2 + 1);
+
+	redisocket->next_connect_at = redis_monotonic_usec() + delay;
+	DEBUG("%s: handle %d retries in %lld usec after %d failures", __func__,
+			redisocket->id, delay, redisocket->connect_failures);
+}
+
+/*
+ * Open and set up one connection to endpoint 'idx' on behalf of socket
+ * 'id', and report the outcome to the endpoint's circuit breaker.
+ * Returns NULL on failure, and also if sentinel moved the endpoint
+ * while we were connecting to its old address.
+ */
+static redisContext * redis_connect_endpoint(REDIS_INSTANCE *inst, int idx,
+		int id) {
+	redisContext* c;
+	struct timeval timeout;
+	char host[256];
+	int port;
+	unsigned int epoch;
+
+	/* convert timeout (ms) to timeval */
+	timeout.tv_sec = inst->config->connect_timeout / 1000;
+	timeout.tv_usec = 1000 * (inst->config->connect_timeout % 1000);
+
+	epoch = redis_endpoint_address(inst, idx, host, &port);
+
+	c = redisConnectWithTimeout(host, port, timeout);
+	if (c == NULL || c->err != 0) {
+		redis_endpoint_report(inst, idx, 0);
+
+		if (c) {
+			log_(L_WARN | L_CONS,
+					"%s: Failed to connect redis handle id=%d, backup=%d: %s,"
+							"host= %s,port=%d", __func__, id, idx, c->errstr,
+					host, port);
+			redisFree(c);
+		} else {
+			log_(L_WARN | L_CONS,
+					"%s: can't allocate redis handle id=%d backup=%d",
+					__func__, id, idx);
 		}
+		return NULL;
 	}
+	if (redis_setup_connection(inst, c) < 0) {
+		redis_endpoint_report(inst, idx, 0);
+		redisFree(c);
+		return NULL;
+	}
+	redis_endpoint_report(inst, idx, 1);
 
-	(void) inst;
-	if (redisocket == NULL) {
-		return 0;
+	if (epoch != __atomic_load_n(&inst->epoch, __ATOMIC_ACQUIRE)) {
+		log_(L_INFO, "%s: %s:%d is no longer the primary, dropping handle "
+				"id=%d", __func__, host, port, id);
+		redisFree(c);
+		return NULL;
 	}
 
-	if (redisocket->inuse != 1) {
-		log_(L_FATAL | L_CONS, "%s: I'm NOT in use. Bug? socket id:%d",
-				__func__, redisocket->id);
+	return c;
+}
+
+/*
+ * Copy the address of endpoint 'idx', which sentinel may change under
+ * us, and return the epoch it belongs to.
+ */
+static unsigned int redis_endpoint_address(REDIS_INSTANCE *inst, int idx,
+		char *host, int *port) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+	unsigned int epoch;
+
+	pthread_mutex_lock(&es->mutex);
+	strcpy(host, inst->config->endpoints[idx].host);
+	*port = inst->config->endpoints[idx].port;
+	epoch = inst->epoch;
+	pthread_mutex_unlock(&es->mutex);
+
+	return epoch;
+}
+
+/*
+ * Set the read/write timeout and keepalive of a freshly connected,
+ * blocking context and send it the handshake: AUTH, SELECT, CLIENT
+ * SETNAME and init_commands go out in one write and their replies are
+ * read back together, so a new connection costs one round trip however
+ * much of that is configured.  Returns -1 if any of them fails.
+ */
+static int redis_setup_connection(REDIS_INSTANCE *inst, redisContext *c) {
+	struct timeval timeout;
+	redisReply *reply;
+	int i, rcode = 0;
+
+	timeout.tv_sec = inst->config->net_readwrite_timeout / 1000;
+	timeout.tv_usec = 1000 * (inst->config->net_readwrite_timeout % 1000);
+
+	if (redisSetTimeout(c, timeout) != REDIS_OK) {
+		log_(L_WARN | L_CONS,
+				"%s: Failed to set timeout: blocking-mode: %d, %s",
+				__func__, (c->flags & REDIS_BLOCK), c->errstr);
 	}
-	redisocket->inuse = 0;
 
-	if ((rcode = pthread_mutex_unlock(&redisocket->mutex)) != 0) {
-		log_(L_FATAL | L_CONS, "%s: "
-				"Can not release lock with handle %d: returns (%d)", __func__,
-				redisocket->id, rcode);
-	} else {
-		TRACE("%s: Released lock with handle %d", __func__, redisocket->id);
+	if (inst->handshake_replies > 0) {
+		if (redisAppendFormattedCommand(c, inst->handshake,
+				inst->handshake_len) != REDIS_OK) {
+			log_(L_ERROR | L_CONS, "%s: Failed to queue handshake: %s",
+					__func__, c->errstr);
+			return -1;
+		}
+
+		/* read every reply, even after an error, to keep them in step */
+		for (i = 0; i < inst->handshake_replies; i++) {
+			if (redisGetReply(c, (void **) &reply) != REDIS_OK) {
+				log_(L_ERROR | L_CONS, "%s: Handshake failed: %s", __func__,
+						c->errstr);
+				return -1;
+			}
+			if (reply->type == REDIS_REPLY_ERROR) {
+				log_(L_ERROR | L_CONS, "%s: Handshake command %d of %d "
+						"failed: %s", __func__, i + 1,
+						inst->handshake_replies, reply->str);
+				rcode = -1;
+			}
+			freeReplyObject(reply);
+		}
+		if (rcode < 0)
+			return -1;
 	}
 
-	DEBUG("%s: Released redis socket id: %d", __func__, redisocket->id);
+	if (redisEnableKeepAlive(c) != REDIS_OK) {
+		log_(L_WARN | L_CONS, "%s: Failed to enable keepalive: %s",
+				__func__, c->errstr);
+	}
 
 	return 0;
 }
 
-void* redis_command(REDIS_SOCKET* redisocket, REDIS_INSTANCE* inst,
-		const char* format, ...) {
-	va_list ap;
-	void *reply;
-	va_start(ap, format);
-	reply = redis_vcommand(redisocket, inst, format, ap);
-	va_end(ap);
-	return reply;
+/*
+ * Free the connection of a socket, if any, and mark it unconnected.  The
+ * slot itself, its mutex and its statistics are left alone.
+ */
+static void redis_drop_connection(REDIS_SOCKET *redisocket) {
+	if (redisocket->conn)
+		redisFree(redisocket->conn);
+	redisocket->conn = NULL;
+	redisocket->state = sockunconnected;
 }
 
-void* redis_vcommand(REDIS_SOCKET* redisocket, REDIS_INSTANCE* inst,
-		const char* format, va_list ap) {
-	va_list ap2;
-	void *reply;
-	redisContext* c;
+/*
+ * Format the handshake of redis_setup_connection once, so that each new
+ * connection only has to write it out.
+ */
+static int redis_build_handshake(REDIS_INSTANCE *inst) {
+	char *cmd, *line, *save, *buf;
+	const char *argv[64];
+	int i, argc, len;
 
-	va_copy(ap2, ap);
+	for (i = -3; i < inst->config->num_init_commands; i++) {
+		cmd = NULL;
+		len = 0;
+		if (i == -3 && inst->config->passwd[0] != '\0') {
+			len = redisFormatCommand(&cmd, "AUTH %s", inst->config->passwd);
+		} else if (i == -2 && inst->config->db > 0) {
+			len = redisFormatCommand(&cmd, "SELECT %d", inst->config->db);
+		} else if (i == -1 && inst->config->client_name[0] != '\0') {
+			len = redisFormatCommand(&cmd, "CLIENT SETNAME %s",
+					inst->config->client_name);
+		} else if (i >= 0 && inst->config->init_commands[i]) {
+			line = strdup(inst->config->init_commands[i]);
+			argc = 0;
+			for (argv[argc] = strtok_r(line, " \t", &save);
+					argv[argc] && argc < 63;
+					argv[argc] = strtok_r(NULL, " \t", &save))
+				argc++;
+			if (argc > 0)
+				len = redisFormatCommandArgv(&cmd, argc, argv, NULL);
+			free(line);
+		}
+		if (len < 0) {
+			log_(L_ERROR | L_CONS, "%s: Failed to format handshake", __func__);
+			return -1;
+		}
+		if (cmd == NULL)
+			continue;
 
-	/* forward to hiredis API */
-	c = redisocket->conn;
-	reply = redisvCommand(c, format, ap);
+		buf = realloc(inst->handshake, inst->handshake_len + len);
+		if (buf == NULL) {
+			free(cmd);
+			return -1;
+		}
+		memcpy(buf + inst->handshake_len, cmd, len);
+		inst->handshake = buf;
+		inst->handshake_len += len;
+		inst->handshake_replies++;
+		free(cmd);
+	}
 
-	if (reply == NULL) {
-		/* Once an error is returned the context cannot be reused and you shoud
-		 set up a new connection.
-		 */
+	DEBUG("%s: %d commands, %d bytes", __func__, inst->handshake_replies,
+			(int) inst->handshake_len);
+	return 0;
+}
 
-		/* close the socket that failed */
-		redisFree(c);
+/*
+ * Make 'c' the connection of a socket.  A new connection is in the
+ * session state the handshake left it in.
+ */
+static void redis_attach_connection(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket, redisContext *c) {
+	redisocket->conn = c;
+	redisocket->db = inst->config->db;
+	strcpy(redisocket->client_name, inst->config->client_name);
+	redisocket->readonly = 0;
+	redisocket->transaction = 0;
+	redisocket->state = sockconnected;
+	redisocket->connected_at = redis_monotonic_usec();
+	redisocket->connect_failures = 0;
+	redisocket->next_connect_at = 0;
+	redisocket->epoch = __atomic_load_n(&inst->epoch, __ATOMIC_ACQUIRE);
+}
 
-		/* reconnect the socket */
-		if (connect_single_socket(redisocket, inst) < 0) {
-			log_(L_ERROR | L_CONS, "%s: Reconnect failed, server down?",
-					__func__);
-			goto quit;
-		}
+/*
+ * The parallel form of connect_single_socket, for filling the pool at
+ * startup and after an outage.  Every socket in 'socks' that is not
+ * backing off gets a non-blocking connect to its current endpoint, all
+ * of them are waited for together with epoll, and whoever failed moves
+ * on to the next endpoint in the next round.  So connecting n sockets
+ * takes at most one connect_timeout per endpoint instead of one per
+ * socket per endpoint.  Circuit breakers, connect budgets, standbys and
+ * backoff apply just as in connect_single_socket.
+ *
+ * The callers hold every socket.  Returns the number connected.
+ */
+static int redis_connect_sockets(REDIS_INSTANCE *inst, REDIS_SOCKET **socks,
+		int n) {
+	int i, k, r, nev, pending, flags, epfd, port;
+	int connected = 0;
+	unsigned int *epochs;
+	char host[256];
+	long long now, deadline;
+	redisContext *c, **conns;
+	signed char *tried;
+	REDIS_SOCKET *cur;
+	struct epoll_event ev, events[64];
 
-		/* retry on the newly connected socket */
-		c = redisocket->conn;
-		reply = redisvCommand(c, format, ap2);
+	if (n <= 0)
+		return 0;
 
-		if (reply == NULL) {
-			log_(L_ERROR, "%s: Failed after reconnect: %s (%d)", __func__,
-					c->errstr, c->err);
+	conns = calloc(n, sizeof(redisContext *));
+	tried = calloc(n, 1);
+	/* the instance epoch each socket's endpoint address was read at */
+	epochs = calloc(n, sizeof(unsigned int));
+	epfd = epoll_create(n < 64 ? n : 64);
+	if (conns == NULL || tried == NULL || epochs == NULL || epfd < 0) {
+		log_(L_WARN, "%s: falling back to connecting one by one", __func__);
+		free(conns);
+		free(tried);
+		free(epochs);
+		if (epfd >= 0)
+			close(epfd);
+		for (i = 0; i < n; i++) {
+			if (connect_single_socket(socks[i], inst) == 0)
+				connected++;
+		}
+		return connected;
+	}
+
+	now = redis_monotonic_usec();
+	for (i = 0; i < n; i++) {
+		if (socks[i]->state == sockconnected || now < socks[i]->next_connect_at)
+			tried[i] = -1;
+	}
+
+	for (r = 0; r < inst->config->num_endpoints; r++) {
+		pending = 0;
+		now = redis_monotonic_usec();
+
+		for (i = 0; i < n; i++) {
+			cur = socks[i];
+			if (tried[i] < 0 || cur->state == sockconnected)
+				continue;
+			if (r > 0) {
+				/* We have more backups to try */
+				cur->backup = (cur->backup + 1) % inst->config->num_endpoints;
+			}
+
+			c = NULL;
+			if (cur->backup != cur->home
+					&& redis_endpoint_might_allow(inst, cur->backup, now))
+				c = redis_take_standby(inst, cur->backup);
+			if (c) {
+				redis_attach_connection(inst, cur, c);
+				connected++;
+				continue;
+			}
+
+			if (!redis_endpoint_allow(inst, cur->backup))
+				continue;
+			tried[i] = 1;
+
+			epochs[i] = redis_endpoint_address(inst, cur->backup, host, &port);
+			c = redisConnectNonBlock(host, port);
+			if (c == NULL || c->err != 0) {
+				log_(L_WARN | L_CONS, "%s: Failed to connect redis handle "
+						"id=%d, backup=%d: %s", __func__, cur->id, cur->backup,
+						c ? c->errstr : "can't allocate redis handle");
+				redis_endpoint_report(inst, cur->backup, 0);
+				if (c)
+					redisFree(c);
+				continue;
+			}
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLOUT;
+			ev.data.u32 = i;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+				redis_endpoint_report(inst, cur->backup, 0);
+				redisFree(c);
+				continue;
+			}
+			conns[i] = c;
+			pending++;
+		}
+
+		deadline = now + (long long) inst->config->connect_timeout * 1000;
+		while (pending > 0) {
+			k = -1;
+			if (inst->config->connect_timeout > 0) {
+				now = redis_monotonic_usec();
+				k = now < deadline ? (int) ((deadline - now + 999) / 1000) : 0;
+			}
+			nev = epoll_wait(epfd, events, 64, k);
+			if (nev < 0 && errno == EINTR)
+				continue;
+			if (nev <= 0)
+				break;
+
+			for (k = 0; k < nev; k++) {
+				i = events[k].data.u32;
+				c = conns[i];
+				cur = socks[i];
+				conns[i] = NULL;
+				pending--;
+				epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, &ev);
+
+				/* back to blocking, as redisConnectWithTimeout leaves it */
+				flags = fcntl(c->fd, F_GETFL);
+				if (redisCheckSocketError(c) != REDIS_OK || flags < 0
+						|| fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+					log_(L_WARN | L_CONS, "%s: Failed to connect redis handle "
+							"id=%d, backup=%d: %s", __func__, cur->id,
+							cur->backup, c->err ? c->errstr : strerror(errno));
+					redis_endpoint_report(inst, cur->backup, 0);
+					redisFree(c);
+					continue;
+				}
+				c->flags |= REDIS_BLOCK;
+				if (redis_setup_connection(inst, c) < 0) {
+					redis_endpoint_report(inst, cur->backup, 0);
+					redisFree(c);
+					continue;
+				}
+				redis_endpoint_report(inst, cur->backup, 1);
+				if (epochs[i]
+						!= __atomic_load_n(&inst->epoch, __ATOMIC_ACQUIRE)) {
+					/* sentinel moved it, the next round tries again */
+					redisFree(c);
+					continue;
+				}
+
+				redis_attach_connection(inst, cur, c);
+				connected++;
+				log_(L_INFO | L_CONS, "%s: connect socket id=%d backup=%d",
+						__func__, cur->id, cur->backup);
+			}
+		}
+
+		/* whatever is left timed out */
+		for (i = 0; i < n; i++) {
+			if (conns[i] == NULL)
+				continue;
+			log_(L_WARN | L_CONS, "%s: Timed out connecting redis handle "
+					"id=%d, backup=%d", __func__, socks[i]->id,
+					socks[i]->backup);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, conns[i]->fd, &ev);
+			redis_endpoint_report(inst, socks[i]->backup, 0);
+			redisFree(conns[i]);
+			conns[i] = NULL;
+		}
+
+		if (connected == n)
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		cur = socks[i];
+		if (cur->state == sockconnected || tried[i] < 0)
+			continue;
+		cur->conn = NULL;
+		cur->backup = (cur->backup + 1) % inst->config->num_endpoints;
+		if (tried[i] > 0)
+			redis_backoff_socket(inst, cur);
+	}
+
+	close(epfd);
+	free(epochs);
+	free(tried);
+	free(conns);
+
+	return connected;
+}
+
+static int redis_close_socket(REDIS_INSTANCE *inst, REDIS_SOCKET * redisocket) {
+	int rcode;
+
+	(void) inst;
+
+	log_(L_INFO | L_CONS, "%s: Closing redis socket,state= %d id=%d backup=%d",
+			__func__, redisocket->state, redisocket->id, redisocket->backup);
+
+	redis_drop_connection(redisocket);
+
+	if (redisocket->inuse) {
+		log_(L_FATAL | L_CONS, "%s: I'm still in use. Bug?", __func__);
+	}
+
+	rcode = pthread_mutex_destroy(&redisocket->mutex);
+	if (rcode != 0) {
+		log_(L_WARN,
+				"%s: Failed to destroy lock: returns (%d),redisocket id:%d",
+				__func__, rcode, redisocket->id);
+	}
+
+	return 0;
+}
+
+REDIS_SOCKET * redis_get_socket(REDIS_INSTANCE * inst) {
+	return redis_get_socket_prio(inst, 0, REDIS_PRIORITY_NORMAL);
+}
+
+static REDIS_SOCKET * redis_get_pool_socket(REDIS_INSTANCE *inst) {
+	REDIS_SOCKET *cur;
+	int tried_to_connect = 0;
+	int unconnected = 0;
+	int rcode;
+
+	cur = redis_cache_get(inst);
+	if (cur)
+		return cur;
+
+	cur = redis_claim_socket(inst, &unconnected, &tried_to_connect);
+	if (!cur)
+		cur = redis_steal_socket(inst);
+	if (cur) {
+		/* should be connected, grab it */
+		DEBUG("%s: Obtained redis socket id: %d", __func__, cur->id);
+
+		if (unconnected != 0 || tried_to_connect != 0) {
+			log_(L_INFO, "%s: "
+					"got socket %d after skipping %d unconnected handles, "
+					"tried to reconnect %d though", __func__, cur->id,
+					unconnected, tried_to_connect);
+		}
+
+		/*
+		 *  The socket is returned in the locked
+		 *  state.
+		 */
+		return cur;
+	}
+
+	/*
+	 *  Every socket is busy or unusable.  The maintenance thread, if
+	 *  any, grows the pool off the request path; queued callers of
+	 *  redis_get_socket_timed get the new socket handed over.
+	 */
+	if (inst->maintenance) {
+		if (inst->pool_size < inst->config->max_num_redis_socks
+				&& !__atomic_exchange_n(&inst->grow_requested, 1,
+						__ATOMIC_ACQ_REL)) {
+			redis_kick_maintenance(inst);
+		}
+		goto none;
+	}
+
+	/*
+	 *  we can create new socket if the pool_size < max_num_redis_socks
+	 */
+	if ((rcode = pthread_mutex_trylock(&inst->pool_size_mutex)) != 0) {
+		DEBUG("%s: pool_size_mutex busy, another thread is growing the pool",
+				__func__);
+		goto none;
+	}
+	TRACE("%s: pool_size_mutex lock ", __func__);
+
+	if (inst->pool_size < inst->config->max_num_redis_socks) {
+		log_(L_INFO | L_CONS, "%s: " "pool size is (%d) now,"
+				"create new socket", __func__, inst->pool_size);
+		// create new socket and return new socket
+		REDIS_SOCKET* sock = add_new_socket(inst);
+
+		if ((rcode = pthread_mutex_unlock(&inst->pool_size_mutex)) != 0) {
+			log_(L_FATAL | L_CONS, "%s: "
+					"Bug? Can not release pool_size_mutex: returns (%d)",
+					__func__, rcode);
+		} else {
+			TRACE("%s: Released pool_size_mutex", __func__);
+		}
+
+		if (sock != NULL) {
+			pthread_mutex_lock(&sock->mutex);
+			sock->inuse = 1;
+			return sock;
+		}
+		goto none;
+	}
+
+	// has be max_num_redis_socks,can't create new socket
+	// unlock the pool_size_mutex
+	DEBUG("%s: " "pool_size >= max_num_redis_socks", __func__);
+	if ((rcode = pthread_mutex_unlock(&inst->pool_size_mutex)) != 0) {
+		log_(L_FATAL | L_CONS, "%s: "
+				"Bug? Can not release pool_size_mutex: returns (%d)",
+				__func__, rcode);
+	} else {
+		TRACE("%s: Released pool_size_mutex", __func__);
+	}
+
+	/* We get here if every redis handle is unconnected and
+	 * unconnectABLE, or in use
+	 * or add_new_socket error
+	 *
+	 * This is routine under bursts, callers are expected to retry or
+	 * use redis_get_socket_timed, so do not flood the log.
+	 */
+	none:
+	__atomic_add_fetch(&inst->stats.exhausted, 1, __ATOMIC_RELAXED);
+	DEBUG("%s: "
+			"There are no redis handles to use! skipped %d, tried to connect %d",
+			__func__, unconnected, tried_to_connect);
+	return NULL;
+}
+
+static long long redis_monotonic_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Like redis_get_socket, but for database 'db': a socket already in it
+ * is preferred, from this thread's cache first and then from the free
+ * map, and only if there is none is another one switched with SELECT.
+ */
+REDIS_SOCKET * redis_get_socket_db(REDIS_INSTANCE * inst, int db) {
+	REDIS_SOCKET *v;
+
+	if (inst->cluster) {
+		log_(L_ERROR, "%s: Not with keys spread over nodes", __func__);
+		return NULL;
+	}
+	if (inst->mux == NULL)
+		return redis_get_pool_socket_db(inst, db);
+
+	/* the multiplexed connections are all in the configured database */
+	v = redis_get_virtual(inst, REDIS_PRIORITY_NORMAL);
+	if (v == NULL || db == inst->config->db)
+		return v;
+
+	v->pinned = redis_get_pool_socket_db(inst, db);
+	if (v->pinned == NULL) {
+		redis_put_virtual(inst, v);
+		return NULL;
+	}
+	__atomic_add_fetch(&inst->stats.mux_pinned, 1, __ATOMIC_RELAXED);
+	v->db = db;
+	return v;
+}
+
+static REDIS_SOCKET * redis_get_pool_socket_db(REDIS_INSTANCE *inst, int db) {
+	REDIS_SOCKET *cur;
+	int deadline_ms = 0;
+
+	if (!inst->admission)
+		return redis_find_socket_db(inst, db);
+
+	if (redis_take_quota(inst, REDIS_PRIORITY_NORMAL, &deadline_ms) < 0)
+		return NULL;
+	cur = redis_find_socket_db(inst, db);
+	if (cur) {
+		cur->quota = 1;
+		cur->acquired_at = redis_monotonic_usec();
+		__atomic_add_fetch(&inst->stats.served, 1, __ATOMIC_RELAXED);
+	} else {
+		redis_put_quota(inst);
+	}
+	return cur;
+}
+
+static REDIS_SOCKET * redis_find_socket_db(REDIS_INSTANCE *inst, int db) {
+	REDIS_SOCKET *cur;
+	redisReply *reply;
+
+	cur = redis_cache_get_db(inst, db);
+	if (cur == NULL)
+		cur = redis_claim_db(inst, db);
+	if (cur) {
+		__atomic_add_fetch(&inst->stats.db_hits, 1, __ATOMIC_RELAXED);
+		return cur;
+	}
+
+	cur = redis_get_pool_socket(inst);
+	if (cur == NULL || cur->db == db)
+		return cur;
+
+	__atomic_add_fetch(&inst->stats.db_switches, 1, __ATOMIC_RELAXED);
+	reply = redis_command(cur, inst, "SELECT %d", db);
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		log_(L_ERROR, "%s: Failed to select db %d on handle %d: %s",
+				__func__, db, cur->id, reply ? reply->str : "I/O error");
+		redis_release_socket(reply, inst, cur);
+		if (reply)
+			freeReplyObject(reply);
+		return NULL;
+	}
+	freeReplyObject(reply);
+
+	return cur;
+}
+
+static REDIS_SOCKET * redis_cache_get_db(REDIS_INSTANCE *inst, int db) {
+	REDIS_THREAD_CACHE *tc = &thread_cache;
+	REDIS_SOCKET *cur;
+	int i;
+
+	if (tc->inst != inst || tc->generation != inst->generation)
+		return NULL;
+
+	for (i = tc->count - 1; i >= 0; i--) {
+		cur = tc->socks[i];
+		if (cur->db != db)
+			continue;
+
+		tc->socks[i] = tc->socks[--tc->count];
+		if (!__atomic_exchange_n(&cur->cached, 0, __ATOMIC_ACQUIRE))
+			continue;
+
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+		TRACE("%s: Reused cached handle %d in db %d", __func__, cur->id, db);
+		return cur;
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim a free, connected socket in database 'db', if any.  The db of a
+ * free socket is only written by its previous holder before it was
+ * released, so reading it before claiming is merely a hint that is
+ * checked again once the socket is ours.
+ */
+static REDIS_SOCKET * redis_claim_db(REDIS_INSTANCE *inst, int db) {
+	int e, ep, w, bit;
+	uint64_t bits;
+	REDIS_SOCKET *cur;
+	REDIS_FREE_WORD *map;
+
+	ep = redis_thread_random() % inst->config->num_endpoints;
+	for (e = 0; e < inst->config->num_endpoints; e++) {
+		map = redis_free_map(inst, (ep + e) % inst->config->num_endpoints);
+
+		for (w = 0; w < inst->num_free_words; w++) {
+			bits = __atomic_load_n(&map[w].bits, __ATOMIC_RELAXED);
+			while (bits) {
+				bit = __builtin_ctzll(bits);
+				bits &= bits - 1;
+				cur = &inst->redis_pool[w * 64 + bit];
+				if (__atomic_load_n(&cur->db, __ATOMIC_RELAXED) != db
+						|| !redis_claim_bit(map, w * 64 + bit))
+					continue;
+
+				pthread_mutex_lock(&cur->mutex);
+				cur->inuse = 1;
+				if (cur->state == sockconnected && cur->db == db)
+					return cur;
+				redis_put_socket(inst, cur);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Like redis_get_socket, but if the pool is exhausted queue up behind
+ * earlier waiters and take the next released socket.  Waiters are served
+ * strictly in arrival order and newcomers do not jump the queue.
+ */
+REDIS_SOCKET * redis_get_socket_timed(REDIS_INSTANCE * inst, int deadline_ms) {
+	return redis_get_socket_prio(inst, deadline_ms, REDIS_PRIORITY_NORMAL);
+}
+
+/*
+ * Sockets are taken in priority order: waiters of a higher class are
+ * queued ahead, and with reserved_high_socks set the other classes
+ * together may not hold more than max_num_redis_socks minus that many,
+ * which leaves the rest for REDIS_PRIORITY_HIGH however busy the pool.
+ */
+REDIS_SOCKET * redis_get_socket_prio(REDIS_INSTANCE * inst, int deadline_ms,
+		int priority) {
+	if (inst->cluster) {
+		log_(L_ERROR, "%s: Keys are spread over nodes, use "
+				"redis_get_socket_key", __func__);
+		return NULL;
+	}
+	if (inst->mux)
+		return redis_get_virtual(inst, priority);
+	return redis_get_pool_socket_prio(inst, deadline_ms, priority);
+}
+
+static REDIS_SOCKET * redis_get_pool_socket_prio(REDIS_INSTANCE *inst,
+		int deadline_ms, int priority) {
+	REDIS_SOCKET *cur;
+	int quota;
+
+	if (!inst->admission)
+		return redis_get_pool_socket_timed(inst, deadline_ms, priority);
+
+	/* fail fast rather than time out at the back of the queue */
+	if (deadline_ms > 0 && inst->config->latency_target > 0
+			&& redis_should_shed(inst, deadline_ms)) {
+		__atomic_add_fetch(&inst->stats.shed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	quota = priority != REDIS_PRIORITY_HIGH;
+	if (quota && redis_take_quota(inst, priority, &deadline_ms) < 0)
+		return NULL;
+
+	cur = redis_get_pool_socket_timed(inst, deadline_ms, priority);
+	if (cur) {
+		cur->quota = quota;
+		cur->acquired_at = redis_monotonic_usec();
+		__atomic_add_fetch(&inst->stats.served, 1, __ATOMIC_RELAXED);
+	} else if (quota) {
+		redis_put_quota(inst);
+	}
+	return cur;
+}
+
+/*
+ * Count one more socket held outside REDIS_PRIORITY_HIGH, waiting up to
+ * *deadline_ms for the count to drop under its limit.  Waiters are woken
+ * by class, and nobody jumps the queue while there are any.  What is
+ * left of the deadline is written back.
+ */
+static int redis_take_quota(REDIS_INSTANCE *inst, int priority,
+		int *deadline_ms) {
+	int limit = redis_quota_limit(inst);
+	int n = __atomic_load_n(&inst->quota_used, __ATOMIC_RELAXED);
+	struct timespec ts;
+	long long start;
+	int rcode = 0, taken = 0;
+
+	if (priority < 0 || priority >= REDIS_PRIORITY_CLASSES)
+		priority = REDIS_PRIORITY_LOW;
+
+	while (n < limit && __atomic_load_n(&inst->num_quota_waiters,
+			__ATOMIC_SEQ_CST) == 0) {
+		if (__atomic_compare_exchange_n(&inst->quota_used, &n, n + 1, 1,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return 0;
+	}
+
+	__atomic_add_fetch(&inst->stats.reserve_denied, 1, __ATOMIC_RELAXED);
+	if (*deadline_ms == 0)
+		return -1;
+
+	start = redis_monotonic_usec();
+	if (*deadline_ms > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += *deadline_ms / 1000;
+		ts.tv_nsec += (long) (*deadline_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&inst->quota_mutex);
+	inst->quota_waiters[priority]++;
+	__atomic_add_fetch(&inst->num_quota_waiters, 1, __ATOMIC_SEQ_CST);
+	while (!taken && rcode != ETIMEDOUT) {
+		n = __atomic_load_n(&inst->quota_used, __ATOMIC_SEQ_CST);
+		if (n < redis_quota_limit(inst)) {
+			taken = __atomic_compare_exchange_n(&inst->quota_used, &n, n + 1,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (*deadline_ms > 0)
+			rcode = pthread_cond_timedwait(&inst->quota_cond[priority],
+					&inst->quota_mutex, &ts);
+		else
+			pthread_cond_wait(&inst->quota_cond[priority],
+					&inst->quota_mutex);
+	}
+	inst->quota_waiters[priority]--;
+	__atomic_sub_fetch(&inst->num_quota_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&inst->quota_mutex);
+
+	if (!taken)
+		return -1;
+	if (*deadline_ms > 0) {
+		*deadline_ms -= (redis_monotonic_usec() - start) / 1000;
+		if (*deadline_ms <= 0)
+			*deadline_ms = 1;
+	}
+	return 0;
+}
+
+/*
+ * How many sockets callers below REDIS_PRIORITY_HIGH may hold: what is
+ * not reserved, or less while the adaptive limit says so.
+ */
+static int redis_quota_limit(REDIS_INSTANCE *inst) {
+	int limit = inst->config->max_num_redis_socks
+			- inst->config->reserved_high_socks;
+	int adaptive;
+
+	if (inst->config->latency_target > 0) {
+		adaptive = __atomic_load_n(&inst->limit_milli, __ATOMIC_RELAXED)
+				/ 1000;
+		if (adaptive < limit)
+			limit = adaptive;
+	}
+	return limit;
+}
+
+/*
+ * Whether a caller would, by the look of the queue ahead of it, still be
+ * waiting when its deadline passes.  Every 'limit' sockets released let
+ * one more waiter through, and a socket is held for hold_usec on
+ * average.
+ */
+static int redis_should_shed(REDIS_INSTANCE *inst, int deadline_ms) {
+	long long queued, hold;
+	int limit = redis_quota_limit(inst);
+
+	queued = __atomic_load_n(&inst->num_waiters, __ATOMIC_RELAXED)
+			+ __atomic_load_n(&inst->num_quota_waiters, __ATOMIC_RELAXED);
+	if (queued == 0
+			&& __atomic_load_n(&inst->quota_used, __ATOMIC_RELAXED) < limit)
+		return 0;
+
+	hold = __atomic_load_n(&inst->hold_usec, __ATOMIC_RELAXED);
+	return (queued + 1) * hold / limit > (long long) deadline_ms * 1000;
+}
+
+/*
+ * AIMD on command latency.  A command within latency_target adds 1/limit
+ * to the limit, so it grows by about one per round of commands; a slower
+ * or failed one takes a tenth off, at most once per its own latency, so
+ * that a burst of slow replies counts as the one signal it is.
+ */
+static void redis_adapt_limit(REDIS_INSTANCE *inst, long long usec, int ok) {
+	int max = 1000 * (inst->config->max_num_redis_socks
+			- inst->config->reserved_high_socks);
+	int cur, next;
+	long long now, cut_at;
+
+	cur = __atomic_load_n(&inst->limit_milli, __ATOMIC_RELAXED);
+	if (ok && usec <= inst->config->latency_target) {
+		if (cur >= max)
+			return;
+		next = cur + 1000000 / cur;
+		if (next > max)
+			next = max;
+		/* a lost race loses one step, no matter */
+		__atomic_compare_exchange_n(&inst->limit_milli, &cur, next, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		return;
+	}
+
+	now = redis_monotonic_usec();
+	cut_at = __atomic_load_n(&inst->limit_cut_at, __ATOMIC_RELAXED);
+	if (now - cut_at < usec || !__atomic_compare_exchange_n(
+			&inst->limit_cut_at, &cut_at, now, 0, __ATOMIC_RELAXED,
+			__ATOMIC_RELAXED))
+		return;
+
+	do {
+		next = cur * 9 / 10;
+		if (next < 1000)
+			next = 1000;
+	} while (!__atomic_compare_exchange_n(&inst->limit_milli, &cur, next, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	DEBUG("%s: %s after %lld usec, concurrency limit %d", __func__,
+			ok ? "slow reply" : "failure", usec, next / 1000);
+}
+
+static void redis_put_quota(REDIS_INSTANCE *inst) {
+	int i;
+
+	__atomic_sub_fetch(&inst->quota_used, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&inst->num_quota_waiters, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&inst->quota_mutex);
+		for (i = 0; i < REDIS_PRIORITY_CLASSES; i++) {
+			if (inst->quota_waiters[i] > 0) {
+				pthread_cond_signal(&inst->quota_cond[i]);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&inst->quota_mutex);
+	}
+}
+
+static REDIS_SOCKET * redis_get_pool_socket_timed(REDIS_INSTANCE *inst,
+		int deadline_ms, int priority) {
+	REDIS_WAITER w, **pp;
+	REDIS_SOCKET *cur, *extra = NULL;
+	pthread_condattr_t attr;
+	struct timespec ts;
+	long long start, waited;
+	int tried_to_connect = 0, unconnected = 0;
+	int rcode = 0, bucket;
+
+	if (__atomic_load_n(&inst->num_waiters, __ATOMIC_SEQ_CST) == 0
+			|| deadline_ms == 0) {
+		cur = redis_get_pool_socket(inst);
+		if (cur || deadline_ms == 0)
+			return cur;
+	}
+
+	start = redis_monotonic_usec();
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	w.sock = NULL;
+	w.priority = priority;
+	w.next = NULL;
+
+	pthread_mutex_lock(&inst->wait_mutex);
+	if (inst->wait_tail == NULL || inst->wait_tail->priority <= priority) {
+		if (inst->wait_tail)
+			inst->wait_tail->next = &w;
+		else
+			inst->wait_head = &w;
+		inst->wait_tail = &w;
+	} else {
+		/* ahead of the first waiter of a lower class */
+		for (pp = &inst->wait_head; (*pp)->priority <= priority;
+				pp = &(*pp)->next)
+			;
+		w.next = *pp;
+		*pp = &w;
+	}
+	__atomic_add_fetch(&inst->num_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&inst->wait_mutex);
+
+	/* a socket may have been released before we were queued */
+	extra = redis_claim_socket(inst, &unconnected, &tried_to_connect);
+
+	pthread_mutex_lock(&inst->wait_mutex);
+	if (extra && !w.sock) {
+		redis_unlink_waiter(inst, &w);
+		w.sock = extra;
+		extra = NULL;
+	}
+
+	if (deadline_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += deadline_ms / 1000;
+		ts.tv_nsec += (long) (deadline_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	while (!w.sock && rcode != ETIMEDOUT) {
+		if (deadline_ms > 0)
+			rcode = pthread_cond_timedwait(&w.cond, &inst->wait_mutex, &ts);
+		else
+			pthread_cond_wait(&w.cond, &inst->wait_mutex);
+	}
+
+	if (!w.sock) {
+		redis_unlink_waiter(inst, &w);
+		inst->stats.timeouts++;
+	}
+
+	waited = redis_monotonic_usec() - start;
+	inst->stats.waits++;
+	inst->stats.wait_usec_total += waited;
+	if ((unsigned long) waited > inst->stats.wait_usec_max)
+		inst->stats.wait_usec_max = waited;
+	for (bucket = 0; bucket < HIREDISPOOL_WAIT_BUCKETS - 1
+			&& waited >= (1LL << bucket); bucket++)
+		;
+	inst->stats.wait_hist[bucket]++;
+	pthread_mutex_unlock(&inst->wait_mutex);
+
+	pthread_cond_destroy(&w.cond);
+
+	/* we were handed a socket and also claimed one, give one back */
+	if (extra)
+		redis_put_socket(inst, extra);
+
+	cur = w.sock;
+	if (cur) {
+		/* handed over sockets are unlocked, see redis_handoff_socket */
+		if (cur->inuse == 0) {
+			pthread_mutex_lock(&cur->mutex);
+			cur->inuse = 1;
+		}
+		DEBUG("%s: Obtained redis socket id: %d after %lld usec", __func__,
+				cur->id, waited);
+	} else {
+		DEBUG("%s: Timed out after %lld usec", __func__, waited);
+	}
+
+	return cur;
+}
+
+int redis_pool_get_stats(REDIS_INSTANCE * inst, REDIS_POOL_STATS * stats) {
+	int i, n;
+
+	if (inst == NULL || stats == NULL)
+		return -1;
+
+	/* the redirects; the rest is in the node pools */
+	if (inst->cluster) {
+		memset(stats, 0, sizeof(*stats));
+		stats->moved = __atomic_load_n(&inst->stats.moved, __ATOMIC_RELAXED);
+		stats->asked = __atomic_load_n(&inst->stats.asked, __ATOMIC_RELAXED);
+		stats->slot_refreshes = __atomic_load_n(&inst->stats.slot_refreshes,
+				__ATOMIC_RELAXED);
+		n = __atomic_load_n(&inst->cluster->num_nodes, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++)
+			stats->pool_size += inst->cluster->pools[i]->pool_size;
+		return 0;
+	}
+
+	pthread_mutex_lock(&inst->wait_mutex);
+	*stats = inst->stats;
+	stats->exhausted = __atomic_load_n(&inst->stats.exhausted,
+			__ATOMIC_RELAXED);
+	stats->concurrency_limit = redis_quota_limit(inst);
+	stats->waiters = inst->num_waiters;
+	pthread_mutex_unlock(&inst->wait_mutex);
+	stats->pool_size = inst->pool_size;
+
+	return 0;
+}
+
+/*
+ * Initialize and connect the first unused slot.  Called with
+ * pool_size_mutex held; the new socket is not put in the free map, it
+ * goes straight to the caller.
+ */
+static REDIS_SOCKET * add_new_socket(REDIS_INSTANCE * inst) {
+	REDIS_SOCKET *redisocket = NULL;
+	int i;
+
+	for (i = 0; i < inst->num_slots; i++) {
+		if (!inst->redis_pool[i].active) {
+			redisocket = &inst->redis_pool[i];
+			break;
+		}
+	}
+	if (redisocket == NULL) {
+		return NULL;
+	}
+
+	if (redis_init_slot(inst, redisocket, i) < 0) {
+		return NULL;
+	}
+
+	if (connect_single_socket(redisocket, inst) == 0) {
+		/* Add this socket to the pool */
+		inst->pool_size++;
+		__atomic_add_fetch(&inst->stats.grown, 1, __ATOMIC_RELAXED);
+		log_(L_INFO | L_CONS, "after add new socket,pool size = %d",
+				inst->pool_size);
+		return redisocket;
+	}
+	log_(L_ERROR | L_CONS, "%s: "
+			"Failed to add_new_socket", __func__);
+	pthread_mutex_destroy(&redisocket->mutex);
+	redisocket->active = 0;
+	return NULL;
+
+}
+
+/*
+ * Reconnect a broken socket in place and give it back to the pool.  The
+ * caller holds it, so nothing else can see the slot meanwhile; its id,
+ * mutex, endpoint and statistics stay as they are.  If the reconnect
+ * fails it goes back unconnected and the next redis_get_socket that
+ * picks it retries.
+ */
+static int reconnect_and_release_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET * err_redisocket) {
+	int rcode;
+
+	redis_drop_connection(err_redisocket);
+	rcode = connect_single_socket(err_redisocket, inst);
+
+	log_(L_INFO, "%s: reconnect socket id= (%d) %s", __func__,
+			err_redisocket->id, rcode == 0 ? "done" : "failed");
+
+	redis_put_socket(inst, err_redisocket);
+	return rcode;
+}
+
+int redis_release_socket(void* reply, REDIS_INSTANCE * inst,
+		REDIS_SOCKET * redisocket) {
+	if (redisocket == NULL) {
+		return 0;
+	}
+
+	if (inst->cluster && (inst = redis_cluster_owner(inst, redisocket)) == NULL)
+		return -1;
+
+	if (redisocket->mux) {
+		if (redisocket->pinned)
+			redis_release_socket(reply, inst, redisocket->pinned);
+		redis_put_virtual(inst, redisocket);
+		return 0;
+	}
+
+	if (redisocket->acquired_at) {
+		/* EWMA with a weight of 1/8 for the new sample */
+		long hold = __atomic_load_n(&inst->hold_usec, __ATOMIC_RELAXED);
+		hold += (long) (redis_monotonic_usec() - redisocket->acquired_at
+				- hold) / 8;
+		__atomic_store_n(&inst->hold_usec, hold, __ATOMIC_RELAXED);
+		redisocket->acquired_at = 0;
+	}
+	if (redisocket->quota) {
+		redisocket->quota = 0;
+		redis_put_quota(inst);
+	}
+	/* the next caller's reads have nothing to do with it */
+	redisocket->transaction = 0;
+
+	/* a stale epoch means it is connected to a demoted primary */
+	if (reply == NULL || redisocket->conn == NULL
+			|| ((redisContext *) redisocket->conn)->err > 0
+			|| redisocket->epoch != __atomic_load_n(&inst->epoch,
+					__ATOMIC_RELAXED)) {
+		if (inst->maintenance)
+			redis_put_dead(inst, redisocket);
+		else
+			reconnect_and_release_socket(inst, redisocket);
+		return 0;
+	}
+
+	if (redisocket->inuse != 1) {
+		log_(L_FATAL | L_CONS, "%s: I'm NOT in use. Bug? socket id:%d",
+				__func__, redisocket->id);
+	}
+	if (!redis_cache_put(inst, redisocket))
+		redis_put_socket(inst, redisocket);
+
+	DEBUG("%s: Released redis socket id: %d", __func__, redisocket->id);
+
+	return 0;
+}
+
+void* redis_command(REDIS_SOCKET* redisocket, REDIS_INSTANCE* inst,
+		const char* format, ...) {
+	va_list ap;
+	void *reply;
+	va_start(ap, format);
+	reply = redis_vcommand(redisocket, inst, format, ap);
+	va_end(ap);
+	return reply;
+}
+
+void* redis_vcommand(REDIS_SOCKET* redisocket, REDIS_INSTANCE* inst,
+		const char* format, va_list ap) {
+	void *reply = NULL;
+	char *cmd;
+	int len;
+
+	/*
+	 * Format it ourselves, which is all redisvCommand does first, so
+	 * that the session state can be tracked and the very same bytes
+	 * resent after a reconnect.
+	 */
+	len = redisvFormatCommand(&cmd, format, ap);
+	if (len < 0) {
+		log_(L_ERROR, "%s: Failed to format command", __func__);
+		return NULL;
+	}
+
+	reply = redis_route(redisocket, inst, REDIS_CONSISTENCY_DEFAULT, cmd, len);
+	free(cmd);
+	return reply;
+}
+
+void* redis_command_consistency(REDIS_SOCKET* redisocket, REDIS_INSTANCE* inst,
+		int consistency, const char* format, ...) {
+	void *reply;
+	va_list ap;
+	char *cmd;
+	int len;
+
+	va_start(ap, format);
+	len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
+	if (len < 0) {
+		log_(L_ERROR, "%s: Failed to format command", __func__);
+		return NULL;
+	}
+
+	reply = redis_route(redisocket, inst, consistency, cmd, len);
+	free(cmd);
+	return reply;
+}
+
+void* redis_command_key(REDIS_INSTANCE* inst, const char* key, size_t keylen,
+		const char* format, ...) {
+	REDIS_SOCKET *sock;
+	REDIS_ARG arg;
+	void *reply = NULL;
+	va_list ap;
+	char *cmd;
+	int len;
+
+	va_start(ap, format);
+	len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
+	if (len < 0) {
+		log_(L_ERROR, "%s: Failed to format command", __func__);
+		return NULL;
+	}
+
+	if (inst->cluster) {
+		arg.str = key;
+		arg.len = keylen;
+		reply = redis_cluster_command(inst, &arg, cmd, len);
+	} else if ((sock = redis_get_socket_timed(inst,
+			inst->config->net_readwrite_timeout)) != NULL) {
+		reply = redis_route(sock, inst, REDIS_CONSISTENCY_DEFAULT, cmd, len);
+		redis_release_socket(reply, inst, sock);
+	}
+
+	free(cmd);
+	return reply;
+}
+
+/*
+ * Send a formatted command to the node serving it in cluster and sharded
+ * mode, or to a replica if it may be read from one, or else on the
+ * socket it is issued on.
+ */
+static void* redis_route(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		int consistency, const char *cmd, size_t len) {
+	REDIS_INSTANCE *r = inst->replicas;
+	REDIS_SOCKET *sock;
+	void *reply = NULL;
+
+	if (inst->cluster) {
+		if (redisocket == NULL)
+			return redis_cluster_command(inst, NULL, cmd, len);
+		if ((inst = redis_cluster_owner(inst, redisocket)) == NULL)
+			return NULL;
+		return redis_dispatch(redisocket, inst, cmd, len);
+	}
+
+	if (r == NULL || !redis_replica_read(redisocket, inst, consistency, cmd,
+			len))
+		return redis_dispatch(redisocket, inst, cmd, len);
+
+	/* a caller with a socket of its own does not wait for the replicas */
+	sock = redis_get_socket_timed(r,
+			redisocket ? 0 : r->config->net_readwrite_timeout);
+	if (sock) {
+		reply = redis_dispatch(sock, r, cmd, len);
+		redis_release_socket(reply, r, sock);
+	}
+	__atomic_add_fetch(&inst->stats.replica_reads, 1, __ATOMIC_RELAXED);
+
+	if (reply == NULL && redisocket) {
+		__atomic_add_fetch(&inst->stats.replica_fallbacks, 1,
+				__ATOMIC_RELAXED);
+		reply = redis_dispatch(redisocket, inst, cmd, len);
+	}
+	return reply;
+}
+
+/*
+ * Whether a command may be answered by a replica: it is read-only and
+ * neither the call nor the config asks for strong consistency, and the
+ * connection it would otherwise go to is in no transaction and in the
+ * database the replicas are.
+ */
+static int redis_replica_read(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		int consistency, const char *cmd, size_t len) {
+	REDIS_SOCKET *real;
+
+	if (consistency == REDIS_CONSISTENCY_DEFAULT)
+		consistency = inst->config->consistency;
+	if (consistency == REDIS_CONSISTENCY_STRONG)
+		return 0;
+
+	real = redisocket && redisocket->mux ? redisocket->pinned : redisocket;
+	if (real && (real->transaction || real->db != inst->config->db))
+		return 0;
+
+	return (redis_command_flags(cmd, len) & REDIS_CMD_READONLY) != 0;
+}
+
+/*
+ * Send a formatted command the way the socket it is issued on calls for:
+ * on the blocking lane, on a real connection or multiplexed.
+ */
+static void* redis_dispatch(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len) {
+	void *reply = NULL;
+	long timeout_ms;
+	int flags;
+
+	/*
+	 * Blocking commands go to the lane unless the caller holds a real
+	 * connection anyway, its own or one it is pinned to.
+	 */
+	flags = inst->config->max_blocking_socks > 0 && (redisocket == NULL
+			|| (redisocket->mux && redisocket->pinned == NULL)) ?
+			redis_command_blocks(cmd, len, &timeout_ms) : 0;
+
+	if (flags) {
+		reply = redis_blocking_command(inst, cmd, len, timeout_ms);
+	} else if (redisocket == NULL) {
+		log_(L_ERROR, "%s: No socket given for a command that does not go "
+				"to the blocking lane", __func__);
+	} else if (redisocket->mux == NULL) {
+		reply = redis_socket_command(redisocket, inst, cmd, len);
+	} else if (redisocket->pinned == NULL
+			&& !((flags = redis_command_flags(cmd, len)) & REDIS_CMD_PINNED)) {
+		reply = redis_mux_command(redisocket, inst, flags & REDIS_CMD_BULK,
+				cmd, len);
+	} else if (redis_pin_socket(inst, redisocket) != NULL) {
+		reply = redis_socket_command(redisocket->pinned, inst, cmd, len);
+	}
+
+	return reply;
+}
+
+/*
+ * Send one formatted command on a real socket and read its reply,
+ * reconnecting and resending once if the connection turns out broken.
+ */
+static void* redis_socket_command(REDIS_SOCKET *redisocket,
+		REDIS_INSTANCE *inst, const char *cmd, size_t len) {
+	void *reply = NULL;
+	redisContext* c;
+	REDIS_ENDPOINT_STATE *es;
+	long long start;
+	long delay;
+
+	es = &inst->endpoint_state[redisocket->backup];
+	__atomic_add_fetch(&es->inflight, 1, __ATOMIC_RELAXED);
+	start = redis_monotonic_usec();
+
+	/* forward to hiredis API, unless an earlier reconnect failed */
+	c = redisocket->conn;
+	if (c) {
+		delay = redis_hedge_delay(redisocket, inst, cmd, len);
+		if (redisAppendFormattedCommand(c, cmd, len) != REDIS_OK
+				|| (delay > 0 ? redis_hedged_reply(redisocket, inst, cmd, len,
+						delay, &reply) : redisGetReply(c, &reply)) != REDIS_OK)
+			reply = NULL;
+		redis_endpoint_observe(es, redis_monotonic_usec() - start,
+				reply != NULL);
+		if (inst->config->latency_target > 0)
+			redis_adapt_limit(inst, redis_monotonic_usec() - start,
+					reply != NULL);
+	}
+
+	if (reply == NULL) {
+		/* Once an error is returned the context cannot be reused and you shoud
+		 set up a new connection.
+		 */
+
+		/* close the socket that failed */
+		redis_drop_connection(redisocket);
+
+		/* leave reconnecting to the maintenance thread */
+		if (inst->maintenance) {
+			log_(L_ERROR, "%s: Command failed on handle %d, "
+					"handing it to the maintenance thread", __func__,
+					redisocket->id);
+			goto quit;
+		}
+
+		/* reconnect the socket */
+		if (connect_single_socket(redisocket, inst) < 0) {
+			log_(L_ERROR | L_CONS, "%s: Reconnect failed, server down?",
+					__func__);
+			goto quit;
+		}
+
+		/* retry on the newly connected socket */
+		c = redisocket->conn;
+		if (redisAppendFormattedCommand(c, cmd, len) != REDIS_OK
+				|| redisGetReply(c, &reply) != REDIS_OK)
+			reply = NULL;
+
+		if (reply == NULL) {
+			log_(L_ERROR, "%s: Failed after reconnect: %s (%d)", __func__,
+					c->errstr, c->err);
 
 			/* do not need clean up here because the next caller will retry. */
 			goto quit;
 		}
 	}
 
-	quit:
-	va_end(ap2);
-	return reply;
+	quit:
+	if (reply)
+		redis_track_session(redisocket, cmd, len,
+				((redisReply *) reply)->type == REDIS_REPLY_ERROR);
+	__atomic_sub_fetch(&es->inflight, 1, __ATOMIC_RELAXED);
+	return reply;
+}
+
+/*
+ * Hedged reads.  With hedge_delay set a read-only command that has no
+ * reply after the delay is sent once more, on an idle socket of another
+ * endpoint, and whichever reply comes first is taken.  The loser's
+ * connection still owes a reply and is closed.  Every hedgeable read
+ * earns hedge_budget percent of a hedge, so hedges stay at that share
+ * of reads however slow an endpoint gets.
+ */
+
+/*
+ * How long to wait for a reply before hedging a command, in usec, or 0
+ * if it is not to be hedged.
+ */
+static long redis_hedge_delay(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len) {
+	REDIS_ENDPOINT_STATE *es;
+	int flags, credit, burst = REDIS_HEDGE_BURST * 1000;
+
+	if (inst->config->hedge_delay == 0 || inst->config->num_endpoints < 2
+			|| redisocket->transaction)
+		return 0;
+	flags = redis_command_flags(cmd, len);
+	if (!(flags & REDIS_CMD_READONLY) || (flags & REDIS_CMD_BLOCKING))
+		return 0;
+
+	credit = __atomic_add_fetch(&inst->hedge_credit,
+			inst->config->hedge_budget * 10, __ATOMIC_RELAXED);
+	if (credit > burst)
+		__atomic_store_n(&inst->hedge_credit, burst, __ATOMIC_RELAXED);
+
+	if (inst->config->hedge_delay > 0)
+		return inst->config->hedge_delay;
+
+	es = &inst->endpoint_state[redisocket->backup];
+	if (__atomic_load_n(&es->commands, __ATOMIC_RELAXED)
+			< REDIS_HEDGE_MIN_SAMPLES)
+		return 0;
+	return __atomic_load_n(&es->p95_usec, __ATOMIC_RELAXED) + 1;
+}
+
+/* Spend one hedge of the budget, if there is one */
+static int redis_hedge_allow(REDIS_INSTANCE *inst) {
+	int credit = __atomic_load_n(&inst->hedge_credit, __ATOMIC_RELAXED);
+
+	while (credit >= 1000) {
+		if (__atomic_compare_exchange_n(&inst->hedge_credit, &credit,
+				credit - 1000, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * An idle, connected socket on another endpoint than 'redisocket', in
+ * the same session state.  Never waits: a hedge is only worth sending
+ * on a socket nobody needs.
+ */
+static REDIS_SOCKET * redis_hedge_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket) {
+	REDIS_SOCKET *h;
+	long long now = redis_monotonic_usec();
+	int i, ep, unconnected = 0, tried_to_connect = 0;
+
+	for (i = 1; i < inst->config->num_endpoints; i++) {
+		ep = (redisocket->backup + i) % inst->config->num_endpoints;
+		if (!redis_endpoint_might_allow(inst, ep, now))
+			continue;
+		h = redis_claim_from(inst, ep, &unconnected, &tried_to_connect);
+		if (h == NULL)
+			continue;
+		if (h->db == redisocket->db && h->readonly == redisocket->readonly)
+			return h;
+		redis_put_socket(inst, h);
+	}
+	return NULL;
+}
+
+/*
+ * redisGetReply for a command written to 'redisocket' and worth
+ * hedging after 'delay' usec.  A hedge that wins trades connections
+ * with 'redisocket', so the caller keeps one that is in step with its
+ * replies and the one that is not goes back to be reconnected.
+ */
+static int redis_hedged_reply(REDIS_SOCKET *redisocket, REDIS_INSTANCE *inst,
+		const char *cmd, size_t len, long delay, void **reply) {
+	redisContext *ctx[2];
+	REDIS_SOCKET *h;
+	REDIS_ENDPOINT_STATE *hes;
+	struct pollfd pfd[2];
+	struct timespec ts;
+	long long start, deadline = 0, now;
+	int i, n, rc, alive = 3, winner = -1, timeout = -1, idx[2];
+	void *r;
+
+	ctx[0] = redisocket->conn;
+	if (redis_flush(ctx[0]) != REDIS_OK)
+		return REDIS_ERR;
+
+	pfd[0].fd = ctx[0]->fd;
+	pfd[0].events = POLLIN;
+	ts.tv_sec = delay / 1000000;
+	ts.tv_nsec = (delay % 1000000) * 1000;
+	if (ppoll(pfd, 1, &ts, NULL) != 0
+			|| (h = redis_hedge_socket(inst, redisocket)) == NULL)
+		return redisGetReply(ctx[0], reply);
+	if (!redis_hedge_allow(inst)) {
+		redis_put_socket(inst, h);
+		return redisGetReply(ctx[0], reply);
+	}
+
+	ctx[1] = h->conn;
+	hes = &inst->endpoint_state[h->backup];
+	__atomic_add_fetch(&hes->inflight, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&inst->stats.hedged, 1, __ATOMIC_RELAXED);
+	start = redis_monotonic_usec();
+	if (redisAppendFormattedCommand(ctx[1], cmd, len) != REDIS_OK
+			|| redis_flush(ctx[1]) != REDIS_OK)
+		alive = 1;
+
+	if (inst->config->net_readwrite_timeout > 0)
+		deadline = start + (long long) inst->config->net_readwrite_timeout
+				* 1000;
+	*reply = NULL;
+	while (winner < 0 && alive) {
+		for (i = n = 0; i < 2; i++) {
+			if (!(alive & (1 << i)))
+				continue;
+			pfd[n].fd = ctx[i]->fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			idx[n++] = i;
+		}
+		if (deadline) {
+			now = redis_monotonic_usec();
+			if (now >= deadline)
+				break;
+			timeout = (int) ((deadline - now + 999) / 1000);
+		}
+		rc = poll(pfd, n, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+
+		for (i = 0; i < n && winner < 0; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			r = NULL;
+			if (redisBufferRead(ctx[idx[i]]) != REDIS_OK
+					|| redisGetReplyFromReader(ctx[idx[i]], &r) != REDIS_OK) {
+				alive &= ~(1 << idx[i]);
+			} else if (r) {
+				winner = idx[i];
+				*reply = r;
+			}
+		}
+	}
+
+	redis_endpoint_observe(hes, redis_monotonic_usec() - start, winner == 1);
+	__atomic_sub_fetch(&hes->inflight, 1, __ATOMIC_RELAXED);
+	if (winner == 1) {
+		__atomic_add_fetch(&inst->stats.hedge_wins, 1, __ATOMIC_RELAXED);
+		redis_swap_connection(redisocket, h);
+	}
+
+	/* whichever connection h has now still owes a reply */
+	if (inst->maintenance) {
+		redis_put_dead(inst, h);
+	} else {
+		redis_drop_connection(h);
+		redis_put_socket(inst, h);
+	}
+
+	return winner >= 0 ? REDIS_OK : REDIS_ERR;
+}
+
+/*
+ * Trade the connections of two sockets held by the caller, along with
+ * the endpoint and session state that go with them.
+ */
+static void redis_swap_connection(REDIS_SOCKET *a, REDIS_SOCKET *b) {
+	REDIS_SOCKET t;
+
+	t.conn = a->conn;
+	t.backup = a->backup;
+	t.connected_at = a->connected_at;
+	t.epoch = a->epoch;
+	t.readonly = a->readonly;
+	t.db = a->db;
+	memcpy(t.client_name, a->client_name, sizeof(t.client_name));
+
+	a->conn = b->conn;
+	a->backup = b->backup;
+	a->connected_at = b->connected_at;
+	a->epoch = b->epoch;
+	a->readonly = b->readonly;
+	a->db = b->db;
+	memcpy(a->client_name, b->client_name, sizeof(a->client_name));
+
+	b->conn = t.conn;
+	b->backup = t.backup;
+	b->connected_at = t.connected_at;
+	b->epoch = t.epoch;
+	b->readonly = t.readonly;
+	b->db = t.db;
+	memcpy(b->client_name, t.client_name, sizeof(b->client_name));
+}
+
+/* Write out what is queued on a blocking context, as redisGetReply does */
+static int redis_flush(redisContext *c) {
+	int done = 0;
+
+	do {
+		if (redisBufferWrite(c, &done) != REDIS_OK)
+			return REDIS_ERR;
+	} while (!done);
+	return REDIS_OK;
+}
+
+/*
+ * Split a command formatted by redisFormatCommand and friends into its
+ * arguments, at most 'max' of them.  Returns the number of arguments of
+ * the command, which may be more than 'max', or -1 if it is not a
+ * well-formed RESP array.
+ */
+static int redis_parse_command(const char *cmd, size_t len, REDIS_ARG *argv,
+		int max) {
+	const char *p = cmd, *end = cmd + len;
+	char *e;
+	long argc, alen;
+	int i;
+
+	if (len < 4 || *p != '*')
+		return -1;
+	argc = strtol(p + 1, &e, 10);
+	if (e + 2 > end || e[0] != '\r' || argc < 0)
+		return -1;
+	p = e + 2;
+
+	for (i = 0; i < argc && i < max; i++) {
+		if (p >= end || *p != '$')
+			return -1;
+		alen = strtol(p + 1, &e, 10);
+		if (alen < 0 || e + 2 + alen + 2 > end)
+			return -1;
+		argv[i].str = e + 2;
+		argv[i].len = alen;
+		p = e + 2 + alen + 2;
+	}
+
+	return argc;
+}
+
+static int redis_compare_command(const void *key, const void *elem) {
+	const REDIS_ARG *name = key;
+	const REDIS_COMMAND_INFO *info = elem;
+	int rcode = strncasecmp(name->str, info->name, name->len);
+
+	if (rcode == 0 && info->name[name->len] != '\0')
+		return -1;
+	return rcode;
+}
+
+static const REDIS_COMMAND_INFO * redis_lookup_command(const REDIS_ARG *name) {
+	return bsearch(name, redis_commands,
+			sizeof(redis_commands) / sizeof(redis_commands[0]),
+			sizeof(REDIS_COMMAND_INFO), redis_compare_command);
+}
+
+/*
+ * Follow the session state of a socket through a command that got a
+ * reply on it, 'failed' if that is an error.  A failed command changes
+ * nothing but a failed EXEC or DISCARD, which leaves no transaction
+ * either.  Only commands sent through redis_command are seen; whoever
+ * changes the state over the raw connection has to live with the pool
+ * not knowing.
+ */
+static void redis_track_session(REDIS_SOCKET *redisocket, const char *cmd,
+		size_t len, int failed) {
+	REDIS_ARG argv[3];
+	const REDIS_COMMAND_INFO *info;
+	int argc;
+	size_t n;
+
+	argc = redis_parse_command(cmd, len, argv, 3);
+	if (argc < 1 || (info = redis_lookup_command(&argv[0])) == NULL
+			|| !(info->flags & (REDIS_CMD_SESSION | REDIS_CMD_TRANSACTION)))
+		return;
+	if (failed && (argv[0].str[0] | 0x20) != 'e'
+			&& (argv[0].str[0] | 0x20) != 'd')
+		return;
+
+	switch (argv[0].str[0] | 0x20) {
+	case 's':/* SELECT db */
+		if (argc == 2 && argv[0].len == 6
+				&& strncasecmp(argv[0].str, "select", 6) == 0)
+			redisocket->db = atoi(argv[1].str);
+		break;
+	case 'c':/* CLIENT SETNAME name */
+		if (argc == 3 && argv[1].len == 7
+				&& strncasecmp(argv[1].str, "setname", 7) == 0) {
+			n = argv[2].len < sizeof(redisocket->client_name) - 1 ?
+					argv[2].len : sizeof(redisocket->client_name) - 1;
+			memcpy(redisocket->client_name, argv[2].str, n);
+			redisocket->client_name[n] = '\0';
+		}
+		break;
+	case 'r':/* READONLY, READWRITE, RESET */
+		if (argv[0].len == 5 && strncasecmp(argv[0].str, "reset", 5) == 0) {
+			redisocket->db = 0;
+			redisocket->transaction = 0;
+			redisocket->client_name[0] = '\0';
+			redisocket->readonly = 0;
+		} else if (strncasecmp(argv[0].str, "read", 4) == 0) {
+			redisocket->readonly = argv[0].len == 8;
+		}
+		break;
+	case 'm':/* MULTI, WATCH */
+	case 'w':
+		redisocket->transaction = 1;
+		break;
+	case 'e':/* EXEC, DISCARD, UNWATCH */
+	case 'd':
+	case 'u':
+		redisocket->transaction = 0;
+		break;
+	}
+}
+
+REDIS_PIPELINE * redis_pipeline_begin(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket, int max_inflight, size_t max_bytes,
+		redis_pipeline_callback callback, void *privdata) {
+	REDIS_PIPELINE *p;
+
+	if (inst == NULL || redisocket == NULL)
+		return NULL;
+
+	if (inst->cluster && (inst = redis_cluster_owner(inst, redisocket)) == NULL)
+		return NULL;
+
+	/* a pipeline needs a connection of its own */
+	if (redisocket->mux && redis_pin_socket(inst, redisocket) == NULL)
+		return NULL;
+
+	p = calloc(1, sizeof(REDIS_PIPELINE));
+	if (p == NULL)
+		return NULL;
+
+	p->inst = inst;
+	p->sock = redisocket->mux ? redisocket->pinned : redisocket;
+	p->handle = redisocket;
+	p->max_inflight = max_inflight > 0 ?
+			max_inflight : HIREDISPOOL_PIPELINE_INFLIGHT;
+	p->max_bytes = max_bytes > 0 ? max_bytes : HIREDISPOOL_PIPELINE_BYTES;
+	p->callback = callback;
+	p->privdata = privdata;
+
+	return p;
+}
+
+int redis_pipeline_command(REDIS_PIPELINE *p, const char *format, ...) {
+	va_list ap;
+	int rcode;
+	va_start(ap, format);
+	rcode = redis_pipeline_vcommand(p, format, ap);
+	va_end(ap);
+	return rcode;
+}
+
+/*
+ * Queue one command.  Returns -1 if it could not be sent, in which case
+ * it has already been reported as failed like a lost reply.
+ */
+int redis_pipeline_vcommand(REDIS_PIPELINE *p, const char *format,
+		va_list ap) {
+	char *cmd;
+	int len;
+
+	len = redisvFormatCommand(&cmd, format, ap);
+	if (len < 0) {
+		log_(L_ERROR, "%s: Failed to format command", __func__);
+		return -1;
+	}
+	return redis_pipeline_append(p, cmd, len);
+}
+
+int redis_pipeline_commandargv(REDIS_PIPELINE *p, int argc, const char **argv,
+		const size_t *argvlen) {
+	char *cmd;
+	int len;
+
+	len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+	if (len < 0) {
+		log_(L_ERROR, "%s: Failed to format command", __func__);
+		return -1;
+	}
+	return redis_pipeline_append(p, cmd, len);
+}
+
+/*
+ * Queue one formatted command, taking over 'cmd'.
+ */
+static int redis_pipeline_append(REDIS_PIPELINE *p, char *cmd, int len) {
+	REDIS_ARG name;
+	const REDIS_COMMAND_INFO *info;
+	int session;
+
+	/* make room first */
+	if (p->inflight >= p->max_inflight
+			|| p->inflight_bytes + len > p->max_bytes)
+		redis_pipeline_drain(p, NULL, 0);
+
+	/*
+	 * A command that changes the session is answered on its own, so
+	 * that the socket's session state follows it like in redis_command.
+	 */
+	session = redis_parse_command(cmd, len, &name, 1) >= 1
+			&& (info = redis_lookup_command(&name)) != NULL
+			&& (info->flags & REDIS_CMD_SESSION);
+	if (session && p->inflight > 0)
+		redis_pipeline_drain(p, NULL, 0);
+
+	if (p->sock->conn == NULL
+			|| redisAppendFormattedCommand(p->sock->conn, cmd, len)
+					!= REDIS_OK) {
+		free(cmd);
+		/* keep the replies in order */
+		if (p->inflight > 0)
+			redis_pipeline_drain(p, NULL, 0);
+		p->issued++;
+		redis_pipeline_deliver(p, NULL);
+		return -1;
+	}
+	p->issued++;
+	p->inflight++;
+	p->inflight_bytes += len;
+
+	if (session)
+		redis_pipeline_drain(p, cmd, len);
+	free(cmd);
+
+	return 0;
+}
+
+long redis_pipeline_sync(REDIS_PIPELINE *p) {
+	if (p->inflight > 0)
+		redis_pipeline_drain(p, NULL, 0);
+	return p->failed;
+}
+
+void ** redis_pipeline_replies(REDIS_PIPELINE *p, long *count) {
+	if (count)
+		*count = p->num_replies;
+	return p->replies;
+}
+
+long redis_pipeline_end(REDIS_PIPELINE *p) {
+	long i, failed;
+
+	if (p == NULL)
+		return -1;
+
+	failed = redis_pipeline_sync(p);
+
+	/*
+	 * Any non-NULL reply will do: redis_release_socket still notices a
+	 * broken connection by itself.
+	 */
+	redis_release_socket(p, p->inst, p->handle);
+
+	for (i = 0; i < p->num_replies; i++) {
+		if (p->replies[i])
+			freeReplyObject(p->replies[i]);
+	}
+	free(p->replies);
+	free(p);
+
+	return failed;
+}
+
+static void redis_pipeline_deliver(REDIS_PIPELINE *p, void *reply) {
+	void **replies;
+	long n;
+
+	if (reply == NULL)
+		p->failed++;
+
+	if (p->callback) {
+		p->callback(reply, p->issued - p->inflight - 1, p->privdata);
+		return;
+	}
+
+	if (p->num_replies == p->cap_replies) {
+		n = p->cap_replies ? p->cap_replies * 2 : 64;
+		replies = realloc(p->replies, sizeof(void *) * n);
+		if (replies == NULL) {
+			if (reply)
+				freeReplyObject(reply);
+			p->failed += reply != NULL;
+			return;
+		}
+		p->replies = replies;
+		p->cap_replies = n;
+	}
+	p->replies[p->num_replies++] = reply;
+}
+
+/*
+ * Write out what is queued and read every outstanding reply.  If the
+ * connection breaks, whatever is left unanswered is reported failed:
+ * those commands may or may not have run, so they are not resent.  The
+ * socket is then reconnected in place like in redis_vcommand, or left
+ * to the maintenance thread, and the pipeline carries on.
+ *
+ * 'session' is the one outstanding command when it changes the session
+ * state, to be tracked if it succeeds.
+ *
+ * The endpoint gets one latency sample per drain, the wait for the
+ * first reply: that is one round trip, while the wait for the last one
+ * grows with the size of the batch.
+ */
+static int redis_pipeline_drain(REDIS_PIPELINE *p, const char *session,
+		size_t len) {
+	REDIS_ENDPOINT_STATE *es;
+	void *reply;
+	long long start, first = 0;
+	int ok = 1;
+
+	if (p->inflight <= 0)
+		return 0;
+
+	es = &p->inst->endpoint_state[p->sock->backup];
+	start = redis_monotonic_usec();
+
+	while (p->inflight > 0) {
+		reply = NULL;
+		if (ok && redisGetReply(p->sock->conn, &reply) != REDIS_OK) {
+			log_(L_ERROR, "%s: Pipeline broken on handle %d with %d "
+					"commands outstanding: %s", __func__, p->sock->id,
+					p->inflight, ((redisContext *) p->sock->conn)->errstr);
+			ok = 0;
+			reply = NULL;
+		}
+		if (first == 0)
+			first = redis_monotonic_usec();
+		p->inflight--;
+		if (session && reply)
+			redis_track_session(p->sock, session, len,
+					((redisReply *) reply)->type == REDIS_REPLY_ERROR);
+		redis_pipeline_deliver(p, reply);
+	}
+	p->inflight_bytes = 0;
+	redis_endpoint_observe(es, first - start, ok);
+
+	if (!ok) {
+		redis_drop_connection(p->sock);
+		if (!p->inst->maintenance)
+			connect_single_socket(p->sock, p->inst);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Scatter-gather read.  The keys are cut into one contiguous range per
+ * borrowed socket, so the replies of each range land in place and the
+ * gather step is just waiting for the threads.  Every range is sent as
+ * a pipeline by a thread of its own, the first one by the caller, which
+ * spreads both the network round trips and the reply parsing.
+ */
+long redis_fanout(REDIS_INSTANCE *inst, const char *command,
+		int keys_per_command, const char **keys, const size_t *keylens,
+		long num_keys, int max_sockets, void **replies) {
+	REDIS_FANOUT_PART *parts;
+	long per, commands, failed = 0;
+	int n, nparts;
+
+	if (inst == NULL || command == NULL || keys == NULL || replies == NULL
+			|| num_keys < 0)
+		return -1;
+	memset(replies, 0, sizeof(void *) * num_keys);
+	if (num_keys == 0)
+		return 0;
+
+	if (inst->cluster) {
+		log_(L_ERROR, "%s: Not with keys spread over nodes", __func__);
+		return num_keys;
+	}
+
+	per = keys_per_command > 0 ? keys_per_command : 1;
+	commands = (num_keys + per - 1) / per;
+	if (max_sockets < 1)
+		max_sockets = 1;
+	if (max_sockets > commands)
+		max_sockets = commands;
+
+	parts = calloc(max_sockets, sizeof(REDIS_FANOUT_PART));
+	if (parts == NULL)
+		return num_keys;
+
+	/*
+	 * Wait for the first socket only; the others are whatever the pool
+	 * can spare right now, so a busy pool degrades to fewer ranges
+	 * rather than to waiting.
+	 */
+	parts[0].sock = redis_get_socket_timed(inst,
+			inst->config->net_readwrite_timeout);
+	if (parts[0].sock == NULL) {
+		log_(L_ERROR, "%s: No socket for %ld keys", __func__, num_keys);
+		free(parts);
+		return num_keys;
+	}
+	for (nparts = 1; nparts < max_sockets; nparts++) {
+		parts[nparts].sock = redis_get_socket(inst);
+		if (parts[nparts].sock == NULL)
+			break;
+	}
+
+	/* whole commands per range */
+	for (n = 0; n < nparts; n++) {
+		parts[n].inst = inst;
+		parts[n].command = command;
+		parts[n].keys_per_command = keys_per_command;
+		parts[n].keys = keys;
+		parts[n].keylens = keylens;
+		parts[n].replies = replies;
+		parts[n].lo = commands * n / nparts * per;
+		parts[n].hi = commands * (n + 1) / nparts * per;
+		if (parts[n].hi > num_keys)
+			parts[n].hi = num_keys;
+	}
+
+	/* run a range here if its thread cannot be had */
+	for (n = 1; n < nparts; n++) {
+		if (pthread_create(&parts[n].thread, NULL, redis_fanout_part,
+				&parts[n]) != 0) {
+			redis_fanout_part(&parts[n]);
+			parts[n].sock = NULL;
+		}
+	}
+	redis_fanout_part(&parts[0]);
+
+	for (n = 0; n < nparts; n++) {
+		if (n > 0 && parts[n].sock)
+			pthread_join(parts[n].thread, NULL);
+		failed += parts[n].failed;
+	}
+	free(parts);
+
+	DEBUG("%s: %ld keys over %d sockets, %ld failed", __func__, num_keys,
+			nparts, failed);
+	return failed;
+}
+
+static void* redis_fanout_part(void *arg) {
+	REDIS_FANOUT_PART *part = arg;
+	REDIS_PIPELINE *p;
+	const char **argv;
+	size_t *argvlen;
+	long k, per, j, n;
+
+	per = part->keys_per_command > 0 ? part->keys_per_command : 1;
+	argv = malloc(sizeof(char *) * (per + 1));
+	argvlen = malloc(sizeof(size_t) * (per + 1));
+	p = argv && argvlen ? redis_pipeline_begin(part->inst, part->sock, 0, 0,
+			redis_fanout_deliver, part) : NULL;
+	if (p == NULL) {
+		redis_release_socket(NULL, part->inst, part->sock);
+		part->failed = part->hi - part->lo;
+		free(argv);
+		free(argvlen);
+		return NULL;
+	}
+
+	argv[0] = part->command;
+	argvlen[0] = strlen(part->command);
+	for (k = part->lo; k < part->hi; k += n) {
+		n = part->hi - k < per ? part->hi - k : per;
+		for (j = 0; j < n; j++) {
+			argv[j + 1] = part->keys[k + j];
+			argvlen[j + 1] = part->keylens ?
+					part->keylens[k + j] : strlen(part->keys[k + j]);
+		}
+		redis_pipeline_commandargv(p, n + 1, argv, argvlen);
+	}
+
+	/* failures have been counted by redis_fanout_deliver */
+	redis_pipeline_end(p);
+	free(argv);
+	free(argvlen);
+	return NULL;
+}
+
+/*
+ * Put the reply of command 'index' of a range in place.  A multi-key
+ * command answers with one element per key, which are taken out of
+ * the array.
+ */
+static void redis_fanout_deliver(void *reply, long index, void *privdata) {
+	REDIS_FANOUT_PART *part = privdata;
+	redisReply *r = reply;
+	long k, j, n, per;
+
+	per = part->keys_per_command > 0 ? part->keys_per_command : 1;
+	k = part->lo + index * per;
+	n = part->hi - k < per ? part->hi - k : per;
+
+	if (r == NULL) {
+		part->failed += n;
+		return;
+	}
+
+	if (part->keys_per_command <= 0) {
+		part->replies[k] = r;
+		return;
+	}
+
+	if (r->type != REDIS_REPLY_ARRAY || (long) r->elements != n) {
+		log_(L_ERROR, "%s: %s answered %s for %ld keys", __func__,
+				part->command, r->type == REDIS_REPLY_ERROR ?
+						r->str : "an unexpected reply", n);
+		part->failed += n;
+		freeReplyObject(r);
+		return;
+	}
+	for (j = 0; j < n; j++) {
+		part->replies[k + j] = r->element[j];
+		r->element[j] = NULL;
+	}
+	freeReplyObject(r);
+}
+
+/*
+ * Multiplexed mode.  redis_get_socket hands out virtual sockets, and
+ * redis_command on them queues the formatted command on one of a few
+ * shared connections and sleeps until its reply is in.  Per connection
+ * a writer thread takes everything queued since its last write and
+ * sends it in one write(2), so under load many callers share a system
+ * call and a round trip; a reader thread reads the replies and hands
+ * them out in the order the commands were written.
+ */
+
+static int redis_mux_start(REDIS_INSTANCE *inst) {
+	REDIS_MUX *m;
+	int i, n = inst->config->num_mux_connections
+			+ inst->config->num_mux_bulk_connections;
+
+	if (posix_memalign((void **) &inst->mux, HIREDISPOOL_CACHELINE,
+			sizeof(REDIS_MUX) * n) != 0) {
+		inst->mux = NULL;
+		return -1;
+	}
+	memset(inst->mux, 0, sizeof(REDIS_MUX) * n);
+
+	for (i = 0; i < n; i++) {
+		m = &inst->mux[i];
+		m->id = i;
+		m->home = i % inst->config->num_endpoints;
+		m->endpoint = m->home;
+		m->inst = inst;
+		/* the reader connects it */
+		m->broken = 1;
+		pthread_mutex_init(&m->mutex, NULL);
+		pthread_cond_init(&m->writer_cond, NULL);
+		pthread_cond_init(&m->reader_cond, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		m = &inst->mux[i];
+		if (pthread_create(&m->reader, NULL, redis_mux_reader, m) != 0) {
+			log_(L_ERROR | L_CONS, "%s: Failed to start reader %d",
+					__func__, i);
+			break;
+		}
+		if (pthread_create(&m->writer, NULL, redis_mux_writer, m) != 0) {
+			log_(L_ERROR | L_CONS, "%s: Failed to start writer %d",
+					__func__, i);
+			/* let redis_mux_stop join the reader alone */
+			m->writer = m->reader;
+			i++;
+			break;
+		}
+	}
+	inst->num_mux = i;
+	if (i < n)
+		return -1;
+	inst->num_mux_bulk = inst->config->num_mux_bulk_connections;
+
+	log_(L_INFO, "%s: Multiplexing redis_command onto %d connections, "
+			"%d more for large replies", __func__,
+			inst->config->num_mux_connections, inst->num_mux_bulk);
+	return 0;
+}
+
+static void redis_mux_stop(REDIS_INSTANCE *inst) {
+	REDIS_MUX *m;
+	int i;
+
+	for (i = 0; i < inst->num_mux; i++) {
+		m = &inst->mux[i];
+		pthread_mutex_lock(&m->mutex);
+		m->stop = 1;
+		if (m->conn)
+			shutdown(((redisContext *) m->conn)->fd, SHUT_RDWR);
+		pthread_cond_broadcast(&m->writer_cond);
+		pthread_cond_broadcast(&m->reader_cond);
+		pthread_mutex_unlock(&m->mutex);
+	}
+
+	for (i = 0; i < inst->num_mux; i++) {
+		m = &inst->mux[i];
+		pthread_join(m->reader, NULL);
+		if (!pthread_equal(m->writer, m->reader))
+			pthread_join(m->writer, NULL);
+		redis_mux_fail(&m->send_head, &m->send_tail);
+		redis_mux_fail(&m->wait_head, &m->wait_tail);
+		if (m->conn)
+			redisFree(m->conn);
+	}
+
+	for (i = 0; i < inst->config->num_mux_connections
+			+ inst->config->num_mux_bulk_connections; i++) {
+		m = &inst->mux[i];
+		pthread_cond_destroy(&m->reader_cond);
+		pthread_cond_destroy(&m->writer_cond);
+		pthread_mutex_destroy(&m->mutex);
+	}
+	free(inst->mux);
+	inst->mux = NULL;
+	inst->num_mux = 0;
+	inst->num_mux_bulk = 0;
+}
+
+/*
+ * Wake up every request of a list with no reply.  Called with the
+ * mutex of its connection held.
+ */
+static void redis_mux_fail(REDIS_MUX_REQUEST **head, REDIS_MUX_REQUEST **tail) {
+	REDIS_MUX_REQUEST *req;
+
+	while ((req = *head) != NULL) {
+		*head = req->next;
+		req->reply = NULL;
+		req->done = 1;
+		pthread_cond_signal(&req->cond);
+	}
+	*tail = NULL;
+}
+
+static void* redis_mux_command(REDIS_SOCKET *vsock, REDIS_INSTANCE *inst,
+		int bulk, const char *cmd, size_t len) {
+	REDIS_MUX *m = vsock->mux;
+	REDIS_MUX_REQUEST req;
+	REDIS_ENDPOINT_STATE *es;
+	long long start;
+	int i, first = 0, count = inst->num_mux - inst->num_mux_bulk;
+
+	/* large replies go where they hold up no small ones */
+	if (bulk && inst->num_mux_bulk > 0) {
+		first = count;
+		count = inst->num_mux_bulk;
+		m = &inst->mux[first + __atomic_fetch_add(&inst->mux_bulk_next, 1,
+				__ATOMIC_RELAXED) % count];
+	}
+
+	/* skip connections that are down for the others */
+	for (i = 1; i < count && __atomic_load_n(&m->down, __ATOMIC_RELAXED); i++)
+		m = &inst->mux[first + (m->id - first + 1) % count];
+
+	req.cmd = cmd;
+	req.len = len;
+	req.reply = NULL;
+	req.done = 0;
+	req.next = NULL;
+	pthread_cond_init(&req.cond, NULL);
+
+	es = &inst->endpoint_state[m->endpoint];
+	__atomic_add_fetch(&es->inflight, 1, __ATOMIC_RELAXED);
+	start = redis_monotonic_usec();
+
+	pthread_mutex_lock(&m->mutex);
+	if (m->down || m->stop) {
+		pthread_mutex_unlock(&m->mutex);
+		pthread_cond_destroy(&req.cond);
+		__atomic_sub_fetch(&es->inflight, 1, __ATOMIC_RELAXED);
+		DEBUG("%s: Multiplexed connection %d is down", __func__, m->id);
+		return NULL;
+	}
+	if (m->send_tail)
+		m->send_tail->next = &req;
+	else
+		m->send_head = &req;
+	m->send_tail = &req;
+	pthread_cond_signal(&m->writer_cond);
+	while (!req.done)
+		pthread_cond_wait(&req.cond, &m->mutex);
+	pthread_mutex_unlock(&m->mutex);
+
+	pthread_cond_destroy(&req.cond);
+
+	redis_endpoint_observe(es, redis_monotonic_usec() - start,
+			req.reply != NULL);
+	__atomic_sub_fetch(&es->inflight, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&inst->stats.mux_commands, 1, __ATOMIC_RELAXED);
+
+	if (req.reply == NULL)
+		log_(L_ERROR, "%s: Command failed on multiplexed connection %d",
+				__func__, m->id);
+	return req.reply;
+}
+
+static void* redis_mux_writer(void *arg) {
+	REDIS_MUX *m = arg;
+	REDIS_MUX_REQUEST *req, *last = NULL;
+	char *buf = NULL, *nbuf;
+	size_t cap = 0, len, off;
+	ssize_t n;
+	int fd;
+
+	pthread_mutex_lock(&m->mutex);
+	while (!m->stop) {
+		if (m->send_head == NULL || m->broken) {
+			pthread_cond_wait(&m->writer_cond, &m->mutex);
+			continue;
+		}
+
+		len = 0;
+		for (req = m->send_head; req; req = req->next) {
+			len += req->len;
+			last = req;
+		}
+		if (len > cap) {
+			nbuf = realloc(buf, len);
+			if (nbuf == NULL) {
+				log_(L_ERROR, "%s: Out of memory for %lu bytes", __func__,
+						(unsigned long) len);
+				redis_mux_fail(&m->send_head, &m->send_tail);
+				continue;
+			}
+			buf = nbuf;
+			cap = len;
+		}
+
+		/*
+		 * Copy the batch while its callers are sure to be waiting, then
+		 * move it over to the reader: replies come back in the order
+		 * the commands are written.
+		 */
+		off = 0;
+		for (req = m->send_head; req; req = req->next) {
+			memcpy(buf + off, req->cmd, req->len);
+			off += req->len;
+		}
+		if (m->wait_tail)
+			m->wait_tail->next = m->send_head;
+		else
+			m->wait_head = m->send_head;
+		m->wait_tail = last;
+		m->send_head = m->send_tail = NULL;
+
+		m->writing = 1;
+		fd = ((redisContext *) m->conn)->fd;
+		pthread_cond_signal(&m->reader_cond);
+		pthread_mutex_unlock(&m->mutex);
+
+		for (off = 0; off < len; off += n) {
+			n = write(fd, buf + off, len - off);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+		}
+
+		pthread_mutex_lock(&m->mutex);
+		m->writing = 0;
+		if (off < len && !m->broken) {
+			log_(L_ERROR, "%s: Write failed on multiplexed connection %d: %s",
+					__func__, m->id, strerror(errno));
+			m->broken = 1;
+			shutdown(fd, SHUT_RDWR);
+		}
+		pthread_cond_signal(&m->reader_cond);
+	}
+	pthread_mutex_unlock(&m->mutex);
+
+	free(buf);
+	return NULL;
+}
+
+static void* redis_mux_reader(void *arg) {
+	REDIS_MUX *m = arg;
+	REDIS_MUX_REQUEST *req;
+	redisContext *c;
+	void *reply;
+	int rcode;
+
+	pthread_mutex_lock(&m->mutex);
+	while (!m->stop) {
+		if (m->broken) {
+			redis_mux_reconnect(m);
+			continue;
+		}
+		if (m->wait_head == NULL) {
+			pthread_cond_wait(&m->reader_cond, &m->mutex);
+			continue;
+		}
+		c = m->conn;
+		pthread_mutex_unlock(&m->mutex);
+
+		rcode = redisGetReply(c, &reply);
+
+		pthread_mutex_lock(&m->mutex);
+		if (rcode != REDIS_OK) {
+			if (!m->stop)
+				log_(L_ERROR, "%s: Multiplexed connection %d broke: %s",
+						__func__, m->id, c->errstr);
+			m->broken = 1;
+			continue;
+		}
+		req = m->wait_head;
+		m->wait_head = req->next;
+		if (m->wait_head == NULL)
+			m->wait_tail = NULL;
+		req->reply = reply;
+		req->done = 1;
+		pthread_cond_signal(&req->cond);
+	}
+	pthread_mutex_unlock(&m->mutex);
+
+	return NULL;
+}
+
+/*
+ * Replace a broken multiplexed connection, trying its home endpoint
+ * first.  Commands already written are lost and fail; the queued ones
+ * wait for the new connection, or fail too if there is none.  Called
+ * by the reader with the mutex held.
+ */
+static void redis_mux_reconnect(REDIS_MUX *m) {
+	REDIS_INSTANCE *inst = m->inst;
+	redisContext *c = NULL, *old;
+	struct timespec ts;
+	long long delay;
+	int ep = m->home;
+
+	/* keep the writer away from the old connection */
+	if (m->conn)
+		shutdown(((redisContext *) m->conn)->fd, SHUT_RDWR);
+	while (m->writing)
+		pthread_cond_wait(&m->reader_cond, &m->mutex);
+	redis_mux_fail(&m->wait_head, &m->wait_tail);
+	old = m->conn;
+	m->conn = NULL;
+	pthread_mutex_unlock(&m->mutex);
+
+	if (old)
+		redisFree(old);
+	if (!__atomic_load_n(&m->stop, __ATOMIC_RELAXED))
+		c = redis_connect_any(inst, m->home, -1 - m->id, &ep);
+
+	pthread_mutex_lock(&m->mutex);
+	if (c) {
+		if (m->down || ep != m->endpoint)
+			log_(L_INFO, "%s: Multiplexed connection %d up on endpoint %d",
+					__func__, m->id, ep);
+		m->conn = c;
+		m->endpoint = ep;
+		m->broken = 0;
+		m->down = 0;
+		m->retries = 0;
+		pthread_cond_signal(&m->writer_cond);
+		return;
+	}
+
+	if (!m->down)
+		log_(L_ERROR | L_CONS, "%s: Multiplexed connection %d is down",
+				__func__, m->id);
+	m->down = 1;
+	redis_mux_fail(&m->send_head, &m->send_tail);
+
+	/* the breakers pace the endpoints, this only paces the loop */
+	delay = (long long) REDIS_BACKOFF_BASE_MS << (m->retries < 5 ?
+			m->retries++ : 5);
+	if (delay > REDIS_MUX_RETRY_MAX_MS)
+		delay = REDIS_MUX_RETRY_MAX_MS;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += delay / 1000;
+	ts.tv_nsec += (delay % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	if (!m->stop)
+		pthread_cond_timedwait(&m->reader_cond, &m->mutex, &ts);
+}
+
+static int redis_command_flags(const char *cmd, size_t len) {
+	const REDIS_COMMAND_INFO *info;
+	REDIS_ARG name;
+
+	if (redis_parse_command(cmd, len, &name, 1) < 1
+			|| (info = redis_lookup_command(&name)) == NULL)
+		return 0;
+	return info->flags;
+}
+
+/*
+ * Give a virtual socket a real one from the pool for the rest of its
+ * use, waiting for it up to net_readwrite_timeout.
+ */
+static REDIS_SOCKET * redis_pin_socket(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *vsock) {
+	if (vsock->pinned)
+		return vsock->pinned;
+
+	vsock->pinned = redis_get_pool_socket_prio(inst,
+			inst->config->net_readwrite_timeout, vsock->priority);
+	if (vsock->pinned == NULL) {
+		log_(L_ERROR, "%s: No socket to pin a multiplexed caller to",
+				__func__);
+		return NULL;
+	}
+	__atomic_add_fetch(&inst->stats.mux_pinned, 1, __ATOMIC_RELAXED);
+	return vsock->pinned;
+}
+
+static REDIS_SOCKET * redis_get_virtual(REDIS_INSTANCE *inst, int priority) {
+	REDIS_SOCKET *v;
+	unsigned int next;
+
+	pthread_mutex_lock(&inst->virtual_mutex);
+	v = inst->virtual_free;
+	if (v)
+		inst->virtual_free = v->next_virtual;
+	pthread_mutex_unlock(&inst->virtual_mutex);
+
+	if (v == NULL) {
+		if (posix_memalign((void **) &v, HIREDISPOOL_CACHELINE,
+				sizeof(REDIS_SOCKET)) != 0) {
+			__atomic_add_fetch(&inst->stats.exhausted, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		memset(v, 0, sizeof(REDIS_SOCKET));
+		v->id = -1;
+		v->state = sockconnected;
+		pthread_mutex_init(&v->mutex, NULL);
+	}
+
+	next = __atomic_fetch_add(&inst->mux_next, 1, __ATOMIC_RELAXED);
+	v->mux = &inst->mux[next % (inst->num_mux - inst->num_mux_bulk)];
+	v->priority = priority;
+	v->home = v->backup = v->mux->home;
+	v->pinned = NULL;
+	v->inuse = 1;
+	v->db = inst->config->db;
+	v->readonly = 0;
+	strcpy(v->client_name, inst->config->client_name);
+
+	return v;
+}
+
+static void redis_put_virtual(REDIS_INSTANCE *inst, REDIS_SOCKET *vsock) {
+	vsock->pinned = NULL;
+	vsock->inuse = 0;
+
+	pthread_mutex_lock(&inst->virtual_mutex);
+	vsock->next_virtual = inst->virtual_free;
+	inst->virtual_free = vsock;
+	pthread_mutex_unlock(&inst->virtual_mutex);
+}
+
+/*
+ * Open a connection to the first endpoint from 'first' on that its
+ * breaker lets through, for connections that are not pool slots.
+ */
+static redisContext * redis_connect_any(REDIS_INSTANCE *inst, int first,
+		int id, int *idx) {
+	redisContext *c;
+	int i, ep;
+
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		ep = (first + i) % inst->config->num_endpoints;
+		if (!redis_endpoint_allow(inst, ep))
+			continue;
+		c = redis_connect_endpoint(inst, ep, id);
+		if (c) {
+			*idx = ep;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Blocking lane.  A blocking command parks its connection on the server
+ * until data arrives or its timeout expires, so with max_blocking_socks
+ * set such commands never run on the socket they are issued on: they
+ * borrow one of at most max_blocking_socks connections of their own,
+ * opened on demand and kept for the next blocking command.  Callers
+ * beyond that queue up in order.  A caller that queues for longer than
+ * its command's timeout gets the reply the server gives on timeout, so
+ * consumers see no difference between a busy lane and an empty list.
+ * WAIT and WAITAOF block as well, but count the writes made on the
+ * connection they are sent on: they stay with the caller, on its own
+ * socket or the multiplexed connection its commands went over.
+ */
+
+/*
+ * Whether a formatted command blocks, and for how long in milliseconds,
+ * 0 meaning forever.  Returns its flags if it does, else 0.
+ */
+static int redis_command_blocks(const char *cmd, size_t len, long *timeout_ms) {
+	const REDIS_COMMAND_INFO *info;
+	REDIS_ARG stack[16], *argv = stack;
+	const REDIS_ARG *t = NULL;
+	char buf[32];
+	double timeout;
+	int argc, i;
+
+	argc = redis_parse_command(cmd, len, argv, 16);
+	if (argc < 2 || (info = redis_lookup_command(&argv[0])) == NULL
+			|| !(info->flags & REDIS_CMD_BLOCKING))
+		return 0;
+
+	if (info->flags & REDIS_CMD_BLOCK_OPTION) {
+		/* BLOCK comes before STREAMS and its many arguments */
+		for (i = 1; i + 1 < argc && i + 1 < 16; i++) {
+			if (argv[i].len == 5 && strncasecmp(argv[i].str, "block", 5) == 0) {
+				t = &argv[i + 1];
+				break;
+			}
+		}
+		if (t == NULL)
+			return 0;
+	} else if (info->flags & REDIS_CMD_TIMEOUT_FIRST) {
+		t = &argv[1];
+	} else {
+		if (argc > 16) {
+			argv = malloc(sizeof(REDIS_ARG) * argc);
+			if (argv == NULL)
+				return 0;
+			redis_parse_command(cmd, len, argv, argc);
+		}
+		t = &argv[argc - 1];
+	}
+
+	timeout = 0;
+	if (t->len < sizeof(buf)) {
+		memcpy(buf, t->str, t->len);
+		buf[t->len] = '\0';
+		timeout = strtod(buf, NULL);
+	}
+	if (argv != stack)
+		free(argv);
+	if (!(info->flags & REDIS_CMD_BLOCK_OPTION))
+		timeout *= 1000;
+	*timeout_ms = timeout > 0 ? (long) timeout : 0;
+	return info->flags;
+}
+
+static void* redis_blocking_command(REDIS_INSTANCE *inst, const char *cmd,
+		size_t len, long timeout_ms) {
+	REDIS_SOCKET *lsock;
+	redisContext *c;
+	redisReply *reply = NULL;
+	struct timeval tv;
+	long long ms;
+	int timedout;
+
+	__atomic_add_fetch(&inst->stats.blocking_commands, 1, __ATOMIC_RELAXED);
+
+	lsock = redis_lane_get(inst, timeout_ms, &timedout);
+	if (lsock == NULL) {
+		if (!timedout)
+			return NULL;
+		/* the server would have given up by now as well */
+		reply = calloc(1, sizeof(redisReply));
+		if (reply)
+			reply->type = REDIS_REPLY_NIL;
+		return reply;
+	}
+
+	/* read for as long as the command may block, and then some */
+	c = lsock->conn;
+	ms = timeout_ms > 0 ? timeout_ms + inst->config->net_readwrite_timeout : 0;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = 1000 * (ms % 1000);
+	if (redisSetTimeout(c, tv) != REDIS_OK
+			|| redisAppendFormattedCommand(c, cmd, len) != REDIS_OK
+			|| redisGetReply(c, (void **) &reply) != REDIS_OK) {
+		log_(L_ERROR, "%s: Blocking command failed: %s", __func__, c->errstr);
+		redisFree(c);
+		lsock->conn = NULL;
+		reply = NULL;
+	}
+	redis_lane_put(inst, lsock);
+
+	return reply;
+}
+
+/*
+ * Borrow a lane connection, opening one if the lane is not full yet,
+ * else waiting up to timeout_ms for one, 0 meaning forever.
+ */
+static REDIS_SOCKET * redis_lane_get(REDIS_INSTANCE *inst, long timeout_ms,
+		int *timedout) {
+	REDIS_LANE_WAITER w;
+	REDIS_LANE_WAITER **pp;
+	REDIS_SOCKET *lsock = NULL;
+	pthread_condattr_t attr;
+	struct timespec ts;
+	redisContext *c;
+	int rcode = 0, ep;
+
+	*timedout = 0;
+
+	pthread_mutex_lock(&inst->lane_mutex);
+	if (inst->lane_free) {
+		lsock = inst->lane_free;
+		inst->lane_free = lsock->next_virtual;
+		pthread_mutex_unlock(&inst->lane_mutex);
+		return lsock;
+	}
+
+	if (inst->num_lane >= inst->config->max_blocking_socks) {
+		__atomic_add_fetch(&inst->stats.blocking_waits, 1, __ATOMIC_RELAXED);
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&w.cond, &attr);
+		pthread_condattr_destroy(&attr);
+		w.sock = NULL;
+		w.may_connect = 0;
+		w.next = NULL;
+		for (pp = &inst->lane_waiters; *pp; pp = &(*pp)->next)
+			;
+		*pp = &w;
+
+		if (timeout_ms > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += timeout_ms / 1000;
+			ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+		}
+		while (!w.sock && !w.may_connect && rcode != ETIMEDOUT) {
+			if (timeout_ms > 0)
+				rcode = pthread_cond_timedwait(&w.cond, &inst->lane_mutex,
+						&ts);
+			else
+				pthread_cond_wait(&w.cond, &inst->lane_mutex);
+		}
+		if (!w.sock && !w.may_connect) {
+			for (pp = &inst->lane_waiters; *pp != &w; pp = &(*pp)->next)
+				;
+			*pp = w.next;
+			*timedout = 1;
+		}
+		pthread_cond_destroy(&w.cond);
+
+		if (w.sock || *timedout) {
+			pthread_mutex_unlock(&inst->lane_mutex);
+			return w.sock;
+		}
+		/* a slot was handed over to us, it is counted already */
+	} else {
+		inst->num_lane++;
+	}
+	pthread_mutex_unlock(&inst->lane_mutex);
+
+	c = redis_connect_any(inst,
+			__atomic_fetch_add(&inst->lane_next, 1, __ATOMIC_RELAXED)
+					% inst->config->num_endpoints, -1, &ep);
+	if (c && posix_memalign((void **) &lsock, HIREDISPOOL_CACHELINE,
+			sizeof(REDIS_SOCKET)) == 0) {
+		memset(lsock, 0, sizeof(REDIS_SOCKET));
+		lsock->id = -1;
+		lsock->state = sockconnected;
+		lsock->conn = c;
+		lsock->home = lsock->backup = ep;
+		lsock->inuse = 1;
+		lsock->epoch = __atomic_load_n(&inst->epoch, __ATOMIC_ACQUIRE);
+		return lsock;
+	}
+
+	log_(L_ERROR, "%s: Failed to open a blocking lane connection", __func__);
+	if (c)
+		redisFree(c);
+	redis_lane_put(inst, NULL);
+	return NULL;
+}
+
+/*
+ * Return a lane connection, straight to the first waiter if there is
+ * one.  A broken one, with conn NULL, is freed and its slot handed on,
+ * and so is the slot of one that could not be opened, passed as NULL.
+ */
+static void redis_lane_put(REDIS_INSTANCE *inst, REDIS_SOCKET *lsock) {
+	REDIS_LANE_WAITER *w;
+
+	if (lsock && lsock->conn
+			&& lsock->epoch != __atomic_load_n(&inst->epoch, __ATOMIC_RELAXED)) {
+		redisFree(lsock->conn);
+		lsock->conn = NULL;
+	}
+
+	pthread_mutex_lock(&inst->lane_mutex);
+	w = inst->lane_waiters;
+	if (w)
+		inst->lane_waiters = w->next;
+
+	if (lsock == NULL || lsock->conn == NULL) {
+		free(lsock);
+		if (w)
+			w->may_connect = 1;
+		else
+			inst->num_lane--;
+	} else if (w) {
+		w->sock = lsock;
+	} else {
+		lsock->next_virtual = inst->lane_free;
+		inst->lane_free = lsock;
+	}
+
+	if (w)
+		pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&inst->lane_mutex);
+}
+
+/*
+ * The key of a formatted command that a cluster routes it by, see the
+ * REDIS_CMD_KEY flags.  Returns -1 for a command without one.
+ */
+static int redis_find_key(const char *cmd, size_t len, REDIS_ARG *key) {
+	const REDIS_COMMAND_INFO *info;
+	REDIS_ARG argv[16];
+	char buf[16];
+	int argc, flags = 0, i = 1;
+
+	argc = redis_parse_command(cmd, len, argv, 16);
+	if (argc < 2)
+		return -1;
+	if (argc > 16)
+		argc = 16;
+	if ((info = redis_lookup_command(&argv[0])) != NULL)
+		flags = info->flags;
+
+	if (flags & REDIS_CMD_KEYLESS) {
+		return -1;
+	} else if (flags & REDIS_CMD_KEY_SECOND) {
+		i = 2;
+	} else if (flags & (REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_KEY_NUMKEYS_FIRST)
+			&& !(flags & REDIS_CMD_KEYS_DEST)) {
+		/*
+		 * EVAL script numkeys key, BLMPOP timeout numkeys key;
+		 * ZUNION numkeys key, LMPOP numkeys key
+		 */
+		i = flags & REDIS_CMD_KEY_NUMKEYS ? 2 : 1;
+		if (argc < i + 2 || argv[i].len >= sizeof(buf))
+			return -1;
+		memcpy(buf, argv[i].str, argv[i].len);
+		buf[argv[i].len] = '\0';
+		if (atoi(buf) < 1)
+			return -1;
+		i++;
+	} else if (flags & REDIS_CMD_KEY_STREAMS) {
+		while (i < argc && !(argv[i].len == 7
+				&& strncasecmp(argv[i].str, "streams", 7) == 0))
+			i++;
+		i++;
+	}
+
+	if (i >= argc)
+		return -1;
+	*key = argv[i];
+	return 0;
+}
+
+/*
+ * Whether every key of a formatted command is served by 'node', see the
+ * REDIS_CMD_KEYS flags.  Commands the table does not describe are taken
+ * to have at most one key.
+ */
+static int redis_keys_on_node(REDIS_INSTANCE *inst, const char *cmd,
+		size_t len, int node) {
+	const REDIS_COMMAND_INFO *info;
+	REDIS_ARG stack[16], *argv = stack;
+	char buf[16];
+	int argc, flags, i, first = 1, end, step = 1, on = 1;
+
+	argc = redis_parse_command(cmd, len, argv, 16);
+	if (argc < 3 || (info = redis_lookup_command(&argv[0])) == NULL)
+		return 1;
+	flags = info->flags;
+	if (!(flags & (REDIS_CMD_KEYS_REST | REDIS_CMD_KEYS_PAIRS
+			| REDIS_CMD_KEYS_TWO | REDIS_CMD_KEYS_DEST | REDIS_CMD_KEY_NUMKEYS
+			| REDIS_CMD_KEY_NUMKEYS_FIRST | REDIS_CMD_KEY_STREAMS)))
+		return 1;
+	if (argc > 16) {
+		if ((argv = malloc(sizeof(REDIS_ARG) * argc)) == NULL)
+			return 1;
+		redis_parse_command(cmd, len, argv, argc);
+	}
+
+	end = argc;
+	if (flags & REDIS_CMD_KEY_SECOND)
+		first = 2;
+	if (flags & REDIS_CMD_KEYS_TWO)
+		end = first + 2;
+	if (flags & REDIS_CMD_KEYS_PAIRS)
+		step = 2;
+	/* BLPOP key key timeout */
+	if ((flags & REDIS_CMD_KEYS_REST) && (flags & REDIS_CMD_BLOCKING))
+		end = argc - 1;
+	if (flags & (REDIS_CMD_KEY_NUMKEYS | REDIS_CMD_KEY_NUMKEYS_FIRST)) {
+		/* ZUNIONSTORE dest numkeys key, EVAL script numkeys key */
+		i = flags & REDIS_CMD_KEY_NUMKEYS ? 2 : 1;
+		end = 0;
+		if (i < argc && argv[i].len < sizeof(buf)) {
+			memcpy(buf, argv[i].str, argv[i].len);
+			buf[argv[i].len] = '\0';
+			first = i + 1;
+			end = first + atoi(buf);
+		}
+		if ((flags & REDIS_CMD_KEYS_DEST) && redis_cluster_node_of(inst,
+				argv[1].str, argv[1].len) != node)
+			on = 0;
+	}
+	if (flags & REDIS_CMD_KEY_STREAMS) {
+		/* XREAD ... STREAMS key key id id */
+		for (first = 1; first < argc && !(argv[first].len == 7
+				&& strncasecmp(argv[first].str, "streams", 7) == 0); first++)
+			;
+		first++;
+		end = first + (argc - first) / 2;
+	}
+	if (end > argc)
+		end = argc;
+
+	for (i = first; i < end && on; i += step)
+		on = redis_cluster_node_of(inst, argv[i].str, argv[i].len) == node;
+
+	if (argv != stack)
+		free(argv);
+	return on;
+}
+
+/*
+ * An error reply of the pool's own, for a command it will not send.  It
+ * comes out of a reader like any other, so freeReplyObject takes it.
+ */
+static redisReply * redis_error_reply(const char *fmt, ...) {
+	redisReader *reader;
+	void *reply = NULL;
+	char buf[256];
+	va_list ap;
+	int n;
+
+	buf[0] = '-';
+	va_start(ap, fmt);
+	n = vsnprintf(buf + 1, sizeof(buf) - 3, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return NULL;
+	if (n > (int) sizeof(buf) - 4)
+		n = sizeof(buf) - 4;
+	memcpy(buf + 1 + n, "\r\n", 2);
+
+	if ((reader = redisReaderCreate()) == NULL)
+		return NULL;
+	if (redisReaderFeed(reader, buf, n + 3) != REDIS_OK
+			|| redisReaderGetReply(reader, &reply) != REDIS_OK)
+		reply = NULL;
+	redisReaderFree(reader);
+	return reply;
+}
+
+/*
+ * What of a key is hashed: what is between its first '{' and the next
+ * '}' if that is not empty, else all of it, so that keys sharing such a
+ * tag end up on one node.
+ */
+static void redis_key_tag(const char **key, size_t *len) {
+	const char *open, *close;
+
+	open = memchr(*key, '{', *len);
+	if (open) {
+		close = memchr(open + 1, '}', *key + *len - open - 1);
+		if (close && close > open + 1) {
+			*key = open + 1;
+			*len = close - *key;
+		}
+	}
+}
+
+/* Hash slot of a key: CRC16 of its tag */
+static int redis_cluster_slot(const char *key, size_t len) {
+	uint16_t crc = 0;
+	size_t i;
+
+	redis_key_tag(&key, &len);
+	for (i = 0; i < len; i++)
+		crc = (crc << 8) ^ redis_crc16_table[((crc >> 8)
+				^ (unsigned char) key[i]) & 0xff];
+	return crc & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+/*
+ * Hash of the ring of sharded mode: 64-bit FNV-1a, whose poor avalanche
+ * on short similar strings such as "host:port-17" is fixed up by the
+ * MurmurHash3 finalizer.
+ */
+static uint32_t redis_hash(const char *s, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t) h;
+}
+
+/*
+ * The node serving a key: by its slot in a cluster, by the first ring
+ * point at or after its hash in sharded mode.  A key of a slot no node
+ * is known for yet goes to any node, which will redirect it.
+ */
+static int redis_cluster_node_of(REDIS_INSTANCE *inst, const char *key,
+		size_t len) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	uint32_t h;
+	int lo, hi, mid, node;
+
+	if (cl->ring == NULL) {
+		node = __atomic_load_n(&cl->slots[redis_cluster_slot(key, len)],
+				__ATOMIC_ACQUIRE);
+		if (node >= 0)
+			return node;
+		return redis_thread_random()
+				% __atomic_load_n(&cl->num_nodes, __ATOMIC_ACQUIRE);
+	}
+
+	redis_key_tag(&key, &len);
+	h = redis_hash(key, len);
+	lo = 0;
+	hi = cl->num_ring;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cl->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return cl->ring[lo == cl->num_ring ? 0 : lo].node;
+}
+
+static int redis_compare_ring(const void *a, const void *b) {
+	const REDIS_RING_POINT *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->node - y->node;
+}
+
+/*
+ * Give every endpoint a pool and REDIS_RING_POINTS points on the ring
+ * per unit of its weight, hashed from its host and port rather than its
+ * place in the list.  Adding or removing an endpoint then only moves
+ * the keys of the arcs its own points cover, and the other endpoints
+ * keep their keys and so their cache hits.  There is no failover: the
+ * keys of a shard that is down fail rather than land on another one.
+ */
+static int redis_shards_start(REDIS_INSTANCE *inst) {
+	REDIS_CLUSTER *cl;
+	REDIS_ENDPOINT *ep;
+	char name[300];
+	int i, j, n, weight, total = 0;
+
+	cl = calloc(1, sizeof(REDIS_CLUSTER));
+	if (cl == NULL)
+		return -1;
+	pthread_mutex_init(&cl->mutex, NULL);
+	pthread_mutex_init(&cl->refresh_mutex, NULL);
+	pthread_cond_init(&cl->refresh_cond, NULL);
+	inst->cluster = cl;
+
+	for (i = 0; i < inst->config->num_endpoints; i++)
+		total += inst->config->endpoints[i].weight > 0 ?
+				inst->config->endpoints[i].weight : 1;
+	cl->ring = malloc(sizeof(REDIS_RING_POINT) * total * REDIS_RING_POINTS);
+	if (cl->ring == NULL)
+		return -1;
+
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		ep = &inst->config->endpoints[i];
+		if (redis_cluster_add_node(inst, ep->host, ep->port) != i) {
+			log_(L_ERROR | L_CONS, "%s: Endpoint @%d %s:%d is not a shard "
+					"of its own", __func__, i, ep->host, ep->port);
+			return -1;
+		}
+		weight = ep->weight > 0 ? ep->weight : 1;
+		for (j = 0; j < weight * REDIS_RING_POINTS; j++) {
+			n = snprintf(name, sizeof(name), "%s:%d-%d", ep->host, ep->port,
+					j);
+			cl->ring[cl->num_ring].hash = redis_hash(name, n);
+			cl->ring[cl->num_ring].node = i;
+			cl->num_ring++;
+		}
+	}
+	qsort(cl->ring, cl->num_ring, sizeof(REDIS_RING_POINT),
+			redis_compare_ring);
+
+	log_(L_INFO, "%s: %d shards, %d points on the ring", __func__,
+			cl->num_nodes, cl->num_ring);
+	return 0;
+}
+
+/*
+ * Bootstrap the slot map from the seeds and start the refresher.
+ */
+static int redis_cluster_start(REDIS_INSTANCE *inst) {
+	REDIS_CLUSTER *cl;
+	int i, rcode;
+
+	cl = calloc(1, sizeof(REDIS_CLUSTER));
+	if (cl == NULL)
+		return -1;
+	for (i = 0; i < REDIS_CLUSTER_SLOTS; i++)
+		cl->slots[i] = -1;
+	pthread_mutex_init(&cl->mutex, NULL);
+	pthread_mutex_init(&cl->refresh_mutex, NULL);
+	pthread_cond_init(&cl->refresh_cond, NULL);
+	inst->cluster = cl;
+
+	if (redis_cluster_refresh(inst) < 0 || cl->num_nodes == 0) {
+		log_(L_ERROR | L_CONS, "%s: No seed node has a slot map", __func__);
+		return -1;
+	}
+
+	rcode = pthread_create(&cl->refresher, NULL, redis_cluster_refresher,
+			inst);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to start refresher thread: returns (%d)", __func__,
+				rcode);
+		return -1;
+	}
+	cl->running = 1;
+
+	log_(L_INFO, "%s: %d nodes serve the cluster", __func__, cl->num_nodes);
+	return 0;
+}
+
+static void redis_cluster_stop(REDIS_INSTANCE *inst) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	int i;
+
+	if (cl->running) {
+		pthread_mutex_lock(&cl->refresh_mutex);
+		cl->stop = 1;
+		pthread_cond_signal(&cl->refresh_cond);
+		pthread_mutex_unlock(&cl->refresh_mutex);
+		pthread_join(cl->refresher, NULL);
+	}
+
+	for (i = 0; i < cl->num_nodes; i++)
+		redis_pool_destroy(cl->pools[i]);
+	pthread_cond_destroy(&cl->refresh_cond);
+	pthread_mutex_destroy(&cl->refresh_mutex);
+	pthread_mutex_destroy(&cl->mutex);
+	free(cl->ring);
+	free(cl);
+	inst->cluster = NULL;
+}
+
+/*
+ * Index of the node at host:port, which gets a pool of the instance's
+ * config if it is new.  Returns -1 if there is no room for another node
+ * or its pool cannot be set up.  The pool connects outside cl->mutex, so
+ * a slow node does not hold up the others being looked up or added.
+ */
+static int redis_cluster_add_node(REDIS_INSTANCE *inst, const char *host,
+		int port) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	REDIS_INSTANCE *pool = NULL;
+	REDIS_CONFIG config;
+	REDIS_ENDPOINT ep;
+	int i, n;
+
+	n = __atomic_load_n(&cl->num_nodes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		if (cl->nodes[i].port == port && strcmp(cl->nodes[i].host, host) == 0)
+			return i;
+	}
+
+	if (n == REDIS_CLUSTER_MAX_NODES || strlen(host) >= sizeof(ep.host)) {
+		log_(L_ERROR | L_CONS, "%s: No room for node %s:%d", __func__, host,
+				port);
+		return -1;
+	}
+
+	memset(&ep, 0, sizeof(ep));
+	strcpy(ep.host, host);
+	ep.port = port;
+	config = *inst->config;
+	config.endpoints = &ep;
+	config.num_endpoints = 1;
+	config.cluster = 0;
+	config.sharded = 0;
+	config.replicas = NULL;
+	config.num_replicas = 0;
+	if (redis_pool_create(&config, &pool) < 0) {
+		log_(L_ERROR | L_CONS, "%s: No pool for node %s:%d", __func__, host,
+				port);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cl->mutex);
+	/* somebody may have added it meanwhile, then theirs is kept */
+	for (n = cl->num_nodes; i < n; i++) {
+		if (cl->nodes[i].port == port
+				&& strcmp(cl->nodes[i].host, host) == 0) {
+			pthread_mutex_unlock(&cl->mutex);
+			redis_pool_destroy(pool);
+			return i;
+		}
+	}
+	if (n == REDIS_CLUSTER_MAX_NODES) {
+		pthread_mutex_unlock(&cl->mutex);
+		redis_pool_destroy(pool);
+		log_(L_ERROR | L_CONS, "%s: No room for node %s:%d", __func__, host,
+				port);
+		return -1;
+	}
+	cl->pools[n] = pool;
+	cl->nodes[n] = ep;
+	__atomic_store_n(&cl->num_nodes, n + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cl->mutex);
+
+	log_(L_INFO, "%s: node %d is %s:%d", __func__, n, host, port);
+	return n;
+}
+
+/*
+ * The node pool a socket handed out for a cluster instance came from.
+ */
+static REDIS_INSTANCE * redis_cluster_owner(REDIS_INSTANCE *inst,
+		REDIS_SOCKET *redisocket) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	REDIS_INSTANCE *pool;
+	int i, n;
+
+	if (redisocket->mux)
+		return redisocket->mux->inst;
+
+	n = __atomic_load_n(&cl->num_nodes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		pool = cl->pools[i];
+		if (redisocket >= pool->redis_pool
+				&& redisocket < pool->redis_pool + pool->num_slots)
+			return pool;
+	}
+
+	log_(L_ERROR, "%s: Socket id %d is not of any node, bug?", __func__,
+			redisocket->id);
+	return NULL;
+}
+
+REDIS_SOCKET * redis_get_socket_key(REDIS_INSTANCE * inst, const char *key,
+		size_t keylen) {
+	if (inst->cluster == NULL)
+		return redis_get_socket(inst);
+	return redis_get_socket(inst->cluster->pools[redis_cluster_node_of(inst,
+			key, keylen)]);
+}
+
+int redis_cluster_get_node(REDIS_INSTANCE * inst, int idx,
+		REDIS_ENDPOINT * endpoint, REDIS_INSTANCE ** pool) {
+	if (inst == NULL || inst->cluster == NULL || idx < 0
+			|| idx >= __atomic_load_n(&inst->cluster->num_nodes,
+					__ATOMIC_ACQUIRE))
+		return -1;
+
+	if (endpoint)
+		*endpoint = inst->cluster->nodes[idx];
+	if (pool)
+		*pool = inst->cluster->pools[idx];
+	return 0;
+}
+
+/*
+ * Send a formatted command to the node serving 'key', or if that is NULL
+ * the key found in the command, or to any node if it has none; SCAN
+ * always goes to the first node of a cluster, so that its cursor stays
+ * valid.  KEYS, DBSIZE and FLUSHDB would only see the keys of one node,
+ * as would SCAN those of one shard, and get an error reply.  In a
+ * cluster a MOVED means the slot map is out of date: the slot is pointed
+ * at the node named, the command is resent there and the refresher
+ * reloads the rest of the map in the background, so only the commands
+ * that hit a moved slot pay for it.  An ASK is for this one command
+ * during a migration and leaves the map alone.  In sharded mode, where
+ * no server checks, a command whose keys are on more than one shard gets
+ * a CROSSSLOT error reply of our own.
+ */
+static void* redis_cluster_command(REDIS_INSTANCE *inst, const REDIS_ARG *key,
+		const char *cmd, size_t len) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	REDIS_INSTANCE *pool;
+	REDIS_SOCKET *sock;
+	REDIS_ARG found;
+	redisReply *reply = NULL, *r;
+	char host[sizeof(cl->nodes[0].host)];
+	int slot, port, node, flags, asking = 0, redirects;
+
+	if (key == NULL && redis_find_key(cmd, len, &found) == 0)
+		key = &found;
+	if (key) {
+		node = redis_cluster_node_of(inst, key->str, key->len);
+		/* no shard would notice, so say what a cluster node would */
+		if (key == &found && cl->ring
+				&& !redis_keys_on_node(inst, cmd, len, node))
+			return redis_error_reply("CROSSSLOT Keys in request don't hash "
+					"to the same shard");
+	} else if ((flags = redis_command_flags(cmd, len)) & REDIS_CMD_KEYSPACE
+			|| (flags & REDIS_CMD_CURSOR && cl->ring)) {
+		return redis_error_reply("ERR Command would see one node only, send "
+				"it to the pool of each of redis_cluster_get_node");
+	} else if (flags & REDIS_CMD_CURSOR) {
+		/* a cursor only means something to the node that handed it out */
+		node = 0;
+	} else {
+		node = redis_thread_random()
+				% __atomic_load_n(&cl->num_nodes, __ATOMIC_ACQUIRE);
+	}
+
+	for (redirects = 0;; redirects++) {
+		pool = cl->pools[node];
+		sock = redis_get_socket_timed(pool,
+				pool->config->net_readwrite_timeout);
+		if (sock == NULL) {
+			log_(L_ERROR, "%s: No socket for node %s:%d", __func__,
+					cl->nodes[node].host, cl->nodes[node].port);
+			break;
+		}
+
+		/* ASKING and the command must follow each other on one connection */
+		if (asking) {
+			r = redis_dispatch(sock, pool, redis_asking,
+					sizeof(redis_asking) - 1);
+			if (r == NULL) {
+				redis_release_socket(NULL, pool, sock);
+				break;
+			}
+			freeReplyObject(r);
+		}
+		reply = redis_dispatch(sock, pool, cmd, len);
+		redis_release_socket(reply, pool, sock);
+
+		if (reply == NULL) {
+			/* the node may be gone in a failover */
+			redis_cluster_kick(cl);
+			break;
+		}
+		if (reply->type != REDIS_REPLY_ERROR || cl->ring
+				|| redirects == REDIS_CLUSTER_MAX_REDIRECTS)
+			break;
+		asking = redis_parse_redirect(reply->str, &slot, host, sizeof(host),
+				&port);
+		if (asking < 0
+				|| (node = redis_cluster_add_node(inst, host, port)) < 0)
+			break;
+
+		if (asking) {
+			__atomic_add_fetch(&inst->stats.asked, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n(&cl->slots[slot], node, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&inst->stats.moved, 1, __ATOMIC_RELAXED);
+			redis_cluster_kick(cl);
+		}
+		DEBUG("%s: %s", __func__, reply->str);
+		freeReplyObject(reply);
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+/*
+ * Parse the error of a redirect, MOVED <slot> <host>:<port> or the same
+ * for ASK.  Returns 0 for MOVED, 1 for ASK and -1 for any other error.
+ */
+static int redis_parse_redirect(const char *err, int *slot, char *host,
+		size_t size, int *port) {
+	const char *colon;
+	char *p;
+	int asking;
+
+	if (strncmp(err, "MOVED ", 6) == 0)
+		asking = 0;
+	else if (strncmp(err, "ASK ", 4) == 0)
+		asking = 1;
+	else
+		return -1;
+
+	*slot = strtol(strchr(err, ' ') + 1, &p, 10);
+	colon = strrchr(p, ':');
+	if (*slot < 0 || *slot >= REDIS_CLUSTER_SLOTS || *p != ' '
+			|| colon == NULL || colon == p + 1
+			|| colon - p - 1 >= (long) size)
+		return -1;
+	memcpy(host, p + 1, colon - p - 1);
+	host[colon - p - 1] = '\0';
+	*port = atoi(colon + 1);
+	if (*port <= 0 || *port > 65535)
+		return -1;
+	return asking;
+}
+
+/*
+ * Reload the slot map from the first node, or failing that the first
+ * seed, that answers CLUSTER SLOTS.
+ */
+static int redis_cluster_refresh(REDIS_INSTANCE *inst) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	REDIS_INSTANCE *pool;
+	REDIS_SOCKET *sock;
+	redisContext *c;
+	redisReply *reply;
+	int i, n, rcode = -1;
+
+	n = __atomic_load_n(&cl->num_nodes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n && rcode < 0; i++) {
+		pool = cl->pools[i];
+		sock = redis_get_socket_timed(pool,
+				pool->config->net_readwrite_timeout);
+		if (sock == NULL)
+			continue;
+		reply = redis_dispatch(sock, pool, redis_cluster_slots,
+				sizeof(redis_cluster_slots) - 1);
+		redis_release_socket(reply, pool, sock);
+		if (reply) {
+			rcode = redis_cluster_load(inst, reply, &cl->nodes[i]);
+			freeReplyObject(reply);
+		}
+	}
+
+	for (i = 0; i < inst->config->num_endpoints && rcode < 0; i++) {
+		c = redis_connect_endpoint(inst, i, -1);
+		if (c == NULL)
+			continue;
+		if (redisAppendFormattedCommand(c, redis_cluster_slots,
+				sizeof(redis_cluster_slots) - 1) == REDIS_OK
+				&& redisGetReply(c, (void **) &reply) == REDIS_OK) {
+			rcode = redis_cluster_load(inst, reply,
+					&inst->config->endpoints[i]);
+			freeReplyObject(reply);
+		}
+		redisFree(c);
+	}
+
+	if (rcode == 0)
+		__atomic_add_fetch(&inst->stats.slot_refreshes, 1, __ATOMIC_RELAXED);
+	else
+		log_(L_WARN, "%s: No node answered CLUSTER SLOTS", __func__);
+	return rcode;
+}
+
+/*
+ * Point the slots of a CLUSTER SLOTS reply at their masters.  Each
+ * element is [first, last, [host, port, ...], replicas...], and a host
+ * left empty or "?" is the node that was asked, 'from'.
+ */
+static int redis_cluster_load(REDIS_INSTANCE *inst, redisReply *reply,
+		const REDIS_ENDPOINT *from) {
+	REDIS_CLUSTER *cl = inst->cluster;
+	redisReply *r, *m;
+	const char *host;
+	long long first, last, s;
+	size_t i;
+	int node;
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		log_(L_ERROR, "%s: CLUSTER SLOTS failed: %s", __func__,
+				reply->type == REDIS_REPLY_ERROR ? reply->str : "no array");
+		return -1;
+	}
+
+	for (i = 0; i < reply->elements; i++) {
+		r = reply->element[i];
+		if (r->type != REDIS_REPLY_ARRAY || r->elements < 3
+				|| r->element[0]->type != REDIS_REPLY_INTEGER
+				|| r->element[1]->type != REDIS_REPLY_INTEGER
+				|| (m = r->element[2])->type != REDIS_REPLY_ARRAY
+				|| m->elements < 2 || m->element[0]->type != REDIS_REPLY_STRING
+				|| m->element[1]->type != REDIS_REPLY_INTEGER)
+			continue;
+		first = r->element[0]->integer;
+		last = r->element[1]->integer;
+		if (first < 0 || last >= REDIS_CLUSTER_SLOTS || first > last)
+			continue;
+
+		host = m->element[0]->len == 0 || strcmp(m->element[0]->str, "?") == 0 ?
+				from->host : m->element[0]->str;
+		node = redis_cluster_add_node(inst, host,
+				(int) m->element[1]->integer);
+		if (node < 0)
+			continue;
+		for (s = first; s <= last; s++)
+			__atomic_store_n(&cl->slots[s], node, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static void redis_cluster_kick(REDIS_CLUSTER *cl) {
+	pthread_mutex_lock(&cl->refresh_mutex);
+	cl->refresh_wanted = 1;
+	pthread_cond_signal(&cl->refresh_cond);
+	pthread_mutex_unlock(&cl->refresh_mutex);
+}
+
+/*
+ * Reload the slot map whenever redis_cluster_kick asks for it, at most
+ * once per REDIS_CLUSTER_REFRESH_MS: while slots migrate MOVEDs come in
+ * bursts, and one reload covers the burst.
+ */
+static void* redis_cluster_refresher(void *arg) {
+	REDIS_INSTANCE *inst = arg;
+	REDIS_CLUSTER *cl = inst->cluster;
+	struct timespec ts;
+
+	pthread_mutex_lock(&cl->refresh_mutex);
+	while (!cl->stop) {
+		if (!cl->refresh_wanted) {
+			pthread_cond_wait(&cl->refresh_cond, &cl->refresh_mutex);
+			continue;
+		}
+		cl->refresh_wanted = 0;
+		pthread_mutex_unlock(&cl->refresh_mutex);
+
+		redis_cluster_refresh(inst);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long) REDIS_CLUSTER_REFRESH_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&cl->refresh_mutex);
+		while (!cl->stop && pthread_cond_timedwait(&cl->refresh_cond,
+				&cl->refresh_mutex, &ts) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&cl->refresh_mutex);
+
+	return NULL;
+}
+
+/*
+ * Sentinel.  With sentinels configured the pool has one endpoint, the
+ * primary they report for master_name.  A thread stays subscribed to
+ * +switch-master on one sentinel at a time; when the primary moves the
+ * endpoint takes the new address and the instance epoch is bumped.
+ * Idle sockets are reconnected at once and the multiplexed connections
+ * broken so they reconnect; sockets in use are reconnected when they
+ * are released with a stale epoch, so nothing keeps writing to the
+ * demoted primary for longer than the command in flight.
+ */
+
+static redisContext * redis_sentinel_connect(REDIS_INSTANCE *inst, int idx) {
+	REDIS_ENDPOINT *s = &inst->config->sentinels[idx];
+	struct timeval timeout;
+	redisContext *c;
+
+	timeout.tv_sec = inst->config->connect_timeout / 1000;
+	timeout.tv_usec = 1000 * (inst->config->connect_timeout % 1000);
+
+	c = redisConnectWithTimeout(s->host, s->port, timeout);
+	if (c == NULL || c->err != 0) {
+		log_(L_WARN | L_CONS, "%s: Failed to connect sentinel %s:%d: %s",
+				__func__, s->host, s->port,
+				c ? c->errstr : "can't allocate redis handle");
+		if (c)
+			redisFree(c);
+		return NULL;
+	}
+
+	timeout.tv_sec = inst->config->net_readwrite_timeout / 1000;
+	timeout.tv_usec = 1000 * (inst->config->net_readwrite_timeout % 1000);
+	redisSetTimeout(c, timeout);
+	return c;
+}
+
+/*
+ * Ask sentinel 'idx' for the address of the primary.
+ */
+static int redis_sentinel_query(REDIS_INSTANCE *inst, int idx, char *host,
+		int *port) {
+	REDIS_ENDPOINT *s = &inst->config->sentinels[idx];
+	redisContext *c;
+	redisReply *reply;
+	int rcode = -1;
+
+	if ((c = redis_sentinel_connect(inst, idx)) == NULL)
+		return -1;
+
+	reply = redisCommand(c, "SENTINEL get-master-addr-by-name %s",
+			inst->config->master_name);
+	if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2
+			&& reply->element[0]->type == REDIS_REPLY_STRING
+			&& reply->element[1]->type == REDIS_REPLY_STRING
+			&& reply->element[0]->len < 256) {
+		strcpy(host, reply->element[0]->str);
+		*port = atoi(reply->element[1]->str);
+		rcode = 0;
+	} else {
+		log_(L_WARN | L_CONS, "%s: Sentinel %s:%d has no primary of %s: %s",
+				__func__, s->host, s->port, inst->config->master_name,
+				reply ? (reply->type == REDIS_REPLY_ERROR ? reply->str
+						: "unknown") : c->errstr);
+	}
+
+	if (reply)
+		freeReplyObject(reply);
+	redisFree(c);
+	return rcode;
+}
+
+/*
+ * Fill in the endpoint from the first sentinel that knows the primary.
+ */
+static int redis_sentinel_discover(REDIS_INSTANCE *inst) {
+	REDIS_ENDPOINT *ep = &inst->config->endpoints[0];
+	int i;
+
+	for (i = 0; i < inst->config->num_sentinels; i++) {
+		if (redis_sentinel_query(inst, i, ep->host, &ep->port) == 0) {
+			log_(L_INFO, "%s: Primary of %s is %s:%d", __func__,
+					inst->config->master_name, ep->host, ep->port);
+			return 0;
+		}
+	}
+
+	log_(L_ERROR | L_CONS, "%s: No sentinel knows the primary of %s",
+			__func__, inst->config->master_name);
+	return -1;
+}
+
+static int redis_sentinel_start(REDIS_INSTANCE *inst) {
+	int rcode;
+
+	inst->sentinel_stop = 0;
+	rcode = pthread_create(&inst->sentinel_thread, NULL, redis_sentinel_main,
+			inst);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to start sentinel thread: returns (%d)", __func__,
+				rcode);
+		return -1;
+	}
+	inst->sentinel = 1;
+	return 0;
+}
+
+static void redis_sentinel_stop(REDIS_INSTANCE *inst) {
+	pthread_mutex_lock(&inst->sentinel_mutex);
+	inst->sentinel_stop = 1;
+	/* the subscriber waits for messages without a timeout */
+	if (inst->sentinel_conn)
+		shutdown(((redisContext *) inst->sentinel_conn)->fd, SHUT_RDWR);
+	pthread_cond_signal(&inst->sentinel_cond);
+	pthread_mutex_unlock(&inst->sentinel_mutex);
+
+	pthread_join(inst->sentinel_thread, NULL);
+	inst->sentinel = 0;
+}
+
+/*
+ * Subscribe to +switch-master on each sentinel in turn for as long as it
+ * answers.  After subscribing the primary is asked for once more, in
+ * case it moved while nobody was listening.
+ */
+static void* redis_sentinel_main(void *arg) {
+	REDIS_INSTANCE *inst = arg;
+	redisContext *c;
+	redisReply *reply;
+	struct timeval forever = { 0, 0 };
+	struct timespec ts;
+	char name[64], host[256], old[256];
+	int idx = 0, port, oldport;
+
+	pthread_mutex_lock(&inst->sentinel_mutex);
+	while (!inst->sentinel_stop) {
+		pthread_mutex_unlock(&inst->sentinel_mutex);
+
+		c = redis_sentinel_connect(inst, idx);
+		reply = c ? redisCommand(c, "SUBSCRIBE +switch-master") : NULL;
+		if (reply && reply->type == REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			reply = NULL;
+
+			pthread_mutex_lock(&inst->sentinel_mutex);
+			inst->sentinel_conn = c;
+			if (inst->sentinel_stop)
+				shutdown(c->fd, SHUT_RDWR);
+			pthread_mutex_unlock(&inst->sentinel_mutex);
+
+			log_(L_INFO, "%s: Following %s on sentinel %s:%d", __func__,
+					inst->config->master_name,
+					inst->config->sentinels[idx].host,
+					inst->config->sentinels[idx].port);
+			if (redis_sentinel_query(inst, idx, host, &port) == 0)
+				redis_sentinel_switch(inst, host, port);
+
+			redisSetTimeout(c, forever);
+			while (redisGetReply(c, (void **) &reply) == REDIS_OK) {
+				/* message, +switch-master, name old-ip old-port new-ip new-port */
+				if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3
+						&& reply->element[2]->type == REDIS_REPLY_STRING
+						&& sscanf(reply->element[2]->str,
+								"%63s %255s %d %255s %d", name, old, &oldport,
+								host, &port) == 5
+						&& strcmp(name, inst->config->master_name) == 0)
+					redis_sentinel_switch(inst, host, port);
+				freeReplyObject(reply);
+				reply = NULL;
+			}
+
+			pthread_mutex_lock(&inst->sentinel_mutex);
+			inst->sentinel_conn = NULL;
+			pthread_mutex_unlock(&inst->sentinel_mutex);
+		}
+		if (reply)
+			freeReplyObject(reply);
+		if (c)
+			redisFree(c);
+
+		idx = (idx + 1) % inst->config->num_sentinels;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long) REDIS_SENTINEL_RETRY_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&inst->sentinel_mutex);
+		while (!inst->sentinel_stop && pthread_cond_timedwait(
+				&inst->sentinel_cond, &inst->sentinel_mutex, &ts) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&inst->sentinel_mutex);
+
+	return NULL;
+}
+
+/*
+ * Point the endpoint at the new primary and drain the connections to
+ * the old one.  The circuit starts out closed, as the failures of the
+ * old primary say nothing about the new one.
+ */
+static void redis_sentinel_switch(REDIS_INSTANCE *inst, const char *host,
+		int port) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[0];
+	REDIS_ENDPOINT *ep = &inst->config->endpoints[0];
+
+	if (strlen(host) >= sizeof(ep->host) || port <= 0 || port > 65535)
+		return;
+
+	pthread_mutex_lock(&es->mutex);
+	if (ep->port == port && strcmp(ep->host, host) == 0) {
+		pthread_mutex_unlock(&es->mutex);
+		return;
+	}
+	log_(L_WARN | L_CONS, "%s: Primary of %s moved from %s:%d to %s:%d",
+			__func__, inst->config->master_name, ep->host, ep->port, host,
+			port);
+	strcpy(ep->host, host);
+	ep->port = port;
+	es->breaker = breakerclosed;
+	es->failures = 0;
+	es->probing = 0;
+	__atomic_add_fetch(&inst->epoch, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&es->mutex);
+
+	__atomic_add_fetch(&inst->stats.failovers, 1, __ATOMIC_RELAXED);
+	redis_sentinel_drain(inst);
+}
+
+/*
+ * Reconnect what can be reconnected right away: the idle sockets, in
+ * parallel, and the multiplexed connections.  Idle lane connections are
+ * closed, the lane opens new ones on demand.
+ */
+static void redis_sentinel_drain(REDIS_INSTANCE *inst) {
+	unsigned int epoch = __atomic_load_n(&inst->epoch, __ATOMIC_ACQUIRE);
+	REDIS_SOCKET **socks, *cur, *lane;
+	REDIS_MUX *m;
+	int i, n = 0, connected;
+
+	socks = malloc(sizeof(REDIS_SOCKET *) * inst->num_slots);
+	for (i = 0; socks && i < inst->num_slots; i++) {
+		cur = &inst->redis_pool[i];
+		if (!cur->active)
+			continue;
+
+		/* idle in the free map or parked in some thread's cache */
+		if (!redis_claim_bit(redis_free_map(inst, cur->backup), i)
+				&& !(__atomic_load_n(&cur->cached, __ATOMIC_RELAXED)
+						&& __atomic_exchange_n(&cur->cached, 0,
+								__ATOMIC_ACQUIRE)))
+			continue;
+
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+		if (cur->state == sockconnected && cur->epoch == epoch) {
+			redis_put_socket(inst, cur);
+			continue;
+		}
+		redis_drop_connection(cur);
+		cur->connect_failures = 0;
+		cur->next_connect_at = 0;
+		socks[n++] = cur;
+	}
+
+	connected = redis_connect_sockets(inst, socks, n);
+	for (i = 0; i < n; i++) {
+		if (socks[i]->state != sockconnected && inst->maintenance)
+			redis_put_dead(inst, socks[i]);
+		else
+			redis_put_socket(inst, socks[i]);
+	}
+	free(socks);
+
+	for (i = 0; i < inst->num_mux; i++) {
+		m = &inst->mux[i];
+		pthread_mutex_lock(&m->mutex);
+		if (m->conn)
+			shutdown(((redisContext *) m->conn)->fd, SHUT_RDWR);
+		pthread_mutex_unlock(&m->mutex);
+	}
+
+	pthread_mutex_lock(&inst->lane_mutex);
+	lane = inst->lane_free;
+	inst->lane_free = NULL;
+	for (cur = lane; cur; cur = cur->next_virtual)
+		inst->num_lane--;
+	pthread_mutex_unlock(&inst->lane_mutex);
+	while (lane) {
+		cur = lane;
+		lane = cur->next_virtual;
+		redisFree(cur->conn);
+		free(cur);
+	}
+
+	log_(L_INFO | L_CONS, "%s: %d of %d idle sockets reconnected", __func__,
+			connected, n);
+}
+
+/*
+ * Fold one command's round trip into its endpoint's statistics.  The
+ * moving average and the p95 are updated without a lock; a lost update
+ * under a race only drops one sample.
+ */
+static void redis_endpoint_observe(REDIS_ENDPOINT_STATE *es, long long usec,
+		int ok) {
+	long ewma, p95, step;
+
+	if (usec < 0)
+		usec = 0;
+
+	__atomic_add_fetch(&es->commands, 1, __ATOMIC_RELAXED);
+	if (!ok) {
+		__atomic_add_fetch(&es->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* EWMA with a weight of 1/8 for the new sample */
+	ewma = __atomic_load_n(&es->latency_usec, __ATOMIC_RELAXED);
+	ewma += ((long) usec - ewma) / 8;
+	__atomic_store_n(&es->latency_usec, ewma, __ATOMIC_RELAXED);
+
+	/*
+	 * p95 by stochastic approximation: 19 steps up for a sample above
+	 * it, one down for any other, which settles where 1 in 20 is above.
+	 */
+	p95 = __atomic_load_n(&es->p95_usec, __ATOMIC_RELAXED);
+	step = p95 / 256 + 1;
+	p95 += (long) usec > p95 ? 19 * step : -step;
+	__atomic_store_n(&es->p95_usec, p95 > 0 ? p95 : 0, __ATOMIC_RELAXED);
+}
+
+int redis_pool_get_endpoint_stats(REDIS_INSTANCE * inst, int idx,
+		REDIS_ENDPOINT_STATS * stats) {
+	REDIS_ENDPOINT_STATE *es;
+	int i;
+
+	if (inst == NULL || stats == NULL || idx < 0
+			|| idx >= inst->config->num_endpoints)
+		return -1;
+
+	es = &inst->endpoint_state[idx];
+	memset(stats, 0, sizeof(*stats));
+	stats->breaker = __atomic_load_n(&es->breaker, __ATOMIC_RELAXED);
+	stats->inflight = __atomic_load_n(&es->inflight, __ATOMIC_RELAXED);
+	stats->commands = __atomic_load_n(&es->commands, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&es->errors, __ATOMIC_RELAXED);
+	stats->latency_usec = __atomic_load_n(&es->latency_usec,
+			__ATOMIC_RELAXED);
+	stats->p95_usec = __atomic_load_n(&es->p95_usec, __ATOMIC_RELAXED);
+
+	stats->idle = redis_popcount_map(inst, redis_free_map(inst, idx));
+	for (i = 0; i < inst->num_slots; i++) {
+		if (!inst->redis_pool[i].active || inst->redis_pool[i].backup != idx)
+			continue;
+		if (inst->redis_pool[i].state == sockconnected)
+			stats->sockets++;
+		if (__atomic_load_n(&inst->redis_pool[i].cached, __ATOMIC_RELAXED))
+			stats->idle++;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a broken socket out of circulation.  It is closed and left in the
+ * dead map for the maintenance thread to reconnect.
+ */
+static void redis_put_dead(REDIS_INSTANCE *inst, REDIS_SOCKET *redisocket) {
+	int id = redisocket->id;
+
+	redis_drop_connection(redisocket);
+	redisocket->inuse = 0;
+	pthread_mutex_unlock(&redisocket->mutex);
+
+	__atomic_fetch_or(&inst->dead_map[id / 64].bits, (uint64_t) 1 << (id % 64),
+			__ATOMIC_RELEASE);
+	redis_kick_maintenance(inst);
+}
+
+static int redis_start_maintenance(REDIS_INSTANCE *inst) {
+	int rcode;
+
+	/* maintenance_kicked is left alone: sockets put dead before the
+	 * thread starts kicked it, and the first pass must not wait */
+	inst->maintenance_stop = 0;
+	inst->maintenance = 1;
+
+	rcode = pthread_create(&inst->maintenance_thread, NULL,
+			redis_maintenance_main, inst);
+	if (rcode != 0) {
+		log_(L_ERROR | L_CONS, "%s: "
+				"Failed to start maintenance thread: returns (%d)", __func__,
+				rcode);
+		inst->maintenance = 0;
+		return -1;
+	}
+
+	log_(L_INFO, "%s: maintenance every %d ms, heartbeat after %d ms idle",
+			__func__, inst->config->maintenance_interval,
+			inst->config->heartbeat_interval);
+	return 0;
+}
+
+static void redis_stop_maintenance(REDIS_INSTANCE *inst) {
+	pthread_mutex_lock(&inst->maintenance_mutex);
+	inst->maintenance_stop = 1;
+	pthread_cond_signal(&inst->maintenance_cond);
+	pthread_mutex_unlock(&inst->maintenance_mutex);
+
+	pthread_join(inst->maintenance_thread, NULL);
+	inst->maintenance = 0;
+}
+
+/*
+ * Wake the maintenance thread before its interval is up.
+ */
+static void redis_kick_maintenance(REDIS_INSTANCE *inst) {
+	pthread_mutex_lock(&inst->maintenance_mutex);
+	inst->maintenance_kicked = 1;
+	pthread_cond_signal(&inst->maintenance_cond);
+	pthread_mutex_unlock(&inst->maintenance_mutex);
+}
+
+/*
+ * Claim the slot behind one bit of a map.  Returns 0 if somebody else
+ * got it first.
+ */
+static int redis_claim_bit(REDIS_FREE_WORD *map, int id) {
+	uint64_t mask = (uint64_t) 1 << (id % 64);
+
+	return (__atomic_fetch_and(&map[id / 64].bits, ~mask, __ATOMIC_ACQUIRE)
+			& mask) != 0;
+}
+
+/*
+ * Reconnect everything in the dead map whose grace period is over.
+ */
+static void redis_maintain_dead(REDIS_INSTANCE *inst) {
+	int i, n = 0;
+	long long now;
+	REDIS_SOCKET *cur, **socks = NULL;
+
+	if (!redis_endpoints_available(inst))
+		return;
+
+	now = redis_monotonic_usec();
+	for (i = 0; i < inst->num_slots; i++) {
+		if (!(__atomic_load_n(&inst->dead_map[i / 64].bits, __ATOMIC_RELAXED)
+				& ((uint64_t) 1 << (i % 64))))
+			continue;
+		cur = &inst->redis_pool[i];
+		if (now < __atomic_load_n(&cur->next_connect_at, __ATOMIC_RELAXED))
+			continue;
+		if (socks == NULL
+				&& (socks = malloc(sizeof(REDIS_SOCKET *) * inst->num_slots))
+						== NULL)
+			return;
+		if (!redis_claim_bit(inst->dead_map, i))
+			continue;
+
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+		socks[n++] = cur;
+	}
+	if (n == 0) {
+		free(socks);
+		return;
+	}
+
+	redis_connect_sockets(inst, socks, n);
+
+	for (i = 0; i < n; i++) {
+		cur = socks[i];
+		if (cur->state == sockconnected) {
+			log_(L_INFO, "%s: reconnected handle %d", __func__, cur->id);
+			redis_put_socket(inst, cur);
+		} else {
+			cur->inuse = 0;
+			pthread_mutex_unlock(&cur->mutex);
+			__atomic_fetch_or(&inst->dead_map[cur->id / 64].bits,
+					(uint64_t) 1 << (cur->id % 64), __ATOMIC_RELEASE);
+		}
+	}
+	free(socks);
+}
+
+/*
+ * PING sockets that sat idle longer than heartbeat_interval, so that
+ * connections dropped by the server or a middlebox are found here and
+ * not by the next request.
+ */
+static void redis_maintain_idle(REDIS_INSTANCE *inst) {
+	int i;
+	long long now, idle;
+	REDIS_SOCKET *cur;
+	redisReply *reply;
+
+	idle = (long long) inst->config->heartbeat_interval * 1000;
+	if (idle <= 0)
+		return;
+
+	for (i = 0; i < inst->num_slots; i++) {
+		cur = &inst->redis_pool[i];
+		if (!cur->active)
+			continue;
+		now = redis_monotonic_usec();
+		if (now - __atomic_load_n(&cur->last_used, __ATOMIC_RELAXED) < idle)
+			continue;
+
+		/* idle in the free map or parked in some thread's cache */
+		if (!redis_claim_bit(redis_free_map(inst, cur->backup), i)
+				&& !(__atomic_load_n(&cur->cached, __ATOMIC_RELAXED)
+						&& __atomic_exchange_n(&cur->cached, 0,
+								__ATOMIC_ACQUIRE)))
+			continue;
+
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+
+		reply = NULL;
+		if (cur->state == sockconnected)
+			reply = redisCommand(cur->conn, "PING");
+
+		if (reply == NULL) {
+			log_(L_WARN, "%s: handle %d failed heartbeat, reconnecting",
+					__func__, cur->id);
+			redis_drop_connection(cur);
+			if (connect_single_socket(cur, inst) < 0) {
+				redis_put_dead(inst, cur);
+				continue;
+			}
+		} else {
+			freeReplyObject(reply);
+		}
+
+		redis_put_socket(inst, cur);
+	}
+}
+
+/*
+ * Add up to 'want' connected sockets to the free map.
+ */
+static void redis_grow_pool(REDIS_INSTANCE *inst, int want) {
+	REDIS_SOCKET *sock;
+
+	pthread_mutex_lock(&inst->pool_size_mutex);
+	while (want-- > 0 && inst->pool_size < inst->config->max_num_redis_socks) {
+		sock = add_new_socket(inst);
+		if (sock == NULL)
+			break;
+
+		pthread_mutex_lock(&sock->mutex);
+		sock->inuse = 1;
+		redis_put_socket(inst, sock);
+	}
+	pthread_mutex_unlock(&inst->pool_size_mutex);
+}
+
+static int redis_popcount_map(REDIS_INSTANCE *inst, REDIS_FREE_WORD *map) {
+	int w, n = 0;
+
+	for (w = 0; w < inst->num_free_words; w++)
+		n += __builtin_popcountll(__atomic_load_n(&map[w].bits,
+				__ATOMIC_RELAXED));
+	return n;
+}
+
+/*
+ * Decide how many sockets to pre-connect.  Callers that found the pool
+ * exhausted ask explicitly; otherwise grow ahead of demand when the share
+ * of sockets in use crosses high_watermark, or when acquisitions since
+ * the last pass queued longer than wait_watermark on average.
+ */
+static int redis_maintain_grow(REDIS_INSTANCE *inst) {
+	REDIS_POOL_STATS now;
+	unsigned long waits;
+	unsigned long long wait_usec;
+	int i, idle, inuse, want = 0;
+
+	redis_pool_get_stats(inst, &now);
+	waits = now.waits - inst->last_stats.waits;
+	wait_usec = now.wait_usec_total - inst->last_stats.wait_usec_total;
+	inst->last_stats = now;
+
+	if (__atomic_exchange_n(&inst->grow_requested, 0, __ATOMIC_ACQ_REL)) {
+		want = now.waiters > 0 ? now.waiters : 1;
+	}
+
+	if (inst->config->high_watermark > 0 && inst->pool_size > 0) {
+		idle = 0;
+		for (i = 0; i < inst->config->num_endpoints; i++)
+			idle += redis_popcount_map(inst, redis_free_map(inst, i));
+		for (i = 0; i < inst->num_slots; i++) {
+			if (__atomic_load_n(&inst->redis_pool[i].cached, __ATOMIC_RELAXED))
+				idle++;
+		}
+		inuse = inst->pool_size - idle
+				- redis_popcount_map(inst, inst->dead_map);
+		if (inuse * 100 >= inst->config->high_watermark * inst->pool_size) {
+			DEBUG("%s: %d of %d sockets in use, pre-connecting", __func__,
+					inuse, inst->pool_size);
+			if (want < 1 + inst->pool_size / 8)
+				want = 1 + inst->pool_size / 8;
+		}
+	}
+
+	if (inst->config->wait_watermark > 0 && waits > 0
+			&& wait_usec / waits
+					>= (unsigned long long) inst->config->wait_watermark * 1000) {
+		DEBUG("%s: %lu acquisitions waited %llu usec on average, "
+				"pre-connecting", __func__, waits, wait_usec / waits);
+		if (want < 1 + inst->pool_size / 8)
+			want = 1 + inst->pool_size / 8;
+	}
+
+	if (want > 0 && inst->pool_size < inst->config->max_num_redis_socks) {
+		redis_grow_pool(inst, want);
+	}
+
+	return want;
+}
+
+/*
+ * Close sockets that sat in the free map longer than idle_ttl, down to
+ * num_redis_socks.  Their slots become free for later growth.
+ */
+static void redis_maintain_reap(REDIS_INSTANCE *inst) {
+	int i;
+	long long ttl, now;
+	REDIS_SOCKET *cur;
+
+	ttl = (long long) inst->config->idle_ttl * 1000;
+	if (ttl <= 0 || inst->pool_size <= inst->config->num_redis_socks)
+		return;
+
+	now = redis_monotonic_usec();
+
+	pthread_mutex_lock(&inst->pool_size_mutex);
+	for (i = inst->num_slots - 1;
+			i >= 0 && inst->pool_size > inst->config->num_redis_socks; i--) {
+		cur = &inst->redis_pool[i];
+		if (!cur->active
+				|| now - __atomic_load_n(&cur->last_used, __ATOMIC_RELAXED)
+						< ttl)
+			continue;
+
+		if (!redis_claim_bit(redis_free_map(inst, cur->backup), i)
+				&& !(__atomic_load_n(&cur->cached, __ATOMIC_RELAXED)
+						&& __atomic_exchange_n(&cur->cached, 0,
+								__ATOMIC_ACQUIRE)))
+			continue;
+
+		/* it may have been used and released since we looked */
+		if (now - cur->last_used < ttl) {
+			pthread_mutex_lock(&cur->mutex);
+			cur->inuse = 1;
+			redis_put_socket(inst, cur);
+			continue;
+		}
+
+		log_(L_INFO, "%s: closing handle %d idle for %lld ms, pool size %d",
+				__func__, cur->id, (now - cur->last_used) / 1000,
+				inst->pool_size - 1);
+		redis_close_socket(inst, cur);
+		cur->active = 0;
+		inst->pool_size--;
+		__atomic_add_fetch(&inst->stats.reaped, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&inst->pool_size_mutex);
+}
+
+/*
+ * Move idle sockets that failed over back to their home endpoint once its
+ * circuit is closed again, and recycle connections older than
+ * max_conn_age.  At most rebalance_rate sockets are touched per pass, so
+ * the pool drifts back to a balanced layout without a reconnect storm.
+ * The old connection is only dropped once the new one is up.
+ */
+static void redis_maintain_rebalance(REDIS_INSTANCE *inst) {
+	int i, target, budget = inst->config->rebalance_rate;
+	long long now, max_age;
+	REDIS_SOCKET *cur;
+	redisContext *c;
+
+	max_age = (long long) inst->config->max_conn_age * 1000;
+	now = redis_monotonic_usec();
+
+	for (i = 0; i < inst->num_slots && budget > 0; i++) {
+		cur = &inst->redis_pool[i];
+		if (!cur->active || cur->state != sockconnected)
+			continue;
+
+		if ((cur->backup == cur->home
+				|| !redis_endpoint_might_allow(inst, cur->home, now))
+				&& (max_age <= 0 || now - cur->connected_at <= max_age))
+			continue;
+
+		if (!redis_claim_bit(redis_free_map(inst, cur->backup), i))
+			continue;
+		pthread_mutex_lock(&cur->mutex);
+		cur->inuse = 1;
+
+		/*
+		 *  Only ask the home circuit once we own the socket: if it is
+		 *  half-open, we are its one probe and must go through with it.
+		 *  Recycling in place is a connect like any other and takes the
+		 *  circuit and connect budget of the endpoint it stays on.
+		 */
+		target = cur->backup;
+		if (cur->backup != cur->home && redis_endpoint_allow(inst, cur->home)) {
+			target = cur->home;
+		} else if (max_age <= 0 || now - cur->connected_at <= max_age
+				|| !redis_endpoint_allow(inst, target)) {
+			redis_put_socket(inst, cur);
+			continue;
+		}
+		budget--;
+
+		c = redis_connect_endpoint(inst, target, cur->id);
+		if (c) {
+			log_(L_INFO, "%s: moving handle %d from @%d to @%d%s", __func__,
+					cur->id, cur->backup, target,
+					target == cur->home ? " (home)" : "");
+			if (target != cur->backup)
+				__atomic_add_fetch(&inst->stats.rebalanced, 1,
+						__ATOMIC_RELAXED);
+			else
+				__atomic_add_fetch(&inst->stats.recycled, 1,
+						__ATOMIC_RELAXED);
+			redisFree(cur->conn);
+			cur->backup = target;
+			redis_attach_connection(inst, cur, c);
+		}
+
+		redis_put_socket(inst, cur);
+	}
+}
+
+/*
+ * Pop a standby connection to endpoint 'idx', or NULL if there is none.
+ */
+static redisContext * redis_take_standby(REDIS_INSTANCE *inst, int idx) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+	redisContext *c = NULL;
+
+	if (inst->config->num_standby == 0)
+		return NULL;
+
+	pthread_mutex_lock(&es->mutex);
+	if (es->num_standby > 0)
+		c = es->standby[--es->num_standby];
+	pthread_mutex_unlock(&es->mutex);
+
+	if (c) {
+		log_(L_INFO, "%s: promoted a standby connection to endpoint @%d",
+				__func__, idx);
+		__atomic_add_fetch(&inst->stats.standby_promoted, 1,
+				__ATOMIC_RELAXED);
+		if (inst->maintenance)
+			redis_kick_maintenance(inst);
+	}
+	return c;
+}
+
+/*
+ * Keep num_standby authenticated spare connections to every endpoint,
+ * PINGed every heartbeat_interval, for connect_single_socket to promote
+ * when a socket fails over.  Endpoints whose circuit is open are left
+ * alone until it closes.
+ */
+static void redis_maintain_standby(REDIS_INSTANCE *inst) {
+	int i, j, n;
+	long long now;
+	REDIS_ENDPOINT_STATE *es;
+	redisContext *c, *check[HIREDISPOOL_MAX_STANDBY];
+	redisReply *reply;
+
+	if (inst->config->num_standby == 0)
+		return;
+
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		es = &inst->endpoint_state[i];
+		now = redis_monotonic_usec();
+
+		/* take them out to PING them without holding the lock */
+		n = 0;
+		if (inst->config->heartbeat_interval > 0
+				&& now - es->standby_checked
+						>= (long long) inst->config->heartbeat_interval * 1000) {
+			pthread_mutex_lock(&es->mutex);
+			while (es->num_standby > 0)
+				check[n++] = es->standby[--es->num_standby];
+			pthread_mutex_unlock(&es->mutex);
+			es->standby_checked = now;
+		}
+
+		for (j = 0; j < n; j++) {
+			reply = redisCommand(check[j], "PING");
+			if (reply == NULL) {
+				log_(L_WARN, "%s: standby connection to @%d failed "
+						"heartbeat", __func__, i);
+				redisFree(check[j]);
+				continue;
+			}
+			freeReplyObject(reply);
+
+			pthread_mutex_lock(&es->mutex);
+			if (es->num_standby < inst->config->num_standby) {
+				es->standby[es->num_standby++] = check[j];
+				check[j] = NULL;
+			}
+			pthread_mutex_unlock(&es->mutex);
+			if (check[j])
+				redisFree(check[j]);
+		}
+
+		while (__atomic_load_n(&es->num_standby, __ATOMIC_RELAXED)
+				< inst->config->num_standby) {
+			if (!redis_endpoint_allow(inst, i))
+				break;
+			c = redis_connect_endpoint(inst, i, -1);
+			if (c == NULL)
+				break;
+
+			pthread_mutex_lock(&es->mutex);
+			if (es->num_standby < inst->config->num_standby) {
+				es->standby[es->num_standby++] = c;
+				c = NULL;
+			}
+			pthread_mutex_unlock(&es->mutex);
+			if (c)
+				redisFree(c);
+		}
+	}
+}
+
+/*
+ * The maintenance thread owns reconnecting, heartbeats and sizing the
+ * pool, so request threads only ever see connected sockets.
+ */
+static void* redis_maintenance_main(void *arg) {
+	REDIS_INSTANCE *inst = arg;
+	struct timespec ts;
+	int interval = inst->config->maintenance_interval;
+
+	pthread_mutex_lock(&inst->maintenance_mutex);
+	while (!inst->maintenance_stop) {
+		if (!inst->maintenance_kicked) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += interval / 1000;
+			ts.tv_nsec += (long) (interval % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&inst->maintenance_cond,
+					&inst->maintenance_mutex, &ts);
+			if (inst->maintenance_stop)
+				break;
+		}
+		inst->maintenance_kicked = 0;
+		pthread_mutex_unlock(&inst->maintenance_mutex);
+
+		if (redis_maintain_grow(inst) == 0)
+			redis_maintain_reap(inst);
+		redis_maintain_dead(inst);
+		redis_maintain_rebalance(inst);
+		redis_maintain_idle(inst);
+		redis_maintain_standby(inst);
+
+		pthread_mutex_lock(&inst->maintenance_mutex);
+	}
+	pthread_mutex_unlock(&inst->maintenance_mutex);
+
+	return NULL;
+}
+
+/*
+ * Circuit breaker of one endpoint.  A closed circuit lets every connect
+ * through.  circuit_failure_threshold consecutive failures open it for
+ * connect_failure_retry_delay seconds, during which it is skipped at no
+ * cost.  After that it is half-open: exactly one caller probes it, the
+ * others keep skipping it until the probe closes or reopens it.
+ *
+ * With connect_rate set, every connect must also take a token from the
+ * endpoint's bucket (see redis_endpoint_take_token).
+ *
+ * Returns 1 if the caller may try to connect to the endpoint.
+ */
+static int redis_endpoint_allow(REDIS_INSTANCE *inst, int idx) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+	long long now;
+	int allow = 0;
+
+	if (inst->config->connect_rate == 0
+			&& __atomic_load_n(&es->breaker, __ATOMIC_RELAXED) == breakerclosed)
+		return 1;
+
+	now = redis_monotonic_usec();
+	pthread_mutex_lock(&es->mutex);
+	switch (es->breaker) {
+	case breakerclosed:
+		allow = redis_endpoint_take_token(inst, idx, now);
+		break;
+	case breakeropen:
+		if (now >= es->open_until
+				&& redis_endpoint_take_token(inst, idx, now)) {
+			es->breaker = breakerhalfopen;
+			es->probing = 1;
+			allow = 1;
+			log_(L_INFO, "%s: circuit of endpoint @%d half-open, probing",
+					__func__, idx);
+		}
+		break;
+	case breakerhalfopen:
+		if (!es->probing && redis_endpoint_take_token(inst, idx, now)) {
+			es->probing = 1;
+			allow = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&es->mutex);
+
+	return allow;
+}
+
+/*
+ * Token bucket on connects to one endpoint: connect_rate tokens a second
+ * up to connect_burst.  For slow_start ms after the circuit closes both
+ * ramp up linearly from a tenth, so a node that just came back is not
+ * flooded by every socket that was waiting for it.  Called with the
+ * endpoint mutex held.
+ */
+static int redis_endpoint_take_token(REDIS_INSTANCE *inst, int idx,
+		long long now) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+	double rate, burst, ramp;
+	long long since;
+
+	if (inst->config->connect_rate == 0)
+		return 1;
+
+	rate = inst->config->connect_rate;
+	burst = inst->config->connect_burst;
+	since = now - es->closed_at;
+	if (es->closed_at && inst->config->slow_start > 0
+			&& since < (long long) inst->config->slow_start * 1000) {
+		ramp = (double) since / ((long long) inst->config->slow_start * 1000);
+		if (ramp < 0.1)
+			ramp = 0.1;
+		rate *= ramp;
+		burst *= ramp;
+		if (burst < 1)
+			burst = 1;
+	}
+
+	es->tokens += rate * (now - es->tokens_at) / 1e6;
+	es->tokens_at = now;
+	if (es->tokens > burst)
+		es->tokens = burst;
+
+	if (es->tokens < 1) {
+		__atomic_add_fetch(&inst->stats.connects_throttled, 1,
+				__ATOMIC_RELAXED);
+		return 0;
+	}
+	es->tokens -= 1;
+	return 1;
+}
+
+static void redis_endpoint_report(REDIS_INSTANCE *inst, int idx, int ok) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+	int delay = inst->config->connect_failure_retry_delay;
+
+	pthread_mutex_lock(&es->mutex);
+	if (ok) {
+		if (es->breaker != breakerclosed) {
+			log_(L_INFO | L_CONS, "%s: circuit of endpoint @%d closed",
+					__func__, idx);
+			es->closed_at = redis_monotonic_usec();
+			if (inst->config->slow_start > 0 && es->tokens > 1)
+				es->tokens = 1;
+		}
+		es->breaker = breakerclosed;
+		es->failures = 0;
+		es->probing = 0;
+	} else {
+		es->failures++;
+		if (es->breaker == breakerhalfopen
+				|| es->failures >= inst->config->circuit_failure_threshold) {
+			if (es->breaker != breakeropen) {
+				log_(L_WARN | L_CONS, "%s: circuit of endpoint @%d opened "
+						"after %d failures for %d s", __func__, idx,
+						es->failures, delay > 0 ? delay : 0);
+			}
+			es->breaker = breakeropen;
+			es->open_until = redis_monotonic_usec()
+					+ (delay > 0 ? (long long) delay * 1000000 : 0);
+		}
+		es->probing = 0;
+	}
+	pthread_mutex_unlock(&es->mutex);
+}
+
+/*
+ * Whether a connect attempt could get through to any endpoint at all.
+ * Read without locks; a stale answer only costs one skipped or one
+ * futile call to connect_single_socket.
+ */
+static int redis_endpoints_available(REDIS_INSTANCE *inst) {
+	int i;
+	long long now = redis_monotonic_usec();
+
+	for (i = 0; i < inst->config->num_endpoints; i++) {
+		if (redis_endpoint_might_allow(inst, i, now))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Lock-free preview of redis_endpoint_allow for one endpoint.
+ */
+static int redis_endpoint_might_allow(REDIS_INSTANCE *inst, int idx,
+		long long now) {
+	REDIS_ENDPOINT_STATE *es = &inst->endpoint_state[idx];
+
+	switch (__atomic_load_n(&es->breaker, __ATOMIC_RELAXED)) {
+	case breakerclosed:
+		return 1;
+	case breakeropen:
+		return now >= es->open_until;
+	case breakerhalfopen:
+		return !es->probing;
+	}
+	return 0;
 }
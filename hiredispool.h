@@ -3,6 +3,9 @@
 #define HIREDISPOOL_H
 
 #include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,10 +18,38 @@ extern "C" {
 #define HIREDISPOOL_PATCH 1
 #define HIREDISPOOL_SONAME 0.1
 
+/* Slots and free-map words are padded to this to avoid false sharing */
+#define HIREDISPOOL_CACHELINE 64
+
+/* Upper bound of REDIS_CONFIG.thread_cache_size */
+#define HIREDISPOOL_MAX_THREAD_CACHE 8
+
+/* Upper bound of REDIS_CONFIG.num_standby */
+#define HIREDISPOOL_MAX_STANDBY 4
+
+/* Defaults of the redis_pipeline_begin window */
+#define HIREDISPOOL_PIPELINE_INFLIGHT 1024
+#define HIREDISPOOL_PIPELINE_BYTES (1 << 20)
+
+/* Priority classes of redis_get_socket_prio, most urgent first */
+#define REDIS_PRIORITY_HIGH 0
+#define REDIS_PRIORITY_NORMAL 1
+#define REDIS_PRIORITY_LOW 2
+#define REDIS_PRIORITY_CLASSES 3
+
+/* Where a read may be served from, see redis_command_consistency */
+#define REDIS_CONSISTENCY_DEFAULT 0/* as REDIS_CONFIG.consistency says */
+#define REDIS_CONSISTENCY_EVENTUAL 1/* a replica, which may lag behind */
+#define REDIS_CONSISTENCY_STRONG 2/* the primary */
+
+/* Buckets of REDIS_POOL_STATS.wait_hist */
+#define HIREDISPOOL_WAIT_BUCKETS 24
+
 /* Types */
 typedef struct redis_endpoint {
     char host[256];
     int port;
+    int weight;//share of the keys in sharded mode, relative to the others, 0: 1
 } REDIS_ENDPOINT;
 
 typedef struct redis_config {
@@ -30,34 +61,371 @@ typedef struct redis_config {
     int max_num_redis_socks;//max socket num
     int connect_failure_retry_delay;
     char passwd[256];
+    int thread_cache_size;//sockets kept per thread on release, 0 disables
+    int maintenance_interval;//ms between maintenance passes, 0 disables the thread unless an option marked below needs it, then 1000
+    int heartbeat_interval;//ms a socket may idle before it is PINGed, 0 disables; needs the maintenance thread
+    int idle_ttl;//ms an idle socket above num_redis_socks is kept, 0 keeps forever; needs the maintenance thread
+    int high_watermark;//percent of sockets in use that triggers pre-connecting, 0 disables; needs the maintenance thread
+    int wait_watermark;//ms of average acquisition wait that triggers pre-connecting, 0 disables; needs the maintenance thread
+    int circuit_failure_threshold;//consecutive connect failures that open an endpoint, default 1
+    int max_conn_age;//ms after which an idle connection is recycled, 0 disables; needs the maintenance thread
+    int rebalance_rate;//sockets moved home or recycled per maintenance pass, default 1
+    int num_standby;//spare connections kept per endpoint for failover, 0 disables; needs the maintenance thread
+    int connect_backoff_max;//ms cap of the jittered per-socket reconnect backoff, 0 disables
+    int connect_rate;//connects per second allowed to each endpoint, 0 unlimited
+    int connect_burst;//connects an endpoint may take at once, default connect_rate
+    int slow_start;//ms over which connect_rate ramps up after an endpoint recovers, 0 disables
+    int lazy_connect;//1: redis_pool_create connects nothing, sockets are filled in the background; needs the maintenance thread
+    int db;//database every connection SELECTs on connect
+    char client_name[64];//CLIENT SETNAME on connect, empty for none
+    const char** init_commands;//sent on connect, arguments separated by spaces; copied
+    int num_init_commands;
+    int num_mux_connections;//shared connections redis_command is multiplexed onto, 0 disables
+    int max_blocking_socks;//connections of the lane blocking commands run on, 0: on the socket they are issued on
+    int reserved_high_socks;//sockets of max_num_redis_socks only REDIS_PRIORITY_HIGH may take, 0 disables
+    int num_mux_bulk_connections;//multiplexed connections of their own for commands with large replies, 0: shared
+    int latency_target;//usec of command latency above which the concurrency limit backs off, 0 disables
+    int cluster;//1: endpoints are seed nodes of a Redis Cluster, each node gets a pool of this config
+    int sharded;//1: keys are spread over the endpoints by consistent hashing, each gets a pool of this config
+    REDIS_ENDPOINT* replicas;//of the primary in endpoints, read-only commands go to them; copied
+    int num_replicas;
+    int consistency;//REDIS_CONSISTENCY_ of commands that do not ask for one, default eventual
+    REDIS_ENDPOINT* sentinels;//asked for the primary of master_name in place of endpoints, which is followed on failover; copied
+    int num_sentinels;
+    char master_name[64];
+    int hedge_delay;//usec without a reply before a read also goes to another endpoint, -1: the endpoint's p95, 0 disables
+    int hedge_budget;//percent of reads that may be hedged, default 5
 } REDIS_CONFIG;
 
 typedef struct redis_socket {
     int id;
-    int backup;
+    int home;/* endpoint the socket belongs to when everything is healthy */
+    int backup;/* endpoint it is connected to right now */
     pthread_mutex_t mutex;
     int inuse;
-    struct redis_socket* next;
     enum { sockunconnected, sockconnected } state;
     void* conn;
-} REDIS_SOCKET;
+    int cached;/* parked in a thread cache, whoever clears it owns it */
+    long long last_used;/* monotonic usec of the last release */
+    int active;/* the slot holds a member of the pool */
+    long long connected_at;/* monotonic usec */
+    int connect_failures;/* consecutive, drives the reconnect backoff */
+    long long next_connect_at;/* monotonic usec before which we don't retry */
+    int db;/* session state, as far as redis_command has seen it */
+    int readonly;
+    char client_name[64];
+    struct redis_mux* mux;/* set on the virtual sockets of the multiplexed mode */
+    struct redis_socket* pinned;/* real socket a virtual one is pinned to */
+    struct redis_socket* next_virtual;/* free list of virtual sockets */
+    int priority;/* class it was taken for */
+    int quota;/* counts against the sockets not reserved for high priority */
+    long long acquired_at;/* usec, while admission control is on */
+    int transaction;/* in MULTI or after WATCH, as far as redis_command has seen */
+    unsigned int epoch;/* of the instance when the connection was opened */
+} __attribute__((aligned(HIREDISPOOL_CACHELINE))) REDIS_SOCKET;
+
+/*
+ * One word of the free map: bit n set means slot (word * 64 + n) is idle
+ * and may be claimed with an atomic fetch-and.
+ */
+typedef struct redis_free_word {
+    uint64_t bits;
+} __attribute__((aligned(HIREDISPOOL_CACHELINE))) REDIS_FREE_WORD;
+
+typedef struct redis_pool_stats {
+    int pool_size;
+    int waiters;/* threads queued in redis_get_socket_timed right now */
+    unsigned long exhausted;/* acquisitions that found no socket at once */
+    unsigned long waits;/* acquisitions that had to queue */
+    unsigned long timeouts;/* queued acquisitions that gave up */
+    unsigned long long wait_usec_total;
+    unsigned long wait_usec_max;
+    unsigned long wait_hist[HIREDISPOOL_WAIT_BUCKETS];/* [i]: waited < 2^i usec */
+    unsigned long grown;/* sockets added after startup */
+    unsigned long reaped;/* idle sockets closed to shrink the pool */
+    unsigned long rebalanced;/* sockets moved back to their home endpoint */
+    unsigned long recycled;/* connections replaced for exceeding max_conn_age */
+    unsigned long standby_promoted;/* failovers served by a standby connection */
+    unsigned long connects_throttled;/* connects refused by the connect budget */
+    unsigned long db_hits;/* redis_get_socket_db found a socket in the db */
+    unsigned long db_switches;/* redis_get_socket_db had to SELECT */
+    unsigned long mux_commands;/* commands sent over multiplexed connections */
+    unsigned long mux_pinned;/* virtual sockets that needed a real one */
+    unsigned long blocking_commands;/* sent on the blocking lane */
+    unsigned long blocking_waits;/* had to queue for a lane connection */
+    unsigned long reserve_denied;/* found the sockets not reserved for high priority taken */
+    unsigned long served;/* sockets handed out under admission control */
+    unsigned long shed;/* callers turned away as they could not make their deadline */
+    int concurrency_limit;/* sockets callers below high priority may hold now */
+    unsigned long moved;/* MOVED redirects followed, cluster mode */
+    unsigned long asked;/* ASK redirects followed, cluster mode */
+    unsigned long slot_refreshes;/* CLUSTER SLOTS reloads, cluster mode */
+    unsigned long replica_reads;/* read-only commands sent to a replica */
+    unsigned long replica_fallbacks;/* of which went to the primary after all */
+    unsigned long failovers;/* primary switches announced by sentinel */
+    unsigned long hedged;/* reads also sent to a second endpoint */
+    unsigned long hedge_wins;/* of which the second endpoint answered first */
+} REDIS_POOL_STATS;
+
+/*
+ * Health and load of one endpoint, see redis_endpoint_allow and
+ * redis_endpoint_score.
+ */
+typedef struct redis_endpoint_state {
+    pthread_mutex_t mutex;
+    enum { breakerclosed, breakeropen, breakerhalfopen } breaker;
+    int failures;/* consecutive connect failures */
+    int probing;/* a half-open probe is in flight */
+    long long open_until;/* monotonic usec */
+    int inflight;/* commands running against it right now */
+    long latency_usec;/* moving average of command round trips */
+    long p95_usec;/* estimate of their 95th percentile */
+    unsigned long commands;
+    unsigned long errors;
+    void* standby[HIREDISPOOL_MAX_STANDBY];/* spare connections, under mutex */
+    int num_standby;
+    long long standby_checked;/* monotonic usec of the last standby PING */
+    double tokens;/* connect budget, under mutex */
+    long long tokens_at;/* monotonic usec of the last refill */
+    long long closed_at;/* monotonic usec the circuit last closed */
+} __attribute__((aligned(HIREDISPOOL_CACHELINE))) REDIS_ENDPOINT_STATE;
+
+typedef struct redis_endpoint_stats {
+    int breaker;/* 0 closed, 1 open, 2 half-open */
+    int sockets;/* connected sockets in its sub-pool */
+    int idle;/* of which idle, in the free map or a thread cache */
+    int inflight;
+    long latency_usec;
+    unsigned long commands;
+    unsigned long errors;
+    long p95_usec;
+} REDIS_ENDPOINT_STATS;
+
+struct redis_waiter;
+struct redis_mux_request;
+struct redis_lane_waiter;
+struct redis_cluster;
+struct redis_instance;
+
+/*
+ * A connection shared by every virtual socket of the multiplexed mode.
+ * Callers queue formatted commands, the writer thread writes whatever
+ * has queued up in one go and the reader thread hands the replies back
+ * in the same order.
+ */
+typedef struct redis_mux {
+    int id;
+    int home;
+    int endpoint;/* the one it is connected to right now */
+    struct redis_instance* inst;
+    void* conn;
+    pthread_mutex_t mutex;
+    pthread_cond_t writer_cond;
+    pthread_cond_t reader_cond;
+    struct redis_mux_request* send_head;/* queued, not written yet */
+    struct redis_mux_request* send_tail;
+    struct redis_mux_request* wait_head;/* written, replies due in this order */
+    struct redis_mux_request* wait_tail;
+    int writing;/* the writer holds a batch it has not finished writing */
+    int broken;/* the reader is to reconnect */
+    int down;/* the last reconnect failed, callers fail fast */
+    int stop;
+    int retries;/* failed reconnects in a row */
+    pthread_t writer;
+    pthread_t reader;
+} __attribute__((aligned(HIREDISPOOL_CACHELINE))) REDIS_MUX;
 
 typedef struct redis_instance {
-    time_t connect_after;
     int pool_size;
     pthread_mutex_t pool_size_mutex;
-    REDIS_SOCKET* redis_pool;
-    REDIS_SOCKET* last_used;
+    REDIS_SOCKET* redis_pool;/* slot array, max_num_redis_socks long */
+    int num_slots;
+    REDIS_FREE_WORD* free_map;/* one map of num_free_words per endpoint */
+    int num_free_words;
+    unsigned long generation;/* tells thread caches of reused addresses apart */
+    pthread_mutex_t wait_mutex;/* protects the wait queue and stats */
+    struct redis_waiter* wait_head;
+    struct redis_waiter* wait_tail;
+    int num_waiters;
+    REDIS_POOL_STATS stats;
+    REDIS_FREE_WORD* dead_map;/* sockets waiting for the maintenance thread */
+    int maintenance;/* the maintenance thread is running */
+    pthread_t maintenance_thread;
+    pthread_mutex_t maintenance_mutex;
+    pthread_cond_t maintenance_cond;
+    int maintenance_stop;
+    int maintenance_kicked;
+    int grow_requested;
+    REDIS_POOL_STATS last_stats;/* as of the previous maintenance pass */
+    REDIS_ENDPOINT_STATE* endpoint_state;/* one per config->endpoints */
+    char* handshake;/* AUTH, SELECT, ... as one pipelined RESP buffer */
+    size_t handshake_len;
+    int handshake_replies;
+    REDIS_MUX* mux;/* the shared ones first, then the bulk ones; NULL if not multiplexed */
+    int num_mux;
+    int num_mux_bulk;
+    unsigned int mux_next;
+    unsigned int mux_bulk_next;
+    pthread_mutex_t virtual_mutex;
+    REDIS_SOCKET* virtual_free;
+    pthread_mutex_t lane_mutex;/* the blocking lane */
+    REDIS_SOCKET* lane_free;
+    int num_lane;/* lane connections open or being opened */
+    unsigned int lane_next;
+    struct redis_lane_waiter* lane_waiters;
+    pthread_mutex_t quota_mutex;/* callers waiting for an unreserved socket */
+    pthread_cond_t quota_cond[REDIS_PRIORITY_CLASSES];
+    int quota_used;
+    int quota_waiters[REDIS_PRIORITY_CLASSES];
+    int num_quota_waiters;
+    int admission;/* reserved_high_socks or latency_target */
+    int limit_milli;/* adaptive concurrency limit, in thousandths */
+    long long limit_cut_at;
+    long hold_usec;/* how long a socket is held, EWMA */
+    struct redis_cluster* cluster;/* node pools; NULL unless config->cluster or config->sharded */
+    struct redis_instance* replicas;/* pool of config->replicas, NULL if none */
+    unsigned int epoch;/* bumped whenever sentinel moves the primary */
+    int sentinel;/* the sentinel subscriber is running */
+    pthread_t sentinel_thread;
+    pthread_mutex_t sentinel_mutex;/* sentinel_conn and sentinel_stop */
+    pthread_cond_t sentinel_cond;
+    void* sentinel_conn;
+    int sentinel_stop;
+    int hedge_credit;/* thousandths of a hedge, earned by every hedgeable read */
     REDIS_CONFIG* config;
 } REDIS_INSTANCE;
 
+/*
+ * Receives each pipeline reply, or NULL for a command lost to a broken
+ * connection, and owns it.  'index' counts the commands of the pipeline
+ * from 0.
+ */
+typedef void (*redis_pipeline_callback)(void* reply, long index, void* privdata);
+
+typedef struct redis_pipeline {
+    REDIS_INSTANCE* inst;
+    REDIS_SOCKET* sock;/* the real socket the commands go to */
+    REDIS_SOCKET* handle;/* what the caller passed in, released at the end */
+    int max_inflight;
+    size_t max_bytes;
+    redis_pipeline_callback callback;/* NULL: replies are kept in 'replies' */
+    void* privdata;
+    int inflight;/* commands written or queued, not answered yet */
+    size_t inflight_bytes;
+    long issued;
+    long failed;/* commands without a reply */
+    void** replies;
+    long num_replies;
+    long cap_replies;
+} REDIS_PIPELINE;
+
 /* Functions */
 int redis_pool_create(const REDIS_CONFIG* config, REDIS_INSTANCE** instance);
 int redis_pool_destroy(REDIS_INSTANCE* instance);
 
+/*
+ * With num_mux_connections set these return virtual sockets: commands
+ * on them share the multiplexed connections, and their conn is NULL.
+ * A virtual socket is pinned to a real one from the pool for the rest
+ * of its use by the first command that needs a connection of its own:
+ * SELECT, HELLO, RESET and other session commands, transactions,
+ * pub/sub including SSUBSCRIBE, replication streams and blocking
+ * commands.  Commands the pool has no entry for are taken to leave the
+ * connection as it was, as the data commands do.
+ */
 REDIS_SOCKET* redis_get_socket(REDIS_INSTANCE* instance);
+/* Wait up to deadline_ms for a socket, 0 never waits, < 0 waits forever */
+REDIS_SOCKET* redis_get_socket_timed(REDIS_INSTANCE* instance, int deadline_ms);
+/*
+ * Like redis_get_socket_timed for one of the REDIS_PRIORITY_ classes;
+ * the two above take REDIS_PRIORITY_NORMAL.  High priority callers are
+ * served first and may use the reserved_high_socks.
+ */
+REDIS_SOCKET* redis_get_socket_prio(REDIS_INSTANCE* instance, int deadline_ms, int priority);
+/* A socket in database db, preferring one that needs no SELECT */
+REDIS_SOCKET* redis_get_socket_db(REDIS_INSTANCE* instance, int db);
+/*
+ * A socket on the cluster node or shard serving 'key', for transactions
+ * and pipelines on keys of one slot or shard; commands on it are not
+ * redirected.  The same as redis_get_socket otherwise.
+ */
+REDIS_SOCKET* redis_get_socket_key(REDIS_INSTANCE* instance, const char* key, size_t keylen);
+int redis_pool_get_stats(REDIS_INSTANCE* instance, REDIS_POOL_STATS* stats);
+int redis_pool_get_endpoint_stats(REDIS_INSTANCE* instance, int idx, REDIS_ENDPOINT_STATS* stats);
 int redis_release_socket(void* reply,REDIS_INSTANCE* instance, REDIS_SOCKET* redisocket);
+/*
+ * With max_blocking_socks set, blocking commands such as BLPOP or XREAD
+ * BLOCK may be sent with a NULL socket, and are on virtual sockets that
+ * are not pinned: they run on the blocking lane and hold no pool socket.
+ * Not so WAIT and WAITAOF, which wait for the writes made on the
+ * connection they are sent on and so need the socket those went out on.
+ *
+ * In cluster and sharded mode commands are sent with a NULL socket: each
+ * goes to the node serving its key, in cluster mode following MOVED and
+ * ASK.  In sharded mode a command whose keys hash to more than one shard
+ * gets a CROSSSLOT error reply; keep them together with a hash tag.  The
+ * other redis_get_socket calls return NULL there.  In cluster mode SCAN
+ * walks the first node only; KEYS, DBSIZE, FLUSHDB and FLUSHALL, and in
+ * sharded mode SCAN, get an error reply.  To reach every key, send them
+ * to the pool of each node of redis_cluster_get_node.
+ */
 void* redis_command(REDIS_SOCKET* redisocket, REDIS_INSTANCE* instance, const char* format, ...);
+/*
+ * A command routed by 'key' rather than by the key found in it, for
+ * commands whose keys the pool cannot tell, and to keep related keys
+ * together.  Outside cluster and sharded mode it is sent on any socket.
+ */
+void* redis_command_key(REDIS_INSTANCE* instance, const char* key, size_t keylen, const char* format, ...);
+/*
+ * With replicas configured, read-only commands go to a replica unless
+ * they are issued inside a transaction or in another database than
+ * config->db, or the call asks for REDIS_CONSISTENCY_STRONG, as one
+ * that must see its own writes does.  redis_command takes
+ * REDIS_CONSISTENCY_DEFAULT.  Reads a replica fails go to the primary
+ * if the caller holds a socket, and may then be sent with a NULL one.
+ */
+void* redis_command_consistency(REDIS_SOCKET* redisocket, REDIS_INSTANCE* instance, int consistency,
+        const char* format, ...);
+
+/*
+ * Pipelining on a borrowed socket.  Commands are queued and written out
+ * in batches; once max_inflight commands or max_bytes of them are
+ * unanswered the replies are read before anything else is queued, so
+ * memory stays bounded however long the pipeline.  0 picks the defaults
+ * above.  redis_pipeline_end releases the socket and frees the kept
+ * replies.
+ */
+REDIS_PIPELINE* redis_pipeline_begin(REDIS_INSTANCE* instance, REDIS_SOCKET* redisocket,
+        int max_inflight, size_t max_bytes, redis_pipeline_callback callback, void* privdata);
+int redis_pipeline_command(REDIS_PIPELINE* pipeline, const char* format, ...);
+int redis_pipeline_vcommand(REDIS_PIPELINE* pipeline, const char* format, va_list ap);
+/* argvlen may be NULL for NUL-terminated arguments, as in redisCommandArgv */
+int redis_pipeline_commandargv(REDIS_PIPELINE* pipeline, int argc, const char** argv, const size_t* argvlen);
+/* Read every outstanding reply; returns the number of failed commands so far */
+long redis_pipeline_sync(REDIS_PIPELINE* pipeline);
+/* The replies kept so far when there is no callback, in command order */
+void** redis_pipeline_replies(REDIS_PIPELINE* pipeline, long* count);
+long redis_pipeline_end(REDIS_PIPELINE* pipeline);
+
+/*
+ * Read num_keys keys with 'command' over up to max_sockets sockets at
+ * once.  keys_per_command > 0 is for multi-key commands such as MGET:
+ * that many keys go into each command and every key gets its element
+ * of the array reply.  0 sends one command per key, such as HGETALL,
+ * and every key gets the whole reply.  replies[i] is the reply for
+ * keys[i], or NULL if it failed; free each with freeReplyObject.
+ * keylens may be NULL.  Returns the number of keys without a reply.
+ */
+long redis_fanout(REDIS_INSTANCE* instance, const char* command, int keys_per_command,
+        const char** keys, const size_t* keylens, long num_keys, int max_sockets, void** replies);
+
+/*
+ * Node 'idx' of a cluster instance as last seen in CLUSTER SLOTS or a
+ * redirect, or shard 'idx' of a sharded one, and the pool of its
+ * connections, for redis_pool_get_stats.  Returns -1 past the last node.
+ */
+int redis_cluster_get_node(REDIS_INSTANCE* instance, int idx, REDIS_ENDPOINT* endpoint,
+        REDIS_INSTANCE** pool);
 
 #ifdef __cplusplus
 }
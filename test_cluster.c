@@ -0,0 +1,604 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the slot hashing and redirect parsing under test are static */
+#include "hiredispool.c"
+
+/*
+ * Cluster mode: slot hashing, hash tags, redirect parsing and key
+ * finding against known values, then a cluster of three local nodes
+ * that a slot is moved and migrated on under the pool.  Sharded mode:
+ * three plain servers that multi-key commands must not be split over.
+ *
+ * The nodes are started from redis-server, or $REDIS_SERVER, on ports
+ * 30001-30003 and the shards on 30004-30006; without one that part is
+ * skipped.
+ *
+ * usage: test_cluster.exe
+ */
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+#define NODES 3
+#define BASE_PORT 30001
+#define SHARD_PORT 30004
+
+static char dir[] = "/tmp/test_cluster.XXXXXX";
+static pid_t pids[NODES], shard_pids[NODES];
+static redisContext* nodes[NODES];
+static char ids[NODES][64];
+
+static int slot_of(const char* key) {
+    return redis_cluster_slot(key, strlen(key));
+}
+
+/* Bit by bit CRC16 (XModem) of the spec, to check the table against */
+static int crc16_slot(const char* key) {
+    uint16_t crc = 0;
+    int i;
+
+    for (; *key; key++) {
+        crc ^= (uint16_t) (unsigned char) *key << 8;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+static int key_of(const char* cmd, char* key, size_t size) {
+    REDIS_ARG arg;
+    char* buf;
+    int len;
+
+    if ((len = redisFormatCommand(&buf, cmd)) < 0)
+        return -1;
+    if (redis_find_key(buf, len, &arg) < 0) {
+        redisFreeCommand(buf);
+        return -1;
+    }
+    snprintf(key, size, "%.*s", (int) arg.len, arg.str);
+    redisFreeCommand(buf);
+    return 0;
+}
+
+static void test_units(void) {
+    char host[256], key[64];
+    int i, ok, slot, port;
+
+    /* CRC16-CCITT (XModem) of "123456789" is 0x31C3 */
+    test("Slot of the CRC16 check string: ");
+    test_cond(slot_of("123456789") == 0x31C3);
+
+    test("Slots of foo, bar and hello: ");
+    test_cond(slot_of("foo") == 12182 && slot_of("bar") == 5061
+            && slot_of("hello") == 866);
+
+    test("Slots agree with a bitwise CRC16: ");
+    for (i = 0, ok = 1; i < 1000 && ok; i++) {
+        snprintf(key, sizeof(key), "key:%d:%x", i, i * 2654435761u);
+        ok = slot_of(key) == crc16_slot(key);
+    }
+    test_cond(ok);
+
+    test("Keys sharing a hash tag share a slot: ");
+    test_cond(slot_of("{user1000}.following") == slot_of("{user1000}.followers")
+            && slot_of("{user1000}.following") == slot_of("user1000"));
+
+    test("An empty hash tag hashes the whole key: ");
+    test_cond(slot_of("foo{}{bar}") == crc16_slot("foo{}{bar}")
+            && slot_of("foo{bar") == crc16_slot("foo{bar")
+            && slot_of("foo}bar{") == crc16_slot("foo}bar{"));
+
+    test("Only the first hash tag counts: ");
+    test_cond(slot_of("foo{{bar}}zap") == slot_of("{bar")
+            && slot_of("foo{bar}{zap}") == slot_of("bar"));
+
+    test("MOVED is parsed: ");
+    test_cond(redis_parse_redirect("MOVED 3999 127.0.0.1:6381", &slot, host,
+            sizeof(host), &port) == 0 && slot == 3999
+            && strcmp(host, "127.0.0.1") == 0 && port == 6381);
+
+    test("ASK with an IPv6 address is parsed: ");
+    test_cond(redis_parse_redirect("ASK 16383 ::1:7000", &slot, host,
+            sizeof(host), &port) == 1 && slot == 16383
+            && strcmp(host, "::1") == 0 && port == 7000);
+
+    test("Other errors and bad redirects are not: ");
+    test_cond(redis_parse_redirect("ERR unknown command", &slot, host,
+            sizeof(host), &port) < 0
+            && redis_parse_redirect("MOVED 16384 127.0.0.1:6381", &slot, host,
+                    sizeof(host), &port) < 0
+            && redis_parse_redirect("MOVED 1 127.0.0.1", &slot, host,
+                    sizeof(host), &port) < 0
+            && redis_parse_redirect("MOVED 1 :6381", &slot, host,
+                    sizeof(host), &port) < 0
+            && redis_parse_redirect("ASK 1 127.0.0.1:6381", &slot, host,
+                    4, &port) < 0);
+
+    test("Keys of commands with numkeys first: ");
+    test_cond(key_of("ZUNION 2 a b", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("ZINTER 2 a b WEIGHTS 1 2", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("ZDIFF 2 a b", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("SINTERCARD 2 a b", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("LMPOP 2 a b LEFT", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("ZMPOP 1 a MIN", key, sizeof(key)) == 0
+            && strcmp(key, "a") == 0
+            && key_of("ZUNION 0 a", key, sizeof(key)) < 0);
+
+    test("Keys of EVAL, BLMPOP, XREAD and GET: ");
+    test_cond(key_of("EVAL s 1 k a", key, sizeof(key)) == 0
+            && strcmp(key, "k") == 0
+            && key_of("BLMPOP 0 1 q LEFT", key, sizeof(key)) == 0
+            && strcmp(key, "q") == 0
+            && key_of("XREAD COUNT 1 STREAMS s 0", key, sizeof(key)) == 0
+            && strcmp(key, "s") == 0
+            && key_of("GET g", key, sizeof(key)) == 0
+            && strcmp(key, "g") == 0);
+
+    test("SCAN has no key and a cursor: ");
+    test_cond(key_of("SCAN 0", key, sizeof(key)) < 0
+            && (redis_command_flags("*2\r\n$4\r\nSCAN\r\n$1\r\n0\r\n", 20)
+                    & REDIS_CMD_CURSOR));
+}
+
+static pid_t start_node(const char* server, int port, int cluster) {
+    char p[16], conf[64];
+    pid_t pid;
+    int fd;
+
+    snprintf(p, sizeof(p), "%d", port);
+    snprintf(conf, sizeof(conf), "nodes-%d.conf", port);
+    if ((pid = fork()) == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execlp(server, server, "--port", p, "--bind", "127.0.0.1",
+                "--cluster-enabled", cluster ? "yes" : "no",
+                "--cluster-config-file", conf, "--dir", dir, "--save", "",
+                "--appendonly", "no", (char*) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static redisContext* connect_node(int port) {
+    struct timeval tv = { 1, 0 };
+    redisContext* c;
+    redisReply* r;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        c = redisConnectWithTimeout("127.0.0.1", port, tv);
+        if (c && !c->err && (r = redisCommand(c, "PING")) != NULL) {
+            freeReplyObject(r);
+            return c;
+        }
+        if (c)
+            redisFree(c);
+        usleep(100000);
+    }
+    return NULL;
+}
+
+/* Run a command on a node and return whether it replied OK */
+static int node_ok(int n, const char* format, ...) {
+    redisReply* r;
+    va_list ap;
+    int ok;
+
+    va_start(ap, format);
+    r = redisvCommand(nodes[n], format, ap);
+    va_end(ap);
+    ok = r && r->type == REDIS_REPLY_STATUS && strcmp(r->str, "OK") == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static int add_slots(int n, int from, int to) {
+    const char** argv;
+    char (*slots)[12];
+    redisReply* r;
+    int i, ok;
+
+    argv = malloc((to - from + 2) * sizeof(*argv));
+    slots = malloc((to - from) * sizeof(*slots));
+    argv[0] = "CLUSTER";
+    argv[1] = "ADDSLOTS";
+    for (i = from; i < to; i++) {
+        snprintf(slots[i - from], sizeof(slots[0]), "%d", i);
+        argv[i - from + 2] = slots[i - from];
+    }
+    r = redisCommandArgv(nodes[n], to - from + 2, argv, NULL);
+    ok = r && r->type == REDIS_REPLY_STATUS;
+    if (r)
+        freeReplyObject(r);
+    free(slots);
+    free(argv);
+    return ok;
+}
+
+static int cluster_ok(void) {
+    redisReply* r;
+    int i, n, ok;
+
+    for (i = 0; i < 100; i++) {
+        for (n = 0, ok = 1; n < NODES && ok; n++) {
+            r = redisCommand(nodes[n], "CLUSTER INFO");
+            ok = r && r->type == REDIS_REPLY_STRING
+                    && strstr(r->str, "cluster_state:ok")
+                    && strstr(r->str, "cluster_known_nodes:3");
+            if (r)
+                freeReplyObject(r);
+        }
+        if (ok)
+            return 1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+/* The node that serves 'slot' */
+static int owner(int slot) {
+    return slot * NODES / REDIS_CLUSTER_SLOTS;
+}
+
+static int start_cluster(const char* server) {
+    redisReply* r;
+    int n;
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+    for (n = 0; n < NODES; n++)
+        if ((pids[n] = start_node(server, BASE_PORT + n, 1)) < 0)
+            return 0;
+    for (n = 0; n < NODES; n++) {
+        if ((nodes[n] = connect_node(BASE_PORT + n)) == NULL)
+            return 0;
+        if ((r = redisCommand(nodes[n], "CLUSTER MYID")) == NULL
+                || r->type != REDIS_REPLY_STRING) {
+            if (r)
+                freeReplyObject(r);
+            return 0;
+        }
+        snprintf(ids[n], sizeof(ids[n]), "%s", r->str);
+        freeReplyObject(r);
+        if (!add_slots(n, n * REDIS_CLUSTER_SLOTS / NODES,
+                (n + 1) * REDIS_CLUSTER_SLOTS / NODES))
+            return 0;
+    }
+    for (n = 1; n < NODES; n++)
+        if (!node_ok(0, "CLUSTER MEET 127.0.0.1 %d", BASE_PORT + n))
+            return 0;
+    return cluster_ok();
+}
+
+static int start_shards(const char* server) {
+    redisContext* c;
+    int n;
+
+    for (n = 0; n < NODES; n++)
+        if ((shard_pids[n] = start_node(server, SHARD_PORT + n, 0)) < 0)
+            return 0;
+    for (n = 0; n < NODES; n++) {
+        if ((c = connect_node(SHARD_PORT + n)) == NULL)
+            return 0;
+        redisFree(c);
+    }
+    return 1;
+}
+
+static void stop_cluster(void) {
+    char path[128];
+    int n;
+
+    for (n = 0; n < NODES; n++) {
+        if (nodes[n])
+            redisFree(nodes[n]);
+        if (pids[n] > 0) {
+            kill(pids[n], SIGKILL);
+            waitpid(pids[n], NULL, 0);
+        }
+        if (shard_pids[n] > 0) {
+            kill(shard_pids[n], SIGKILL);
+            waitpid(shard_pids[n], NULL, 0);
+        }
+        snprintf(path, sizeof(path), "%s/nodes-%d.conf", dir, BASE_PORT + n);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/dump.rdb", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* A key of the form prefix-N in 'slot' */
+static void key_in(int slot, const char* prefix, char* key, size_t size) {
+    int i;
+
+    for (i = 0;; i++) {
+        snprintf(key, size, "%s-%d", prefix, i);
+        if (slot_of(key) == slot)
+            return;
+    }
+}
+
+static int reply_is(redisReply* r, const char* str) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_STRING && strcmp(r->str, str) == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static int is_array(redisReply* r) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_ARRAY;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static int status_ok(redisReply* r) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_STATUS && strcmp(r->str, "OK") == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static int is_error(redisReply* r, const char* prefix) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_ERROR
+            && strncmp(r->str, prefix, strlen(prefix)) == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static void test_cluster(REDIS_INSTANCE* inst) {
+    REDIS_POOL_STATS stats;
+    REDIS_ENDPOINT node;
+    REDIS_INSTANCE* pool;
+    char key[64];
+    int i, ok, slot, from, to;
+
+    test("Every node is known after CLUSTER SLOTS: ");
+    test_cond(redis_cluster_get_node(inst, NODES - 1, &node, &pool) == 0
+            && pool != NULL && redis_cluster_get_node(inst, NODES, NULL,
+                    NULL) < 0);
+
+    test("Keys go to the node of their slot: ");
+    for (i = 0, ok = 1; i < 300 && ok; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        ok = status_ok(redis_command(NULL, inst, "SET %s %d", key, i));
+        ok = ok && reply_is(redisCommand(nodes[owner(slot_of(key))],
+                "GET %s", key), strchr(key, '-') + 1);
+    }
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.moved == 0 && stats.asked == 0);
+
+    test("Multi-key commands go to the node of their first key: ");
+    test_cond(status_ok(redis_command(NULL, inst, "SET {z}a 1"))
+            && status_ok(redis_command(NULL, inst, "SET {z}b 2"))
+            && reply_is(redis_command(NULL, inst, "GET {z}b"), "2")
+            && status_ok(redis_command(NULL, inst, "MSET {u}a 1 {u}b 2"))
+            && is_array(redis_command(NULL, inst, "ZUNION 2 {u}x {u}y"))
+            && redis_pool_get_stats(inst, &stats) == 0 && stats.moved == 0);
+
+    /* a slot moved behind the back of the pool */
+    slot = slot_of("foo");
+    from = owner(slot);
+    to = (from + 1) % NODES;
+    for (i = 0, ok = 1; i < NODES; i++)
+        ok = ok && node_ok(i, "CLUSTER SETSLOT %d NODE %s", slot, ids[to]);
+    key_in(slot, "moved", key, sizeof(key));
+    test("A MOVED is followed and the slot remapped: ");
+    ok = ok && status_ok(redis_command(NULL, inst, "SET %s v", key))
+            && reply_is(redisCommand(nodes[to], "GET %s", key), "v");
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.moved == 1);
+
+    test("The next command goes straight to the new node: ");
+    ok = reply_is(redis_command(NULL, inst, "GET %s", key), "v");
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.moved == 1);
+
+    /* a slot half way through a migration */
+    slot = slot_of("bar");
+    from = owner(slot);
+    to = (from + 1) % NODES;
+    ok = node_ok(to, "CLUSTER SETSLOT %d IMPORTING %s", slot, ids[from])
+            && node_ok(from, "CLUSTER SETSLOT %d MIGRATING %s", slot, ids[to]);
+    key_in(slot, "asked", key, sizeof(key));
+    test("An ASK is followed with ASKING: ");
+    ok = ok && status_ok(redis_command(NULL, inst, "SET %s w", key))
+            && node_ok(to, "ASKING")
+            && reply_is(redisCommand(nodes[to], "GET %s", key), "w")
+            && reply_is(redis_command(NULL, inst, "GET %s", key), "w");
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.asked == 2 && stats.moved == 1);
+
+    for (i = 0; i < NODES; i++)
+        node_ok(i, "CLUSTER SETSLOT %d NODE %s", slot, ids[to]);
+    test("Once migrated the slot takes a MOVED: ");
+    ok = reply_is(redis_command(NULL, inst, "GET %s", key), "w");
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.moved == 2 && stats.asked == 2);
+
+    test("SCAN walks the first node: ");
+    redis_cluster_get_node(inst, 0, &node, NULL);
+    for (i = 0, ok = 1; i < 5 && ok; i++) {
+        redisReply* r = redis_command(NULL, inst, "SCAN 0 COUNT 1000");
+        redisReply* d = redisCommand(nodes[node.port - BASE_PORT],
+                "DBSIZE");
+        ok = r && r->type == REDIS_REPLY_ARRAY && r->elements == 2
+                && d && d->type == REDIS_REPLY_INTEGER
+                && r->element[1]->elements == (size_t) d->integer;
+        if (r)
+            freeReplyObject(r);
+        if (d)
+            freeReplyObject(d);
+    }
+    test_cond(ok);
+
+    test("Commands on the keys of one node are refused: ");
+    test_cond(is_error(redis_command(NULL, inst, "KEYS *"), "ERR ")
+            && is_error(redis_command(NULL, inst, "DBSIZE"), "ERR ")
+            && is_error(redis_command(NULL, inst, "FLUSHDB"), "ERR "));
+}
+
+static void test_sharded(REDIS_INSTANCE* inst) {
+    redisReply* r;
+    char a[16], b[16];
+    int i, ok;
+
+    /* two keys on different shards */
+    snprintf(a, sizeof(a), "k-0");
+    for (i = 1;; i++) {
+        snprintf(b, sizeof(b), "k-%d", i);
+        if (redis_cluster_node_of(inst, b, strlen(b))
+                != redis_cluster_node_of(inst, a, strlen(a)))
+            break;
+    }
+
+    test("Multi-key commands on one shard go through: ");
+    ok = status_ok(redis_command(NULL, inst, "MSET {t}a 1 {t}b 2"));
+    r = redis_command(NULL, inst, "MGET {t}a {t}b");
+    test_cond(ok && r && r->type == REDIS_REPLY_ARRAY && r->elements == 2
+            && r->element[1]->type == REDIS_REPLY_STRING
+            && strcmp(r->element[1]->str, "2") == 0);
+    if (r)
+        freeReplyObject(r);
+
+    test("Multi-key commands across shards get CROSSSLOT: ");
+    test_cond(is_error(redis_command(NULL, inst, "MGET %s %s", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "DEL %s %s", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "EXISTS %s %s", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "SUNION %s %s", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "SINTERSTORE %s %s %s",
+                    a, a, b), "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "RENAME %s %s", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "EVAL %s 2 %s %s",
+                    "return 1", a, b), "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "MSET %s 1 %s 2", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "ZUNIONSTORE %s 1 %s",
+                    b, a), "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "BITOP AND %s %s %s",
+                    a, a, b), "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "BLPOP %s %s 1", a, b),
+                    "CROSSSLOT ")
+            && is_error(redis_command(NULL, inst, "XREAD STREAMS %s %s 0 0",
+                    a, b), "CROSSSLOT "));
+
+    test("Values, arguments and timeouts are not taken for keys: ");
+    test_cond(status_ok(redis_command(NULL, inst, "MSET %s %s", a, b))
+            && reply_is(redis_command(NULL, inst, "EVAL %s 1 %s %s",
+                    "return ARGV[1]", a, b), b)
+            && reply_is(redis_command(NULL, inst, "GET %s", a), b));
+
+    test("A key given by the caller is taken at its word: ");
+    r = redis_command_key(inst, a, strlen(a), "MSET %s 1 %s 2", a, b);
+    test_cond(status_ok(r));
+
+    test("SCAN and the commands on the keys of one shard are refused: ");
+    test_cond(is_error(redis_command(NULL, inst, "SCAN 0"), "ERR ")
+            && is_error(redis_command(NULL, inst, "KEYS *"), "ERR ")
+            && is_error(redis_command(NULL, inst, "FLUSHALL"), "ERR ")
+            && is_array(redis_command(NULL, inst, "SSCAN {t}s 0")));
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    LOG_CONFIG log = { -1, LOG_DEST_FILES, "log/test_cluster.log",
+            "test_cluster", L_WARN, 1 };
+    log_set_config(&log);
+    signal(SIGPIPE, SIG_IGN);
+
+    test_units();
+
+    const char* server = getenv("REDIS_SERVER");
+    if (server == NULL)
+        server = "redis-server";
+    if (!start_cluster(server)) {
+        printf("No cluster of %s, skipping the cluster tests\n", server);
+    } else {
+        REDIS_ENDPOINT seed = { "127.0.0.1", BASE_PORT + 1, 0 };
+        REDIS_CONFIG conf;
+        REDIS_INSTANCE* inst = NULL;
+
+        memset(&conf, 0, sizeof(conf));
+        conf.endpoints = &seed;
+        conf.num_endpoints = 1;
+        conf.connect_timeout = 1000;
+        conf.net_readwrite_timeout = 1000;
+        conf.num_redis_socks = 1;
+        conf.max_num_redis_socks = 4;
+        conf.connect_failure_retry_delay = 1;
+        conf.cluster = 1;
+
+        test("Cluster pool is created from one seed: ");
+        test_cond(redis_pool_create(&conf, &inst) == 0);
+        if (inst) {
+            test_cluster(inst);
+            redis_pool_destroy(inst);
+        }
+    }
+
+    if (!start_shards(server)) {
+        printf("No shards of %s, skipping the sharded tests\n", server);
+    } else {
+        REDIS_ENDPOINT shards[NODES] = { { "127.0.0.1", SHARD_PORT, 0 },
+                { "127.0.0.1", SHARD_PORT + 1, 0 },
+                { "127.0.0.1", SHARD_PORT + 2, 0 } };
+        REDIS_CONFIG conf;
+        REDIS_INSTANCE* inst = NULL;
+
+        memset(&conf, 0, sizeof(conf));
+        conf.endpoints = shards;
+        conf.num_endpoints = NODES;
+        conf.connect_timeout = 1000;
+        conf.net_readwrite_timeout = 1000;
+        conf.num_redis_socks = 1;
+        conf.max_num_redis_socks = 4;
+        conf.connect_failure_retry_delay = 1;
+        conf.sharded = 1;
+
+        test("Sharded pool is created: ");
+        test_cond(redis_pool_create(&conf, &inst) == 0);
+        if (inst) {
+            test_sharded(inst);
+            redis_pool_destroy(inst);
+        }
+    }
+    stop_cluster();
+
+    printf("%d tests, %d passed, %d failed\n", tests, tests - fails, fails);
+    return fails ? 1 : 0;
+}
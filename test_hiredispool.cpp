@@ -725,12 +725,21 @@ int main(int argc, char** argv) {
 	log_set_config(&log);
 
 	REDIS_ENDPOINT endpoints[2] =
-//			{ { "127.0.0.1", 6379 }, { "127.0.0.1", 6379 }
-			{ { "132.122.232.179", 7352 }, { "132.122.232.180", 7353 }, };
-
-	REDIS_CONFIG conf = { (REDIS_ENDPOINT*) &endpoints, 2, 10000, 5000, 2, 10,
-			1, "test001#Abc12345!",
-			};
+//			{ { "127.0.0.1", 6379, 1 }, { "127.0.0.1", 6379, 1 }
+			{ { "132.122.232.179", 7352, 1 }, { "132.122.232.180", 7353, 1 }, };
+
+	REDIS_CONFIG conf;
+	memset(&conf, 0, sizeof(conf));
+	conf.endpoints = (REDIS_ENDPOINT*) &endpoints;
+	conf.num_endpoints = 2;
+	conf.connect_timeout = 10000;
+	conf.net_readwrite_timeout = 5000;
+	conf.num_redis_socks = 2;
+	conf.max_num_redis_socks = 10;
+	conf.connect_failure_retry_delay = 1;
+	strcpy(conf.passwd, "test001#Abc12345!");
+	conf.db = 4970;
+	strcpy(conf.client_name, "test_hiredispool");
 
 	REDIS_INSTANCE* inst;
 	if (redis_pool_create(&conf, &inst) < 0)
@@ -745,7 +754,6 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	redisReply * reply = NULL;
-	rop_selectdatabase((redisContext *) sock_str->conn, (void **) &reply, 4970);
 
 	//---------------string------------------
 	log_(L_INFO | L_CONS, "---------------string------------------");
@@ -796,9 +804,6 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	redisReply * reply_list = NULL;
-	rop_selectdatabase((redisContext *) sock_list->conn, (void **) &reply_list,
-			4970);
-
 	//入队列
 	rop_list_push((redisContext *) sock_list->conn, (void **) &reply_list,
 			"list_key", "list_1");
@@ -835,9 +840,6 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	redisReply * reply_set = NULL;
-	rop_selectdatabase((redisContext *) sock_set->conn, (void **) &reply_set,
-			4970);
-
 	rop_set_add((redisContext *) sock_set->conn, (void **) &reply_set,
 			"set_key", "baidu");
 	rop_set_add((redisContext *) sock_set->conn, (void **) &reply_set,
@@ -856,9 +858,6 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	redisReply * reply_Zset = NULL;
-	rop_selectdatabase((redisContext *) sock_Zset->conn, (void **) &reply_Zset,
-			4970);
-
 	rop_zset_add((redisContext *) sock_Zset->conn, (void **) &reply_Zset,
 			"zset_key", "baidu", 10);
 	rop_zset_add((redisContext *) sock_Zset->conn, (void **) &reply_Zset,
@@ -893,9 +892,6 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	redisReply * reply_hash = NULL;
-	rop_selectdatabase((redisContext *) sock_hash->conn, (void **) &reply_hash,
-			4970);
-
 	rop_hash_add((redisContext *) sock_hash->conn, (void **) &reply_hash,"hash_key", "one", "1");
 	rop_hash_add((redisContext *) sock_hash->conn, (void **) &reply_hash,"hash_key", "two", "2");
 	rop_hash_add((redisContext *) sock_hash->conn, (void **) &reply_hash,"hash_key", "three", "3");
@@ -910,30 +906,32 @@ int main(int argc, char** argv) {
 			return -1;
 		}
 
-	redisReply * reply_Append = NULL;
-	rop_selectdatabase((redisContext *) sock_Append->conn,
-			(void **) &reply_Append, 4970);
-
-
-	redisAppendCommand((redisContext *) sock_Append->conn, "set foo foo");
-	redisAppendCommand((redisContext *) sock_Append->conn, "set t tt");
-	redisAppendCommand((redisContext *) sock_Append->conn, "set a aa");
-	redisAppendCommand((redisContext *) sock_Append->conn, "get foo");
-	redisAppendCommand((redisContext *) sock_Append->conn, "get a");
-	redisAppendCommand((redisContext *) sock_Append->conn, "get t");
-
-	for (int i = 0; i < 6; ++i) {
-		int r = redisGetReply((redisContext *) sock_Append->conn,
-				(void **) &reply_Append);
-		if (r == REDIS_ERR) {
+	REDIS_PIPELINE* pipe = redis_pipeline_begin(inst, sock_Append, 0, 0,
+			NULL, NULL);
+
+	redis_pipeline_command(pipe, "set foo foo");
+	redis_pipeline_command(pipe, "set t tt");
+	redis_pipeline_command(pipe, "set a aa");
+	redis_pipeline_command(pipe, "get foo");
+	redis_pipeline_command(pipe, "get a");
+	redis_pipeline_command(pipe, "get t");
+	redis_pipeline_sync(pipe);
+
+	long num_Append;
+	void** replies_Append = redis_pipeline_replies(pipe, &num_Append);
+	for (long i = 0; i < num_Append; ++i) {
+		redisReply* reply_Append = (redisReply *) replies_Append[i];
+		if (reply_Append == NULL) {
 			printf("ERROR\n");
-			//			freeReplyObject(reply);
 		} else {
 			printf("res: %s, num: %zu, type: %d\n", reply_Append->str, reply_Append->elements,
 					reply_Append->type);
 		}
 	}
 
+	//释放pipeline时归还连接
+	redis_pipeline_end(pipe);
+
 
 
 	//归还连接需要传入最后一次reply
@@ -942,7 +940,6 @@ int main(int argc, char** argv) {
 	redis_release_socket(reply_set, inst, sock_set);
 	redis_release_socket(reply_Zset, inst, sock_Zset);
 	redis_release_socket(reply_hash, inst, sock_hash);
-	redis_release_socket(reply_Append, inst, sock_Append);
 	redis_pool_destroy(inst);
 
 	//归还连接后在进行freeReplyObject
@@ -951,7 +948,6 @@ int main(int argc, char** argv) {
 	freeReplyObject(reply_set);
 	freeReplyObject(reply_Zset);
 	freeReplyObject(reply_hash);
-	freeReplyObject(reply_Append);
 
 	return 0;
 }
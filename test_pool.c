@@ -0,0 +1,845 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* some of what is under test is static */
+#include "hiredispool.c"
+
+/*
+ * Pool behaviour under load and failure: the order waiters are served
+ * in and their deadline, the maintenance thread the options need, the
+ * session state a failed command leaves, the idle sockets an endpoint
+ * reports, the circuit breaker of an endpoint that goes down and comes
+ * back and the pacing of reconnects to it, multiplexed replies across a
+ * reconnect, sockets reserved for high priority, callers shed when they
+ * cannot make their deadline and hedged reads, against a local server
+ * started from redis-server, or $REDIS_SERVER, on port 30021, and a
+ * second one on 30022.  Without one those parts are skipped.
+ *
+ * usage: test_pool.exe
+ */
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+#define SERVERS 2
+#define BASE_PORT 30021
+
+static char dir[] = "/tmp/test_pool.XXXXXX";
+static const char* server;
+static pid_t pids[SERVERS];
+
+static pid_t start_server(int port) {
+    char p[16];
+    pid_t pid;
+    int fd;
+
+    snprintf(p, sizeof(p), "%d", port);
+    if ((pid = fork()) == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execlp(server, server, "--port", p, "--bind", "127.0.0.1", "--dir",
+                dir, "--save", "", "--appendonly", "no", (char*) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static redisContext* connect_server(int port) {
+    struct timeval tv = { 1, 0 };
+    redisContext* c;
+    redisReply* r;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        c = redisConnectWithTimeout("127.0.0.1", port, tv);
+        if (c && !c->err && (r = redisCommand(c, "PING")) != NULL) {
+            freeReplyObject(r);
+            return c;
+        }
+        if (c)
+            redisFree(c);
+        usleep(100000);
+    }
+    return NULL;
+}
+
+/* Start server 'n' and wait until it answers */
+static int server_up(int n) {
+    redisContext* c;
+
+    if ((pids[n] = start_server(BASE_PORT + n)) < 0)
+        return 0;
+    if ((c = connect_server(BASE_PORT + n)) == NULL)
+        return 0;
+    redisFree(c);
+    return 1;
+}
+
+static void stop_servers(void) {
+    int n;
+
+    for (n = 0; n < SERVERS; n++) {
+        if (pids[n] > 0) {
+            kill(pids[n], SIGKILL);
+            waitpid(pids[n], NULL, 0);
+            pids[n] = 0;
+        }
+    }
+    rmdir(dir);
+}
+
+static void init_config(REDIS_CONFIG* conf, REDIS_ENDPOINT* endpoints,
+        int num_endpoints) {
+    memset(conf, 0, sizeof(*conf));
+    conf->endpoints = endpoints;
+    conf->num_endpoints = num_endpoints;
+    conf->connect_timeout = 1000;
+    conf->net_readwrite_timeout = 1000;
+    conf->num_redis_socks = 1;
+    conf->max_num_redis_socks = 1;
+    conf->connect_failure_retry_delay = 1;
+}
+
+/* Sockets of the pool connected within 'ms' */
+static int connected_within(REDIS_INSTANCE* inst, int ms) {
+    int i, n;
+
+    for (; ; ms -= 10) {
+        for (i = 0, n = 0; i < inst->num_slots; i++)
+            n += inst->redis_pool[i].active
+                    && inst->redis_pool[i].state == sockconnected;
+        if (n == inst->config->num_redis_socks || ms <= 0)
+            return n;
+        usleep(10000);
+    }
+}
+
+/* Release a socket as after a command that went through */
+static void put(REDIS_INSTANCE* inst, REDIS_SOCKET* sock) {
+    redisReply* r;
+
+    r = redis_command(sock, inst, "PING");
+    redis_release_socket(r, inst, sock);
+    if (r)
+        freeReplyObject(r);
+}
+
+static long long now_ms(void) {
+    return redis_monotonic_usec() / 1000;
+}
+
+/* A thread queued in redis_get_socket_timed, and when it got a socket */
+typedef struct waiter {
+    REDIS_INSTANCE* inst;
+    int deadline_ms;
+    int* served;/* shared count of the waiters served */
+    int order;/* 1 for the first one served */
+    pthread_t thread;
+} WAITER;
+
+static void* wait_socket(void* arg) {
+    WAITER* w = arg;
+    REDIS_SOCKET* sock;
+
+    if ((sock = redis_get_socket_timed(w->inst, w->deadline_ms)) == NULL)
+        return NULL;
+    w->order = __atomic_add_fetch(w->served, 1, __ATOMIC_SEQ_CST);
+    usleep(20000);
+    put(w->inst, sock);
+    return NULL;
+}
+
+/* Wait up to a second for 'n' callers queued for a socket */
+static int queued(REDIS_INSTANCE* inst, int n) {
+    REDIS_POOL_STATS stats;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        redis_pool_get_stats(inst, &stats);
+        if (stats.waiters == n)
+            return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+static void test_wait_queue(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+    WAITER w[3];
+    long long start;
+    int i, ok, served = 0;
+
+    init_config(&conf, &endpoint, 1);
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("An exhausted pool times out a caller at its deadline: ");
+    sock = redis_get_socket(inst);
+    start = now_ms();
+    ok = sock && redis_get_socket_timed(inst, 100) == NULL;
+    start = now_ms() - start;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && start >= 90 && start < 500 && stats.timeouts == 1
+            && stats.waiters == 0);
+
+    test("Queued callers are served in the order they came: ");
+    for (i = 0, ok = sock != NULL; i < 3 && ok; i++) {
+        w[i].inst = inst;
+        w[i].deadline_ms = 5000;
+        w[i].served = &served;
+        w[i].order = 0;
+        ok = pthread_create(&w[i].thread, NULL, wait_socket, &w[i]) == 0
+                && queued(inst, i + 1);
+    }
+    if (sock)
+        put(inst, sock);
+    while (i-- > 0)
+        pthread_join(w[i].thread, NULL);
+    test_cond(ok && w[0].order == 1 && w[1].order == 2 && w[2].order == 3);
+
+    test("A released socket goes to the waiter, not to a newcomer: ");
+    sock = redis_get_socket(inst);
+    w[0].order = 0;
+    ok = sock && pthread_create(&w[0].thread, NULL, wait_socket, &w[0]) == 0;
+    if (ok) {
+        ok = queued(inst, 1);
+        put(inst, sock);
+        ok = ok && redis_get_socket(inst) == NULL;
+        pthread_join(w[0].thread, NULL);
+    }
+    test_cond(ok && w[0].order == 4);
+
+    redis_pool_destroy(inst);
+}
+
+static void test_maintenance(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+
+    init_config(&conf, &endpoint, 1);
+    conf.num_redis_socks = 2;
+    conf.max_num_redis_socks = 2;
+    conf.lazy_connect = 1;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("lazy_connect starts the maintenance thread without an interval: ");
+    test_cond(inst->maintenance
+            && inst->config->maintenance_interval == REDIS_MAINTENANCE_DEFAULT_MS
+            && connected_within(inst, 3000) == 2);
+    redis_pool_destroy(inst);
+
+    conf.maintenance_interval = 10000;
+    inst = NULL;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("Its first pass does not wait for the interval: ");
+    test_cond(connected_within(inst, 500) == 2);
+
+    redis_pool_destroy(inst);
+}
+
+/* Send 'format' on 'sock' and tell whether the reply was an error */
+static int failed(REDIS_INSTANCE* inst, REDIS_SOCKET* sock,
+        const char* format) {
+    redisReply* r;
+    int rcode;
+
+    r = redis_command(sock, inst, format);
+    rcode = r && r->type == REDIS_REPLY_ERROR;
+    if (r)
+        freeReplyObject(r);
+    return rcode;
+}
+
+static void test_session(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+    int ok;
+
+    init_config(&conf, &endpoint, 1);
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+    if ((sock = redis_get_socket(inst)) == NULL) {
+        redis_pool_destroy(inst);
+        return;
+    }
+
+    test("An EXEC that fails with EXECABORT ends the transaction: ");
+    ok = !failed(inst, sock, "MULTI") && sock->transaction
+            && failed(inst, sock, "SET x");
+    ok = ok && failed(inst, sock, "EXEC");
+    test_cond(ok && !sock->transaction);
+
+    test("So does a DISCARD that fails: ");
+    sock->transaction = 1;
+    test_cond(failed(inst, sock, "DISCARD") && !sock->transaction);
+
+    test("Other commands that fail change nothing: ");
+    test_cond(failed(inst, sock, "SELECT x") && sock->db == 0);
+
+    put(inst, sock);
+    redis_pool_destroy(inst);
+}
+
+static void test_endpoint_stats(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_ENDPOINT_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+
+    init_config(&conf, &endpoint, 1);
+    conf.num_redis_socks = 2;
+    conf.max_num_redis_socks = 2;
+    conf.thread_cache_size = 1;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("A socket held in a thread cache counts as idle: ");
+    if ((sock = redis_get_socket(inst)) != NULL)
+        put(inst, sock);
+    redis_pool_get_endpoint_stats(inst, 0, &stats);
+    test_cond(sock && sock->cached && stats.sockets == 2 && stats.idle == 2);
+
+    redis_pool_destroy(inst);
+}
+
+static int breaker_of(REDIS_INSTANCE* inst, int idx) {
+    REDIS_ENDPOINT_STATS stats;
+
+    if (redis_pool_get_endpoint_stats(inst, idx, &stats) < 0)
+        return -1;
+    return stats.breaker;
+}
+
+/* Endpoint 0 is server 1, which is not started yet; endpoint 1 is up */
+static void test_breaker(void) {
+    REDIS_ENDPOINT endpoints[2] = { { "127.0.0.1", BASE_PORT + 1, 0 },
+            { "127.0.0.1", BASE_PORT, 0 } };
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+    redisContext* c;
+    long long start;
+    int ok;
+
+    init_config(&conf, endpoints, 2);
+    conf.num_redis_socks = 2;
+    conf.max_num_redis_socks = 2;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("A failed connect opens the circuit of its endpoint: ");
+    test_cond(breaker_of(inst, 0) == breakeropen
+            && breaker_of(inst, 1) == breakerclosed);
+
+    test("Sockets go to the other endpoint without trying it: ");
+    start = now_ms();
+    sock = redis_get_socket(inst);
+    ok = sock && sock->backup == 1 && !redis_endpoint_allow(inst, 0);
+    if (sock)
+        put(inst, sock);
+    test_cond(ok && now_ms() - start < 100);
+
+    test("Once the delay is over a single probe is let through: ");
+    usleep(1100000);
+    ok = redis_endpoint_allow(inst, 0);
+    test_cond(ok && !redis_endpoint_allow(inst, 0)
+            && breaker_of(inst, 0) == breakerhalfopen);
+
+    test("A probe that fails opens the circuit again: ");
+    redis_endpoint_report(inst, 0, 0);
+    test_cond(breaker_of(inst, 0) == breakeropen
+            && !redis_endpoint_allow(inst, 0));
+
+    test("A probe that connects closes it: ");
+    c = NULL;
+    if (server_up(1)) {
+        usleep(1100000);
+        if (redis_endpoint_allow(inst, 0))
+            c = redis_connect_endpoint(inst, 0, 0);
+    }
+    test_cond(c && breaker_of(inst, 0) == breakerclosed
+            && redis_endpoint_allow(inst, 0) && redis_endpoint_allow(inst, 0));
+    if (c)
+        redisFree(c);
+
+    redis_pool_destroy(inst);
+}
+
+/* Connects endpoint 0 would allow right now */
+static int tokens(REDIS_INSTANCE* inst) {
+    REDIS_ENDPOINT_STATE* es = &inst->endpoint_state[0];
+    int n;
+
+    pthread_mutex_lock(&es->mutex);
+    for (n = 0; n < 100 && redis_endpoint_take_token(inst, 0,
+            redis_monotonic_usec()); n++)
+        ;
+    pthread_mutex_unlock(&es->mutex);
+    return n;
+}
+
+/* Whether the backoff of a socket with 'failures' before is in [lo, hi] ms */
+static int backoff_in(REDIS_INSTANCE* inst, int failures, int lo, int hi) {
+    REDIS_SOCKET sock;
+    long long now, delay;
+
+    memset(&sock, 0, sizeof(sock));
+    sock.connect_failures = failures;
+    now = redis_monotonic_usec();
+    redis_backoff_socket(inst, &sock);
+    delay = sock.next_connect_at - now;
+    return sock.connect_failures == failures + 1 && delay >= lo * 1000LL
+            && delay <= hi * 1000LL + 1000;
+}
+
+static void test_connect_budget(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_ENDPOINT_STATE* es;
+    REDIS_SOCKET a, b;
+    int i, ok;
+
+    init_config(&conf, &endpoint, 1);
+    conf.connect_rate = 2;
+    conf.connect_burst = 2;
+    conf.connect_backoff_max = 400;
+    conf.slow_start = 1000;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("Connects beyond the burst are throttled: ");
+    ok = tokens(inst) <= 2 && tokens(inst) == 0;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.connects_throttled >= 2);
+
+    test("The budget refills at connect_rate: ");
+    usleep(600000);
+    test_cond(tokens(inst) == 1);
+
+    test("Reconnects back off exponentially up to their cap: ");
+    test_cond(backoff_in(inst, 0, 25, 50) && backoff_in(inst, 1, 50, 100)
+            && backoff_in(inst, 2, 100, 200) && backoff_in(inst, 3, 200, 400)
+            && backoff_in(inst, 10, 200, 400));
+
+    test("Sockets that failed together retry apart: ");
+    for (i = 0, ok = 0; i < 10 && !ok; i++) {
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        a.connect_failures = b.connect_failures = 3;
+        redis_backoff_socket(inst, &a);
+        redis_backoff_socket(inst, &b);
+        ok = a.next_connect_at - b.next_connect_at > 1000
+                || b.next_connect_at - a.next_connect_at > 1000;
+    }
+    test_cond(ok);
+
+    test("An endpoint that comes back starts on a single connect: ");
+    es = &inst->endpoint_state[0];
+    pthread_mutex_lock(&es->mutex);
+    es->tokens = conf.connect_burst;
+    es->tokens_at = redis_monotonic_usec();
+    pthread_mutex_unlock(&es->mutex);
+    redis_endpoint_report(inst, 0, 0);
+    redis_endpoint_report(inst, 0, 1);
+    test_cond(breaker_of(inst, 0) == breakerclosed && tokens(inst) == 1);
+
+    redis_pool_destroy(inst);
+}
+
+#define ECHOES 2000
+
+/* A thread sending numbered ECHOs through the multiplexed connection */
+typedef struct echoer {
+    REDIS_INSTANCE* inst;
+    int id;
+    int replies;
+    int lost;/* no reply, the connection went away under it */
+    int wrong;/* somebody else's reply */
+    pthread_t thread;
+} ECHOER;
+
+static void* echo_loop(void* arg) {
+    ECHOER* e = arg;
+    REDIS_SOCKET* sock;
+    redisReply* r;
+    char s[32];
+    int i;
+
+    for (i = 0; i < ECHOES; i++) {
+        if ((sock = redis_get_socket(e->inst)) == NULL) {
+            e->lost++;
+            continue;
+        }
+        snprintf(s, sizeof(s), "%d-%d", e->id, i);
+        r = redis_command(sock, e->inst, "ECHO %s", s);
+        if (r == NULL)
+            e->lost++;
+        else if (r->type == REDIS_REPLY_STRING && strcmp(r->str, s) == 0)
+            e->replies++;
+        else
+            e->wrong++;
+        redis_release_socket(r, e->inst, sock);
+        if (r)
+            freeReplyObject(r);
+    }
+    return NULL;
+}
+
+/* Whether 'format' on a fresh virtual socket pins it */
+static int pins(REDIS_INSTANCE* inst, const char* format) {
+    REDIS_POOL_STATS before, after;
+    REDIS_SOCKET* sock;
+    redisReply* r;
+
+    redis_pool_get_stats(inst, &before);
+    if ((sock = redis_get_socket(inst)) == NULL)
+        return 0;
+    r = redis_command(sock, inst, format);
+    redis_release_socket(r, inst, sock);
+    if (r)
+        freeReplyObject(r);
+    redis_pool_get_stats(inst, &after);
+    return r && after.mux_pinned == before.mux_pinned + 1;
+}
+
+static void test_mux(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    redisContext* c;
+    redisReply* r;
+    ECHOER e[8];
+    int i, n, ok, replies = 0, lost = 0, wrong = 0;
+
+    init_config(&conf, &endpoint, 1);
+    conf.num_redis_socks = 2;
+    conf.max_num_redis_socks = 4;
+    conf.num_mux_connections = 1;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    /* commands the kills catch in flight fail, none gets another's reply */
+    test("Multiplexed replies reach their callers across reconnects: ");
+    c = connect_server(BASE_PORT);
+    for (n = 0; n < 8; n++) {
+        e[n].inst = inst;
+        e[n].id = n;
+        e[n].replies = e[n].lost = e[n].wrong = 0;
+        if (pthread_create(&e[n].thread, NULL, echo_loop, &e[n]) != 0)
+            break;
+    }
+    for (i = 0; i < 3 && c; i++) {
+        usleep(30000);
+        if ((r = redisCommand(c, "CLIENT KILL TYPE normal")) != NULL)
+            freeReplyObject(r);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(e[i].thread, NULL);
+        replies += e[i].replies;
+        lost += e[i].lost;
+        wrong += e[i].wrong;
+    }
+    if (c)
+        redisFree(c);
+    redis_pool_get_stats(inst, &stats);
+    test_cond(n == 8 && wrong == 0 && replies > 0 && replies + lost == 8 * ECHOES
+            && stats.mux_commands > 0);
+
+    test("The multiplexed connection is back afterwards: ");
+    for (i = 0, ok = 0; i < 50 && !ok; i++) {
+        e[0].replies = e[0].lost = e[0].wrong = 0;
+        echo_loop(&e[0]);
+        if (!(ok = e[0].replies == ECHOES))
+            usleep(100000);
+    }
+    test_cond(ok && e[0].wrong == 0);
+
+    test("HELLO, RESET and SSUBSCRIBE pin their caller: ");
+    test_cond(pins(inst, "HELLO 2") && pins(inst, "RESET")
+            && pins(inst, "SSUBSCRIBE channel") && !pins(inst, "ECHO x"));
+
+    redis_pool_destroy(inst);
+}
+
+static void test_reserved(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET *normal[2], *high, *other;
+    int ok;
+
+    init_config(&conf, &endpoint, 1);
+    conf.num_redis_socks = 3;
+    conf.max_num_redis_socks = 3;
+    conf.reserved_high_socks = 1;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("Normal priority gets the sockets that are not reserved: ");
+    normal[0] = redis_get_socket_prio(inst, 0, REDIS_PRIORITY_NORMAL);
+    normal[1] = redis_get_socket_prio(inst, 0, REDIS_PRIORITY_LOW);
+    test_cond(normal[0] && normal[1]);
+
+    test("The reserved socket is refused to normal and low priority: ");
+    ok = redis_get_socket_prio(inst, 0, REDIS_PRIORITY_NORMAL) == NULL
+            && redis_get_socket_prio(inst, 50, REDIS_PRIORITY_LOW) == NULL;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.reserve_denied == 2);
+
+    test("High priority gets it: ");
+    high = redis_get_socket_prio(inst, 0, REDIS_PRIORITY_HIGH);
+    test_cond(high && high != normal[0] && high != normal[1]);
+
+    test("A socket released below high priority can be taken again: ");
+    if (normal[1])
+        put(inst, normal[1]);
+    other = redis_get_socket_prio(inst, 0, REDIS_PRIORITY_NORMAL);
+    test_cond(other != NULL);
+
+    if (other)
+        put(inst, other);
+    if (high)
+        put(inst, high);
+    if (normal[0])
+        put(inst, normal[0]);
+    redis_pool_destroy(inst);
+}
+
+/* Hold a socket for 'ms' in another thread, then release it */
+typedef struct holder {
+    REDIS_INSTANCE* inst;
+    REDIS_SOCKET* sock;
+    int ms;
+    pthread_t thread;
+} HOLDER;
+
+static void* hold_socket(void* arg) {
+    HOLDER* h = arg;
+
+    usleep(h->ms * 1000);
+    put(h->inst, h->sock);
+    return NULL;
+}
+
+static void test_shedding(void) {
+    REDIS_ENDPOINT endpoint = { "127.0.0.1", BASE_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+    HOLDER h;
+    long long began;
+    int i, ok;
+
+    init_config(&conf, &endpoint, 1);
+    conf.max_num_redis_socks = 4;
+    conf.latency_target = 1000000;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("Slow replies cut the concurrency limit once per round: ");
+    redis_pool_get_stats(inst, &stats);
+    ok = stats.concurrency_limit == 4;
+    redis_adapt_limit(inst, 2000000, 1);
+    redis_adapt_limit(inst, 2000000, 1);
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && stats.concurrency_limit == 3);
+
+    test("Replies within the target bring it back: ");
+    for (i = 0; i < 10; i++)
+        redis_adapt_limit(inst, 1000, 1);
+    redis_pool_get_stats(inst, &stats);
+    test_cond(stats.concurrency_limit == 4);
+    redis_pool_destroy(inst);
+
+    conf.max_num_redis_socks = 1;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    /* each caller holds its socket for 20 ms or so */
+    for (i = 0; i < 8; i++) {
+        if ((sock = redis_get_socket_timed(inst, 1000)) == NULL)
+            break;
+        usleep(20000);
+        put(inst, sock);
+    }
+
+    test("A caller that could not make its deadline fails at once: ");
+    ok = (sock = redis_get_socket_timed(inst, 1000)) != NULL;
+    began = now_ms();
+    ok = ok && redis_get_socket_timed(inst, 5) == NULL;
+    began = now_ms() - began;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && began < 3 && stats.shed == 1);
+
+    test("One that can waits its turn: ");
+    h.inst = inst;
+    h.sock = sock;
+    h.ms = 30;
+    ok = sock && pthread_create(&h.thread, NULL, hold_socket, &h) == 0;
+    if (ok) {
+        sock = redis_get_socket_timed(inst, 1000);
+        pthread_join(h.thread, NULL);
+    }
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && sock && stats.shed == 1 && stats.served == 10);
+    if (sock)
+        put(inst, sock);
+
+    redis_pool_destroy(inst);
+}
+
+/*
+ * GET x, which each server holds its own port in, on a pool socket;
+ * with 'pause' the server of the socket stalls for 300 ms first.  The
+ * reply is checked against the endpoint the socket ended up on, and the
+ * port it came from returned, or -1.
+ */
+static int get_x(REDIS_INSTANCE* inst, int pause, long long* ms) {
+    REDIS_SOCKET* sock;
+    redisContext* c = NULL;
+    redisReply* r;
+    long long began;
+    int port = -1;
+
+    if ((sock = redis_get_socket(inst)) == NULL)
+        return -1;
+    if (pause) {
+        c = connect_server(inst->config->endpoints[sock->backup].port);
+        if (c && (r = redisCommand(c, "CLIENT PAUSE 300")) != NULL)
+            freeReplyObject(r);
+    }
+    began = now_ms();
+    r = redis_command(sock, inst, "GET x");
+    if (ms)
+        *ms = now_ms() - began;
+    if (r && r->type == REDIS_REPLY_STRING
+            && atoi(r->str) == inst->config->endpoints[sock->backup].port)
+        port = atoi(r->str);
+    redis_release_socket(r, inst, sock);
+    if (r)
+        freeReplyObject(r);
+    if (c) {
+        /* let the pause run out, and the loser's reply come in */
+        usleep(350000);
+        redisFree(c);
+    }
+    return port;
+}
+
+static void test_hedging(void) {
+    REDIS_ENDPOINT endpoints[2] = { { "127.0.0.1", BASE_PORT, 0 },
+            { "127.0.0.1", BASE_PORT + 1, 0 } };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    redisContext* c;
+    redisReply* r;
+    long long ms;
+    int i, n, ok;
+
+    for (n = 0; n < SERVERS; n++) {
+        if (pids[n] == 0 && !server_up(n))
+            return;
+        if ((c = connect_server(BASE_PORT + n)) == NULL)
+            return;
+        if ((r = redisCommand(c, "SET x %d", BASE_PORT + n)) != NULL)
+            freeReplyObject(r);
+        redisFree(c);
+    }
+
+    init_config(&conf, endpoints, 2);
+    conf.num_redis_socks = 2;
+    conf.max_num_redis_socks = 2;
+    conf.hedge_delay = 20000;
+    conf.hedge_budget = 10;
+    if (redis_pool_create(&conf, &inst) < 0)
+        return;
+
+    test("A stalled read is not hedged before it earned the budget: ");
+    ok = get_x(inst, 1, &ms) > 0;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && ms >= 200 && stats.hedged == 0);
+
+    test("Once nine more reads earned it, it is: ");
+    for (i = 0; i < 9 && ok; i++)
+        ok = get_x(inst, 0, NULL) > 0;
+    ok = ok && get_x(inst, 1, &ms) > 0;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && ms < 200 && stats.hedged == 1 && stats.hedge_wins == 1);
+
+    test("The budget is spent, so the next stalled read is not: ");
+    ok = get_x(inst, 1, &ms) > 0;
+    redis_pool_get_stats(inst, &stats);
+    test_cond(ok && ms >= 200 && stats.hedged == 1);
+
+    test("The loser's late reply reaches no one: ");
+    for (i = 0, ok = 1; i < 20 && ok; i++) {
+        REDIS_SOCKET* sock = redis_get_socket(inst);
+
+        r = sock ? redis_command(sock, inst, "ECHO %d", i) : NULL;
+        ok = r && r->type == REDIS_REPLY_STRING && atoi(r->str) == i;
+        redis_release_socket(r, inst, sock);
+        if (r)
+            freeReplyObject(r);
+    }
+    test_cond(ok);
+
+    redis_pool_destroy(inst);
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    LOG_CONFIG log = { -1, LOG_DEST_FILES, "log/test_pool.log", "test_pool",
+            L_WARN, 1 };
+    log_set_config(&log);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((server = getenv("REDIS_SERVER")) == NULL)
+        server = "redis-server";
+    if (mkdtemp(dir) == NULL || !server_up(0)) {
+        printf("No %s, skipping the pool tests\n", server);
+    } else {
+        test_wait_queue();
+        test_maintenance();
+        test_session();
+        test_endpoint_stats();
+        test_breaker();
+        test_connect_budget();
+        test_mux();
+        test_reserved();
+        test_shedding();
+        test_hedging();
+    }
+    stop_servers();
+
+    printf("%d tests, %d passed, %d failed\n", tests, tests - fails, fails);
+    return fails ? 1 : 0;
+}
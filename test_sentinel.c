@@ -0,0 +1,330 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hiredispool.h"
+#include "log.h"
+#include "hiredis/hiredis.h"
+
+/*
+ * Sentinel mode: a primary, a replica and a sentinel are started from
+ * redis-server, or $REDIS_SERVER, on ports 30011-30013, the sentinel is
+ * told to fail over and the pool must follow it to the new primary.
+ * Without a redis-server that part is skipped.
+ *
+ * usage: test_sentinel.exe
+ */
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+#define PRIMARY_PORT 30011
+#define REPLICA_PORT 30012
+#define SENTINEL_PORT 30013
+
+static char dir[] = "/tmp/test_sentinel.XXXXXX";
+static char sentinel_conf[64];
+static pid_t pids[3];
+
+static pid_t start_server(const char* server, const char** args) {
+    const char* argv[16];
+    pid_t pid;
+    int fd, i;
+
+    argv[0] = server;
+    for (i = 0; args[i]; i++)
+        argv[i + 1] = args[i];
+    argv[i + 1] = NULL;
+    if ((pid = fork()) == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execvp(server, (char**) argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static redisContext* connect_server(int port) {
+    struct timeval tv = { 1, 0 };
+    redisContext* c;
+    redisReply* r;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        c = redisConnectWithTimeout("127.0.0.1", port, tv);
+        if (c && !c->err && (r = redisCommand(c, "PING")) != NULL) {
+            freeReplyObject(r);
+            return c;
+        }
+        if (c)
+            redisFree(c);
+        usleep(100000);
+    }
+    return NULL;
+}
+
+/* Whether the INFO 'section' of a server holds 'field' within 'ms' */
+static int info_has(int port, const char* section, const char* field, int ms) {
+    redisContext* c;
+    redisReply* r;
+    int ok = 0;
+
+    if ((c = connect_server(port)) == NULL)
+        return 0;
+    for (; ms > 0 && !ok; ms -= 100) {
+        r = redisCommand(c, "INFO %s", section);
+        ok = r && r->type == REDIS_REPLY_STRING && strstr(r->str, field);
+        if (r)
+            freeReplyObject(r);
+        if (!ok)
+            usleep(100000);
+    }
+    redisFree(c);
+    return ok;
+}
+
+static int start_servers(const char* server) {
+    char primary[16], replica[16];
+    const char* primary_args[] = { "--port", primary, "--bind", "127.0.0.1",
+            "--dir", dir, "--save", "", "--appendonly", "no", NULL };
+    const char* replica_args[] = { "--port", replica, "--bind", "127.0.0.1",
+            "--dir", dir, "--save", "", "--appendonly", "no",
+            "--replicaof", "127.0.0.1", primary, NULL };
+    const char* sentinel_args[] = { sentinel_conf, "--sentinel", NULL };
+    FILE* f;
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+    snprintf(primary, sizeof(primary), "%d", PRIMARY_PORT);
+    snprintf(replica, sizeof(replica), "%d", REPLICA_PORT);
+    snprintf(sentinel_conf, sizeof(sentinel_conf), "%s/sentinel.conf", dir);
+    if ((f = fopen(sentinel_conf, "w")) == NULL)
+        return 0;
+    fprintf(f, "port %d\n"
+            "bind 127.0.0.1\n"
+            "dir %s\n"
+            "sentinel monitor mymaster 127.0.0.1 %d 1\n"
+            "sentinel down-after-milliseconds mymaster 1000\n"
+            "sentinel failover-timeout mymaster 5000\n", SENTINEL_PORT, dir,
+            PRIMARY_PORT);
+    fclose(f);
+
+    pids[0] = start_server(server, primary_args);
+    pids[1] = start_server(server, replica_args);
+    pids[2] = start_server(server, sentinel_args);
+    if (pids[0] < 0 || pids[1] < 0 || pids[2] < 0)
+        return 0;
+
+    /* the replica in sync, and known to the sentinel */
+    return info_has(REPLICA_PORT, "replication", "master_link_status:up", 10000)
+            && info_has(SENTINEL_PORT, "sentinel", "slaves=1", 10000);
+}
+
+static void stop_servers(void) {
+    char path[128];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    unlink(sentinel_conf);
+    snprintf(path, sizeof(path), "%s/dump.rdb", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static int reply_is(redisReply* r, const char* str) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_STRING && strcmp(r->str, str) == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+static int status_ok(redisReply* r) {
+    int ok;
+
+    ok = r && r->type == REDIS_REPLY_STATUS && strcmp(r->str, "OK") == 0;
+    if (r)
+        freeReplyObject(r);
+    return ok;
+}
+
+/* GET 'key' straight from the server on 'port' */
+static int server_has(int port, const char* key, const char* value) {
+    redisContext* c;
+    int ok;
+
+    if ((c = connect_server(port)) == NULL)
+        return 0;
+    ok = reply_is(redisCommand(c, "GET %s", key), value);
+    redisFree(c);
+    return ok;
+}
+
+/* SET or GET through a socket of the pool */
+static redisReply* pool_command(REDIS_INSTANCE* inst, const char* key,
+        const char* value) {
+    REDIS_SOCKET* sock;
+    redisReply* r;
+
+    if ((sock = redis_get_socket(inst)) == NULL)
+        return NULL;
+    if (value)
+        r = redis_command(sock, inst, "SET %s %s", key, value);
+    else
+        r = redis_command(sock, inst, "GET %s", key);
+    redis_release_socket(r, inst, sock);
+    return r;
+}
+
+static void init_config(REDIS_CONFIG* conf, REDIS_ENDPOINT* sentinel) {
+    memset(conf, 0, sizeof(*conf));
+    conf->sentinels = sentinel;
+    conf->num_sentinels = 1;
+    strcpy(conf->master_name, "mymaster");
+    conf->connect_timeout = 1000;
+    conf->net_readwrite_timeout = 1000;
+    conf->num_redis_socks = 2;
+    conf->max_num_redis_socks = 4;
+    conf->connect_failure_retry_delay = 1;
+}
+
+/* WAIT on a multiplexed socket, with a blocking lane it must not take */
+static void test_wait(void) {
+    REDIS_ENDPOINT primary = { "127.0.0.1", PRIMARY_PORT, 0 };
+    REDIS_POOL_STATS stats;
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+    REDIS_SOCKET* sock;
+    redisReply* r = NULL;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.endpoints = &primary;
+    conf.num_endpoints = 1;
+    conf.connect_timeout = 1000;
+    conf.net_readwrite_timeout = 1000;
+    conf.num_redis_socks = 1;
+    conf.max_num_redis_socks = 2;
+    conf.connect_failure_retry_delay = 1;
+    conf.num_mux_connections = 1;
+    conf.max_blocking_socks = 1;
+
+    test("WAIT goes out where the writes did: ");
+    if (redis_pool_create(&conf, &inst) == 0) {
+        if ((sock = redis_get_socket(inst)) != NULL) {
+            if (status_ok(redis_command(sock, inst, "SET waited 1")))
+                r = redis_command(sock, inst, "WAIT 1 5000");
+            redis_release_socket(r, inst, sock);
+        }
+        redis_pool_get_stats(inst, &stats);
+        redis_pool_destroy(inst);
+    }
+    test_cond(r && r->type == REDIS_REPLY_INTEGER && r->integer == 1
+            && stats.blocking_commands == 0 && stats.mux_pinned == 0);
+    if (r)
+        freeReplyObject(r);
+}
+
+static void test_failover(REDIS_INSTANCE* inst) {
+    REDIS_POOL_STATS stats;
+    redisContext* s;
+    char key[16], value[16];
+    int i, ok;
+
+    test("Writes go to the primary the sentinel reports: ");
+    test_cond(status_ok(pool_command(inst, "before", "1"))
+            && server_has(PRIMARY_PORT, "before", "1"));
+
+    /* may be refused for a while after the sentinel first saw the
+     * replica */
+    test("SENTINEL FAILOVER is accepted: ");
+    s = connect_server(SENTINEL_PORT);
+    for (i = 0, ok = 0; s && i < 50 && !ok; i++) {
+        if (!(ok = status_ok(redisCommand(s, "SENTINEL FAILOVER mymaster"))))
+            usleep(100000);
+    }
+    test_cond(ok);
+    if (s)
+        redisFree(s);
+
+    test("The pool follows +switch-master: ");
+    for (i = 0, ok = 0; i < 150 && !ok; i++) {
+        redis_pool_get_stats(inst, &stats);
+        if (!(ok = stats.failovers == 1))
+            usleep(100000);
+    }
+    test_cond(ok);
+
+    test("The replica is the primary now: ");
+    test_cond(info_has(REPLICA_PORT, "replication", "role:master", 5000));
+
+    test("Writes go to the new primary: ");
+    for (i = 0, ok = 1; i < 20 && ok; i++) {
+        snprintf(key, sizeof(key), "after%d", i);
+        snprintf(value, sizeof(value), "%d", i);
+        ok = status_ok(pool_command(inst, key, value));
+    }
+    test_cond(ok && server_has(REPLICA_PORT, "after0", "0")
+            && server_has(REPLICA_PORT, "after19", "19")
+            && server_has(REPLICA_PORT, "before", "1"));
+
+    test("Reads see them: ");
+    test_cond(reply_is(pool_command(inst, "after19", NULL), "19"));
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    LOG_CONFIG log = { -1, LOG_DEST_FILES, "log/test_sentinel.log",
+            "test_sentinel", L_WARN, 1 };
+    log_set_config(&log);
+    signal(SIGPIPE, SIG_IGN);
+
+    REDIS_ENDPOINT sentinel = { "127.0.0.1", SENTINEL_PORT, 0 };
+    REDIS_CONFIG conf;
+    REDIS_INSTANCE* inst = NULL;
+
+    init_config(&conf, &sentinel);
+    test("No pool without a sentinel that answers: ");
+    test_cond(redis_pool_create(&conf, &inst) < 0);
+
+    conf.master_name[0] = '\0';
+    test("No pool without a master_name: ");
+    test_cond(redis_pool_create(&conf, &inst) < 0);
+
+    const char* server = getenv("REDIS_SERVER");
+    if (server == NULL)
+        server = "redis-server";
+    if (!start_servers(server)) {
+        printf("No sentinel of %s, skipping the failover tests\n", server);
+    } else {
+        test_wait();
+        init_config(&conf, &sentinel);
+        inst = NULL;
+        test("Pool is created through the sentinel: ");
+        test_cond(redis_pool_create(&conf, &inst) == 0);
+        if (inst) {
+            test_failover(inst);
+            redis_pool_destroy(inst);
+        }
+    }
+    stop_servers();
+
+    printf("%d tests, %d passed, %d failed\n", tests, tests - fails, fails);
+    return fails ? 1 : 0;
+}